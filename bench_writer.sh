@@ -0,0 +1,44 @@
+#!/bin/bash
+# Compares the io_uring and pwrite writers on one model. Each run splits the
+# model once per writer, alternating so that both see the same page cache
+# and disk state, and the logged write phase is collected for each writer.
+#
+# Usage: ./bench_writer.sh [model] [runs] [jobs]
+set -euo pipefail
+cd "$(dirname "$0")"
+
+model=${1:-./data/mobilenet_v2.tflite}
+runs=${2:-5}
+jobs=${3:-$(nproc)}
+binary=./build/split_tflite
+if [ ! -x "$binary" ]; then
+  make all
+fi
+
+output=$(mktemp -d)
+trap 'rm -rf "$output"' EXIT
+
+declare -A times
+for ((run = 0; run < runs; ++run)); do
+  for writer in io_uring pwrite; do
+    # "Wrote N operators with <writer> on T threads in S s (R/s)."
+    seconds=$("$binary" --input_file "$model" \
+                        --output_root_folder "$output" \
+                        --jobs "$jobs" \
+                        --writer "$writer" 2>&1 |
+              sed -n "s/.*Wrote .* with $writer on .* in \([0-9.]*\) s .*/\1/p")
+    if [ -z "$seconds" ]; then
+      echo "$writer did not run; see the output of $binary --writer $writer" >&2
+      exit 1
+    fi
+    times[$writer]+="$seconds "
+  done
+done
+
+for writer in io_uring pwrite; do
+  printf '%-8s ' "$writer"
+  tr ' ' '\n' <<< "${times[$writer]}" | sed '/^$/d' | sort -n |
+    awk '{ t[NR] = $1 }
+         END { printf "median %.3f s, min %.3f s, max %.3f s over %d runs\n",
+                      t[int((NR + 1) / 2)], t[1], t[NR], NR }'
+done
@@ -0,0 +1,38 @@
+#pragma once
+
+// Only compiled into `make ALLOC_STATS=1` builds: every allocation of every
+// thread bumps one shared counter, which production runs should not pay for.
+#ifdef SPLIT_TFLITE_ALLOC_STATS
+
+#include <atomic>   // std::atomic
+#include <cstddef>  // size_t
+#include <cstdlib>  // std::malloc std::free
+#include <new>      // std::bad_alloc
+
+// Global count of operator new calls, used to report allocation behaviour of
+// the unpack and split phases.
+namespace detail {
+std::atomic<size_t> allocation_count{0};
+}  // namespace detail
+
+size_t allocation_count() {
+  return detail::allocation_count.load(std::memory_order_relaxed);
+}
+
+void* operator new(size_t size) {
+  detail::allocation_count.fetch_add(1, std::memory_order_relaxed);
+  if (void* p = std::malloc(size == 0 ? 1 : size)) {
+    return p;
+  }
+  throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept {
+  std::free(p);
+}
+
+void operator delete(void* p, size_t) noexcept {
+  std::free(p);
+}
+
+#endif  // SPLIT_TFLITE_ALLOC_STATS
@@ -0,0 +1,170 @@
+#pragma once
+
+#include <cstddef>   // size_t
+#include <cstdint>   // int32_t
+#include <cstring>   // std::memcpy
+#include <optional>  // std::optional
+#include <utility>   // std::move
+#include <vector>    // std::vector
+
+#include "def.h"
+#include "log.h"
+#include "schema.h"
+#include "shapes.h"
+#include "tflite_generated.hpp"
+
+// Batch size rewriting. tflite keeps the batch as the leading dimension of
+// the model's inputs, so every input of subgraph 0 of rank 2 or more gets
+// the new batch and shape inference carries it through the activations.
+// Inputs of rank 1, such as a sequence length, and the inputs of control
+// flow subgraphs, such as loop counters, are not batched and stay as they
+// are. Constant shapes fed to RESHAPE that lead with the old batch, where
+// the reshaped tensor comes from a batched input and leads with its batch,
+// are rewritten alongside; weights and other constants stay as they are.
+
+namespace detail {
+
+bool holds_data(const tflite::ModelT& model_table,
+                const tflite::TensorT& tensor) {
+  return tensor.buffer < model_table.buffers.size() &&
+         !model_table.buffers[tensor.buffer]->data.empty();
+}
+
+// For every tensor of subgraph 0 reached from a batched input, the batch
+// that input had, or 0 for tensors no batched input reaches. Operators are
+// stored in execution order, so one pass follows every path.
+std::vector<int32_t> input_batches(const tflite::ModelT& model_table) {
+  const tflite::SubGraphT& subgraph = *model_table.subgraphs[0];
+  std::vector<int32_t> batches(subgraph.tensors.size(), 0);
+  for (int32_t input : subgraph.inputs) {
+    if (input < 0 || holds_data(model_table, *subgraph.tensors[input])) {
+      continue;
+    }
+    const tflite::TensorT& tensor = *subgraph.tensors[input];
+    std::optional<Shape> stored = stored_shape(tensor);
+    if (stored.has_value() && stored->size() >= 2) {
+      // a dynamic batch is stored as 1 in `shape`
+      batches[input] = tensor.shape.empty() ? (*stored)[0] : tensor.shape[0];
+    }
+  }
+  for (const PtrType<tflite::OperatorT>& op : subgraph.operators) {
+    int32_t from = 0;
+    for (int32_t input : op->inputs) {
+      if (input >= 0 && batches[input] != 0) {
+        from = batches[input];
+        break;
+      }
+    }
+    for (int32_t output : op->outputs) {
+      if (from != 0 && output >= 0 && batches[output] == 0) {
+        batches[output] = from;
+      }
+    }
+  }
+  return batches;
+}
+
+// Points a RESHAPE whose target leads with `from` at a copy that leads with
+// `to`. Returns whether it did.
+bool rebatch_reshape(tflite::ModelT& model_table,
+                     tflite::SubGraphT& subgraph,
+                     tflite::OperatorT& op,
+                     int32_t from,
+                     int32_t to) {
+  bool changed = false;
+  if (tflite::ReshapeOptionsT* o = op.builtin_options.AsReshapeOptions();
+      o != nullptr && !o->new_shape.empty() && o->new_shape[0] == from) {
+    o->new_shape[0] = to;
+    changed = true;
+  }
+  if (op.inputs.size() < 2 || op.inputs[1] < 0) {
+    return changed;
+  }
+  const tflite::TensorT& target = *subgraph.tensors[op.inputs[1]];
+  std::optional<std::vector<int32_t>> dims =
+      constant_ints(model_table, subgraph, op, 1);
+  if (target.type != tflite::TensorType::INT32 || !dims.has_value() ||
+      dims->empty() || (*dims)[0] != from) {
+    return changed;
+  }
+  (*dims)[0] = to;
+
+  // a new tensor, as the target may be shared with other operators
+  auto buffer = make_ptr<tflite::BufferT>();
+  buffer->data.resize(dims->size() * sizeof(int32_t));
+  std::memcpy(buffer->data.data(), dims->data(), buffer->data.size());
+  model_table.buffers.emplace_back(std::move(buffer));
+  auto tensor = make_ptr<tflite::TensorT>(target);
+  tensor->name += "_batch";
+  tensor->buffer = model_table.buffers.size() - 1;
+  subgraph.tensors.emplace_back(std::move(tensor));
+  op.inputs[1] = subgraph.tensors.size() - 1;
+  return true;
+}
+
+}  // namespace detail
+
+// Sets the batch of every batched input of subgraph 0 to `batch` and lets
+// shape inference carry it through the activations. Returns the number of
+// tensors whose shape changed.
+size_t set_batch(tflite::ModelT& model_table, int32_t batch) {
+  if (model_table.subgraphs.empty()) {
+    return 0;
+  }
+  tflite::SubGraphT& subgraph = *model_table.subgraphs[0];
+  const std::vector<int32_t> from = detail::input_batches(model_table);
+  size_t inputs = 0, reshapes = 0;
+  // before the inputs change, so a RESHAPE of an input sees its old batch
+  for (const PtrType<tflite::OperatorT>& op : subgraph.operators) {
+    if (builtin_code(*model_table.operator_codes[op->opcode_index]) !=
+            tflite::BuiltinOperator::RESHAPE ||
+        op->inputs.empty() || op->inputs[0] < 0) {
+      continue;
+    }
+    const int32_t old_batch = from[op->inputs[0]];
+    const tflite::TensorT& data = *subgraph.tensors[op->inputs[0]];
+    if (old_batch != 0 && old_batch != batch && !data.shape.empty() &&
+        data.shape[0] == old_batch) {
+      reshapes += detail::rebatch_reshape(
+          model_table, subgraph, *op, old_batch, batch);
+    }
+  }
+
+  for (int32_t input : subgraph.inputs) {
+    if (input < 0 || from[input] == 0 || from[input] == batch) {
+      continue;
+    }
+    tflite::TensorT& tensor = *subgraph.tensors[input];
+    if (!tensor.shape.empty()) {
+      tensor.shape[0] = batch;
+    }
+    if (!tensor.shape_signature.empty()) {
+      tensor.shape_signature[0] = batch;
+    }
+    ++inputs;
+  }
+
+  ShapeInference inference = infer_shapes(model_table, true);
+  log_info("Set the batch of {} inputs to {}, {} reshape targets rewritten.",
+           inputs,
+           batch,
+           reshapes);
+  report_shapes(model_table, inference);
+
+  // past an operator shape inference has no rule for, the stored shape
+  // stands, and the batch may not have reached it
+  size_t stale = 0;
+  for (size_t t = 0; t < from.size(); ++t) {
+    const tflite::TensorT& tensor = *subgraph.tensors[t];
+    if (from[t] > 1 && from[t] != batch && !tensor.shape.empty() &&
+        tensor.shape[0] == from[t]) {
+      ++stale;
+    }
+  }
+  if (stale > 0) {
+    log_warning("{} activations reached from the inputs still lead with the "
+                "old batch.",
+                stale);
+  }
+  return inputs + inference.changed;
+}
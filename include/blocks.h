@@ -0,0 +1,230 @@
+#pragma once
+
+#include <algorithm>      // std::min std::fill std::fill_n
+#include <cstddef>        // size_t
+#include <cstdint>        // int32_t uint64_t
+#include <functional>     // std::hash
+#include <string>         // std::string
+#include <unordered_map>  // std::unordered_map
+#include <utility>        // std::pair
+#include <vector>         // std::vector
+
+#include <fmt/format.h>
+
+#include "buffered_output.h"
+#include "def.h"
+#include "summary.h"
+#include "tflite_generated.hpp"
+#include "unique.h"
+
+// Detection of repeated blocks: runs of consecutive operators that recur
+// with the same configuration and the same wiring, like the layers of a
+// transformer or the residual blocks of a ResNet.
+//
+// Every operator becomes a token made of its configuration class (see
+// unique.h) and, for every input, the distance back to the operator that
+// produces it and the output slot, or a mark for constants and subgraph
+// inputs. Two runs of tokens that are equal compute the same thing on
+// differently weighted tensors. The search repeatedly takes the run length
+// and token sequence whose non-overlapping repetitions cover the most
+// operators beyond the first occurrence, then excludes those operators,
+// until nothing repeats.
+
+struct BlockType {
+  size_t subgraph_index = 0;
+  size_t length = 0;
+  std::vector<size_t> starts;  // first operator of every occurrence
+};
+
+struct BlockCatalog {
+  std::vector<BlockType> blocks;
+  // block type of every operator, -1 outside blocks, by subgraph
+  std::vector<std::vector<int32_t>> block_of;
+};
+
+fs::path block_file_name(const fs::path& model_name,
+                         size_t subgraph_index,
+                         size_t block_index) {
+  return fmt::format(
+      "{}_{}_block{}.tflite", model_name.string(), subgraph_index, block_index);
+}
+
+namespace detail {
+
+// Tokens of the operators of a subgraph, as strings and their hashes.
+void operator_tokens(const tflite::SubGraphT& subgraph,
+                     const std::vector<uint32_t>& classes,
+                     std::vector<std::string>& tokens,
+                     std::vector<uint64_t>& hashes) {
+  // producing operator and output slot of every tensor
+  std::vector<std::pair<int32_t, int32_t>> producers(subgraph.tensors.size(),
+                                                     {-1, -1});
+  tokens.assign(subgraph.operators.size(), std::string());
+  hashes.resize(subgraph.operators.size());
+  for (size_t i = 0; i < subgraph.operators.size(); ++i) {
+    const tflite::OperatorT& op = *subgraph.operators[i];
+    std::string& token = tokens[i];
+    append(token, classes[i]);
+    for (int32_t input : op.inputs) {
+      auto [producer, slot] =
+          input < 0 ? std::pair(-1, -1) : producers[input];
+      append(token, producer < 0 ? -1 : static_cast<int32_t>(i) - producer);
+      append(token, slot);
+    }
+    for (size_t slot = 0; slot < op.outputs.size(); ++slot) {
+      if (op.outputs[slot] >= 0) {
+        producers[op.outputs[slot]] = {static_cast<int32_t>(i),
+                                       static_cast<int32_t>(slot)};
+      }
+    }
+    hashes[i] = std::hash<std::string>()(token);
+  }
+}
+
+// Blocks of one subgraph, appended to `blocks`.
+void find_blocks(size_t subgraph_index,
+                 const std::vector<std::string>& tokens,
+                 const std::vector<uint64_t>& hashes,
+                 size_t min_length,
+                 size_t max_length,
+                 std::vector<BlockType>& blocks) {
+  const size_t n = tokens.size();
+  constexpr uint64_t base = 0x100000001b3;
+  // polynomial prefix hashes modulo 2^64, so any window hashes in O(1)
+  std::vector<uint64_t> prefix(n + 1, 0), powers(n + 1, 1);
+  for (size_t i = 0; i < n; ++i) {
+    prefix[i + 1] = prefix[i] * base + hashes[i];
+    powers[i + 1] = powers[i] * base;
+  }
+  std::vector<bool> covered(n, false);
+  std::vector<size_t> covered_prefix(n + 1, 0);
+  std::unordered_map<uint64_t, std::vector<size_t>> windows;
+
+  for (;;) {
+    for (size_t i = 0; i < n; ++i) {
+      covered_prefix[i + 1] = covered_prefix[i] + covered[i];
+    }
+    size_t best_score = 0, best_length = 0;
+    std::vector<size_t> best_starts;
+    for (size_t length = min_length; length <= std::min(max_length, n / 2);
+         ++length) {
+      windows.clear();
+      for (size_t p = 0; p + length <= n; ++p) {
+        if (covered_prefix[p + length] == covered_prefix[p]) {
+          windows[prefix[p + length] - prefix[p] * powers[length]]
+              .emplace_back(p);
+        }
+      }
+      for (const auto& [hash, starts] : windows) {
+        size_t count = 0;
+        for (size_t i = 0, end = 0; i < starts.size(); ++i) {
+          if (starts[i] >= end) {
+            ++count;
+            end = starts[i] + length;
+          }
+        }
+        if (count >= 2 && length * (count - 1) > best_score) {
+          best_score = length * (count - 1);
+          best_length = length;
+          best_starts = starts;
+        }
+      }
+    }
+    if (best_score == 0) {
+      break;
+    }
+
+    // the hashes only proposed the block, the tokens decide
+    BlockType block{subgraph_index, best_length, {}};
+    auto same = [&](size_t a, size_t b) {
+      for (size_t i = 0; i < best_length; ++i) {
+        if (tokens[a + i] != tokens[b + i]) {
+          return false;
+        }
+      }
+      return true;
+    };
+    for (size_t start : best_starts) {
+      if ((block.starts.empty() ||
+           start >= block.starts.back() + best_length) &&
+          (block.starts.empty() || same(block.starts.front(), start))) {
+        block.starts.emplace_back(start);
+      }
+    }
+    for (size_t start : block.starts) {
+      std::fill(covered.begin() + start,
+                covered.begin() + start + best_length,
+                true);
+    }
+    if (block.starts.size() >= 2) {
+      blocks.emplace_back(std::move(block));
+    }
+  }
+}
+
+}  // namespace detail
+
+// Finds the repeated blocks of every subgraph, of `min_length` to
+// `max_length` operators. `catalog` classifies the operators.
+BlockCatalog find_repeated_blocks(const tflite::ModelT& model_table,
+                                  const OperatorCatalog& catalog,
+                                  size_t min_length = 2,
+                                  size_t max_length = 256) {
+  BlockCatalog result;
+  std::vector<std::string> tokens;
+  std::vector<uint64_t> hashes;
+  result.block_of.resize(model_table.subgraphs.size());
+  for (size_t subgraph_index = 0; subgraph_index < model_table.subgraphs.size();
+       ++subgraph_index) {
+    const tflite::SubGraphT& subgraph = *model_table.subgraphs[subgraph_index];
+    detail::operator_tokens(
+        subgraph, catalog.class_of[subgraph_index], tokens, hashes);
+    size_t first = result.blocks.size();
+    detail::find_blocks(
+        subgraph_index, tokens, hashes, min_length, max_length, result.blocks);
+
+    result.block_of[subgraph_index].assign(subgraph.operators.size(), -1);
+    for (size_t b = first; b < result.blocks.size(); ++b) {
+      for (size_t start : result.blocks[b].starts) {
+        std::fill_n(result.block_of[subgraph_index].begin() + start,
+                    result.blocks[b].length,
+                    static_cast<int32_t>(b));
+      }
+    }
+  }
+  return result;
+}
+
+// Writes <model>.blocks.json: every block type with its length, count, file
+// and occurrences, then the block type of every operator.
+void save_block_map(const BlockCatalog& catalog,
+                    const fs::path& model_name,
+                    const fs::path& model_folder) {
+  fs::path map_path = model_folder / (model_name.string() + ".blocks.json");
+  detail::FilePtr file = detail::open_for_writing(map_path);
+  BufferedOutput out(file.get());
+
+  out.print("{{\n\"version\": {},\n\"model\": ", summary_version);
+  detail::print_json_string(out, model_name.string());
+  out.print(",\n\"blocks\": [");
+  for (size_t i = 0; i < catalog.blocks.size(); ++i) {
+    const BlockType& block = catalog.blocks[i];
+    out.print("{}\n{{\"block\": {}, \"subgraph\": {}, \"length\": {}, "
+              "\"count\": {}, \"file\": ",
+              i == 0 ? "" : ",",
+              i,
+              block.subgraph_index,
+              block.length,
+              block.starts.size());
+    detail::print_json_string(
+        out, block_file_name(model_name, block.subgraph_index, i).string());
+    out.print(", \"starts\": [{}]}}", fmt::join(block.starts, ", "));
+  }
+  out.print("],\n\"operator_blocks\": [");
+  for (size_t i = 0; i < catalog.block_of.size(); ++i) {
+    out.print("{}\n[{}]",
+              i == 0 ? "" : ",",
+              fmt::join(catalog.block_of[i], ", "));
+  }
+  out.print("]\n}}\n");
+}
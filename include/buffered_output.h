@@ -0,0 +1,93 @@
+#pragma once
+
+#include <algorithm>    // std::ranges::none_of
+#include <cerrno>       // errno
+#include <cstddef>      // size_t
+#include <cstdio>       // std::FILE std::fopen std::fclose std::fwrite
+#include <cstring>      // std::strerror
+#include <iterator>     // std::back_inserter
+#include <memory>       // std::unique_ptr
+#include <string_view>  // std::string_view
+#include <utility>      // std::forward
+
+#include <fmt/format.h>
+
+#include "def.h"
+#include "log.h"
+
+// Formats into a memory buffer and hands it to stdio in large blocks, so a
+// summary of many thousands of operators costs a handful of writes.
+class BufferedOutput {
+ public:
+  explicit BufferedOutput(std::FILE* file) : file_(file) {}
+
+  BufferedOutput(const BufferedOutput&) = delete;
+  BufferedOutput& operator=(const BufferedOutput&) = delete;
+
+  ~BufferedOutput() {
+    flush();
+  }
+
+  template <typename... Args>
+  void print(fmt::format_string<Args...> fmt_str, Args&&... args) {
+    fmt::format_to(
+        std::back_inserter(buffer_), fmt_str, std::forward<Args>(args)...);
+    if (buffer_.size() >= flush_size) {
+      flush();
+    }
+  }
+
+  // Appends raw bytes, for binary formats.
+  void write(const void* data, size_t size) {
+    const char* bytes = static_cast<const char*>(data);
+    buffer_.append(bytes, bytes + size);
+    if (buffer_.size() >= flush_size) {
+      flush();
+    }
+  }
+
+  void flush() {
+    std::fwrite(buffer_.data(), 1, buffer_.size(), file_);
+    buffer_.clear();
+  }
+
+ private:
+  static constexpr size_t flush_size = 1 << 16;
+
+  std::FILE* file_;
+  fmt::memory_buffer buffer_;
+};
+
+namespace detail {
+
+using FilePtr = std::unique_ptr<std::FILE, decltype(&std::fclose)>;
+
+FilePtr open_for_writing(const fs::path& path) {
+  FilePtr file(std::fopen(path.c_str(), "wb"), &std::fclose);
+  if (file == nullptr) {
+    log_fatal("Cannot open {}: {}.", path.string(), std::strerror(errno));
+  }
+  return file;
+}
+
+void print_json_string(BufferedOutput& out, std::string_view text) {
+  if (std::ranges::none_of(text, [](char c) {
+        return c == '"' || c == '\\' || static_cast<unsigned char>(c) < 0x20;
+      })) {
+    out.print("\"{}\"", text);
+    return;
+  }
+  out.print("\"");
+  for (char c : text) {
+    if (c == '"' || c == '\\') {
+      out.print("\\{}", c);
+    } else if (static_cast<unsigned char>(c) < 0x20) {
+      out.print("\\u{:04x}", static_cast<unsigned>(c));
+    } else {
+      out.print("{}", c);
+    }
+  }
+  out.print("\"");
+}
+
+}  // namespace detail
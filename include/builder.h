@@ -0,0 +1,145 @@
+#pragma once
+
+#include <algorithm>           // std::lower_bound std::max
+#include <condition_variable>  // std::condition_variable
+#include <cstddef>             // size_t
+#include <cstdint>             // uint8_t
+#include <memory>              // std::unique_ptr std::make_unique_for_overwrite
+#include <mutex>               // std::mutex std::unique_lock
+#include <optional>            // std::optional
+#include <unordered_map>       // std::unordered_map
+#include <utility>             // std::pair
+#include <vector>              // std::vector
+
+#include "tflite_generated.hpp"
+
+// Allocator that keeps the blocks it gets back and reuses the smallest
+// retained block that is large enough. At most `max_retained` bytes are
+// kept: a larger block goes back to the system as soon as it is released,
+// and the largest retained ones go when the total would exceed the cap. Only
+// the owning worker allocates and releases, so it needs no locking.
+class ArenaAllocator : public flatbuffers::Allocator {
+ public:
+  explicit ArenaAllocator(size_t max_retained) : max_retained_(max_retained) {}
+
+  uint8_t* allocate(size_t size) override {
+    auto it = std::lower_bound(
+        free_blocks_.begin(),
+        free_blocks_.end(),
+        size,
+        [](const Block& block, size_t size) { return block.second < size; });
+    Block block;
+    if (it == free_blocks_.end()) {
+      block = {std::make_unique_for_overwrite<uint8_t[]>(size), size};
+    } else {
+      block = std::move(*it);
+      free_blocks_.erase(it);
+      retained_ -= block.second;
+    }
+    uint8_t* p = block.first.get();
+    used_blocks_.emplace(p, std::move(block));
+    return p;
+  }
+
+  void deallocate(uint8_t* p, size_t) override {
+    auto used = used_blocks_.find(p);
+    Block block = std::move(used->second);
+    used_blocks_.erase(used);
+    if (block.second > max_retained_) {
+      return;
+    }
+    auto it = std::lower_bound(
+        free_blocks_.begin(),
+        free_blocks_.end(),
+        block.second,
+        [](const Block& block, size_t size) { return block.second < size; });
+    retained_ += block.second;
+    free_blocks_.insert(it, std::move(block));
+    while (retained_ > max_retained_) {
+      retained_ -= free_blocks_.back().second;
+      free_blocks_.pop_back();
+    }
+  }
+
+ private:
+  using Block = std::pair<std::unique_ptr<uint8_t[]>, size_t>;
+
+  size_t max_retained_;
+  size_t retained_ = 0;
+  std::unordered_map<uint8_t*, Block> used_blocks_;
+  std::vector<Block> free_blocks_;  // sorted by size
+};
+
+// A worker's set of reusable builders. A builder stays leased while the
+// output writer still reads its buffer, and is cleared, not freed, when it is
+// handed out again, unless it is far larger than needed and over
+// `max_retained` bytes, like the one that wrote the whole model.
+class BuilderPool {
+ public:
+  explicit BuilderPool(size_t max_builders = 4,
+                       size_t max_retained = size_t{64} << 20)
+      : allocator_(max_retained),
+        slots_(max_builders),
+        max_retained_(max_retained) {}
+
+  BuilderPool(const BuilderPool&) = delete;
+  BuilderPool& operator=(const BuilderPool&) = delete;
+
+  // Returns a cleared builder whose buffer is reserved for at least
+  // `size_hint` bytes, so serialization does not reallocate on the way.
+  flatbuffers::FlatBufferBuilder* acquire(size_t size_hint) {
+    Slot* slot = nullptr;
+    {
+      std::unique_lock lock(mutex_);
+      released_.wait(lock, [&]() {
+        for (Slot& candidate : slots_) {
+          if (!candidate.leased) {
+            slot = &candidate;
+            return true;
+          }
+        }
+        return false;
+      });
+      slot->leased = true;
+    }
+
+    // dropped on the acquiring worker, the allocator's only user
+    if (slot->builder.has_value() && slot->capacity >= size_hint &&
+        slot->capacity <= std::max(size_hint, max_retained_)) {
+      slot->builder->Clear();
+    } else {
+      slot->builder.reset();
+      slot->builder.emplace(size_hint, &allocator_, false);
+      slot->capacity = size_hint;
+    }
+    return &*slot->builder;
+  }
+
+  // Called by the writer, possibly on its own thread, once the builder's
+  // buffer is no longer needed.
+  void release(flatbuffers::FlatBufferBuilder* builder) {
+    {
+      std::lock_guard lock(mutex_);
+      for (Slot& slot : slots_) {
+        if (slot.builder.has_value() && &*slot.builder == builder) {
+          slot.capacity = std::max<size_t>(slot.capacity, builder->GetSize());
+          slot.leased = false;
+        }
+      }
+    }
+    released_.notify_one();
+  }
+
+ private:
+  struct Slot {
+    std::optional<flatbuffers::FlatBufferBuilder> builder;
+    size_t capacity = 0;
+    bool leased = false;
+  };
+
+  ArenaAllocator allocator_;
+  std::vector<Slot> slots_;
+  size_t max_retained_;
+  std::mutex mutex_;
+  std::condition_variable released_;
+};
@@ -0,0 +1,291 @@
+#pragma once
+
+#include <immintrin.h>
+
+#include <algorithm>  // std::clamp std::max std::min std::ranges::sort
+#include <cmath>      // std::ceil std::exp2 std::isfinite std::log2
+#include <cstddef>    // size_t
+#include <cstdint>    // int32_t uint64_t
+#include <limits>     // std::numeric_limits
+#include <optional>   // std::optional
+#include <utility>    // std::pair
+#include <vector>     // std::vector
+
+#include <fmt/format.h>
+
+#include "buffered_output.h"
+#include "def.h"
+#include "executor.h"
+#include "image.h"
+#include "log.h"
+#include "parallel.h"
+#include "summary.h"
+#include "tflite_generated.hpp"
+
+// Calibration records the range of every float activation of the main
+// subgraph over a set of sample inputs, run on the reference executor, as
+// full-integer quantization needs it. Each thread runs its own copy of the
+// model on a share of the samples and keeps its own statistics; they are
+// merged once at the end.
+//
+// The histogram of a tensor spans [-range, range] in a power of two number
+// of bins, with range a power of two. When a value falls outside, the range
+// doubles and neighbouring bins merge in pairs, so histograms of different
+// threads and samples add up exactly at the coarser of their ranges.
+
+namespace detail {
+
+std::pair<float, float> min_max_scalar(const float* in, size_t n) {
+  float low = std::numeric_limits<float>::infinity(), high = -low;
+  for (size_t i = 0; i < n; ++i) {
+    low = std::min(low, in[i]);
+    high = std::max(high, in[i]);
+  }
+  return {low, high};
+}
+
+[[gnu::target("avx2")]] std::pair<float, float> min_max_avx2(const float* in,
+                                                             size_t n) {
+  __m256 low = _mm256_set1_ps(std::numeric_limits<float>::infinity());
+  __m256 high = _mm256_set1_ps(-std::numeric_limits<float>::infinity());
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    const __m256 x = _mm256_loadu_ps(in + i);
+    low = _mm256_min_ps(low, x);
+    high = _mm256_max_ps(high, x);
+  }
+  alignas(32) float lows[8], highs[8];
+  _mm256_store_ps(lows, low);
+  _mm256_store_ps(highs, high);
+  auto [tail_low, tail_high] = min_max_scalar(in + i, n - i);
+  return {std::min(*std::min_element(lows, lows + 8), tail_low),
+          std::max(*std::max_element(highs, highs + 8), tail_high)};
+}
+
+std::pair<float, float> min_max(const float* in, size_t n) {
+  static const auto kernel = [] {
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2") ? min_max_avx2 : min_max_scalar;
+  }();
+  return kernel(in, n);
+}
+
+}  // namespace detail
+
+struct TensorStats {
+  int32_t tensor_index = -1;
+  float min = std::numeric_limits<float>::infinity();
+  float max = -std::numeric_limits<float>::infinity();
+  uint64_t count = 0;
+  float range = 0.0f;  // the histogram covers [-range, range]
+  std::vector<uint64_t> histogram;
+
+  void add(const float* data, size_t n) {
+    if (n == 0) {
+      return;
+    }
+    auto [low, high] = detail::min_max(data, n);
+    min = std::min(min, low);
+    max = std::max(max, high);
+    count += n;
+    widen(std::max(-low, high));
+    const size_t bins = histogram.size();
+    const float scale = bins / (2 * range);
+    for (size_t i = 0; i < n; ++i) {
+      if (std::isfinite(data[i])) {
+        size_t bin = static_cast<size_t>((data[i] + range) * scale);
+        ++histogram[std::min(bin, bins - 1)];
+      }
+    }
+  }
+
+  void merge(const TensorStats& other) {
+    if (other.count == 0) {
+      return;
+    }
+    min = std::min(min, other.min);
+    max = std::max(max, other.max);
+    count += other.count;
+    widen(other.range);
+    const size_t factor = range / other.range, half = histogram.size() / 2;
+    for (size_t k = 0; k < other.histogram.size(); ++k) {
+      histogram[(k + (factor - 1) * half) / factor] += other.histogram[k];
+    }
+  }
+
+ private:
+  // Grows the range to a power of two of at least `abs_max`.
+  void widen(float abs_max) {
+    if (!std::isfinite(abs_max)) {
+      abs_max = std::numeric_limits<float>::max() / 2;
+    }
+    if (range == 0.0f) {
+      range = std::exp2(std::ceil(std::log2(std::max(abs_max, 0x1p-20f))));
+      return;
+    }
+    size_t factor = 1;
+    while (range * factor < abs_max) {
+      factor *= 2;
+    }
+    if (factor == 1) {
+      return;
+    }
+    // bin k of the old range lands in bin (k + (factor - 1) * bins / 2) /
+    // factor; with both powers of two no old bin straddles two new ones
+    std::vector<uint64_t> widened(histogram.size(), 0);
+    const size_t half = histogram.size() / 2;
+    for (size_t k = 0; k < histogram.size(); ++k) {
+      widened[(k + (factor - 1) * half) / factor] += histogram[k];
+    }
+    histogram = std::move(widened);
+    range *= factor;
+  }
+};
+
+struct Calibration {
+  size_t samples = 0;
+  std::vector<TensorStats> tensors;  // float activations of subgraph 0
+};
+
+// PNG files of a folder, in name order.
+std::vector<fs::path> calibration_inputs(const fs::path& folder) {
+  std::vector<fs::path> inputs;
+  for (const fs::directory_entry& entry : fs::directory_iterator(folder)) {
+    if (entry.is_regular_file() && entry.path().extension() == ".png") {
+      inputs.emplace_back(entry.path());
+    }
+  }
+  std::ranges::sort(inputs);
+  return inputs;
+}
+
+// Runs the main subgraph on every input on up to `jobs` threads and
+// collects the statistics of its float activations, inputs included, with
+// `bins` histogram bins, a power of two.
+Calibration calibrate(const tflite::ModelT& model_table,
+                      const std::vector<fs::path>& inputs,
+                      size_t bins,
+                      size_t jobs) {
+  Calibration calibration;
+  if (model_table.subgraphs.empty() ||
+      model_table.subgraphs[0]->inputs.size() != 1) {
+    log_error("Calibration needs a main subgraph with exactly one input.");
+    return calibration;
+  }
+  const tflite::SubGraphT& subgraph = *model_table.subgraphs[0];
+  const tflite::TensorT& input = *subgraph.tensors[subgraph.inputs[0]];
+  if (input.type != tflite::TensorType::FLOAT32) {
+    log_error("Input {} is {}, calibration needs a float input.",
+              input.name,
+              tflite::EnumNameTensorType(input.type));
+    return calibration;
+  }
+
+  // slot of every tracked tensor in the statistics, -1 if untracked
+  std::vector<int32_t> slot(subgraph.tensors.size(), -1);
+  for (size_t t = 0; t < subgraph.tensors.size(); ++t) {
+    const tflite::TensorT& tensor = *subgraph.tensors[t];
+    if (tensor.type == tflite::TensorType::FLOAT32 &&
+        (tensor.buffer >= model_table.buffers.size() ||
+         model_table.buffers[tensor.buffer]->data.empty())) {
+      slot[t] = calibration.tensors.size();
+      TensorStats& stats = calibration.tensors.emplace_back();
+      stats.tensor_index = t;
+      stats.histogram.assign(bins, 0);
+    }
+  }
+
+  jobs = std::max<size_t>(std::min(jobs, inputs.size()), 1);
+  std::vector<std::optional<ModelRunner>> runners(jobs);
+  std::vector<Calibration> partial(jobs, calibration);
+  parallel_for(inputs.size(), jobs, [&](size_t index, size_t worker) {
+    std::optional<TensorValue> value = image_input(inputs[index], input.shape);
+    if (!value.has_value()) {
+      return;
+    }
+    if (!runners[worker].has_value()) {
+      runners[worker].emplace(model_table);
+    }
+    ModelRunner& runner = *runners[worker];
+    std::vector<TensorStats>& stats = partial[worker].tensors;
+    auto record = [&](int32_t tensor_index) {
+      if (tensor_index >= 0 && slot[tensor_index] >= 0 &&
+          runner.value(tensor_index).has_value()) {
+        const std::vector<float>& data = runner.value(tensor_index)->data;
+        stats[slot[tensor_index]].add(data.data(), data.size());
+      }
+    };
+    runner.set_input(0, std::move(*value));
+    record(subgraph.inputs[0]);
+    runner.run([](size_t) {},
+               [&](size_t operator_index) {
+                 for (int32_t output :
+                      subgraph.operators[operator_index]->outputs) {
+                   record(output);
+                 }
+               });
+    ++partial[worker].samples;
+  });
+
+  for (const Calibration& part : partial) {
+    calibration.samples += part.samples;
+    for (size_t i = 0; i < part.tensors.size(); ++i) {
+      calibration.tensors[i].merge(part.tensors[i]);
+    }
+  }
+  return calibration;
+}
+
+// Records the calibrated ranges as the min and max of the quantization
+// parameters of the tensors, where the tflite quantizer reads them.
+void apply_calibration(tflite::ModelT& model_table,
+                       const Calibration& calibration) {
+  tflite::SubGraphT& subgraph = *model_table.subgraphs[0];
+  for (const TensorStats& stats : calibration.tensors) {
+    if (stats.count == 0) {
+      continue;
+    }
+    tflite::TensorT& tensor = *subgraph.tensors[stats.tensor_index];
+    if (tensor.quantization == nullptr) {
+      tensor.quantization = make_ptr<tflite::QuantizationParametersT>();
+    }
+    tensor.quantization->min = {stats.min};
+    tensor.quantization->max = {stats.max};
+  }
+}
+
+// Writes <model>.calibration.json: the range, element count and histogram
+// of every calibrated tensor. Bin k of a histogram counts the values in
+// [-range + k * w, -range + (k + 1) * w), w = 2 * range / bins.
+void save_calibration(const tflite::ModelT& model_table,
+                      const Calibration& calibration,
+                      const fs::path& model_name,
+                      const fs::path& folder) {
+  detail::FilePtr file = detail::open_for_writing(
+      folder / (model_name.string() + ".calibration.json"));
+  BufferedOutput out(file.get());
+  const tflite::SubGraphT& subgraph = *model_table.subgraphs[0];
+  out.print("{{\n\"version\": {},\n\"model\": ", summary_version);
+  detail::print_json_string(out, model_name.string());
+  out.print(",\n\"samples\": {},\n\"tensors\": [", calibration.samples);
+  bool first = true;
+  for (const TensorStats& stats : calibration.tensors) {
+    if (stats.count == 0) {
+      continue;
+    }
+    out.print("{}\n{{\"subgraph\": 0, \"tensor\": {}, \"name\": ",
+              first ? "" : ",",
+              stats.tensor_index);
+    first = false;
+    detail::print_json_string(out,
+                              subgraph.tensors[stats.tensor_index]->name);
+    out.print(", \"min\": {}, \"max\": {}, \"count\": {}, \"range\": {}, "
+              "\"histogram\": [{}]}}",
+              stats.min,
+              stats.max,
+              stats.count,
+              stats.range,
+              fmt::join(stats.histogram, ", "));
+  }
+  out.print("]\n}}\n");
+}
@@ -0,0 +1,139 @@
+#pragma once
+
+#include <algorithm>    // std::ranges::sort
+#include <chrono>       // std::chrono::steady_clock
+#include <cstddef>      // size_t
+#include <cstdint>      // uint32_t uint64_t
+#include <cstring>      // std::memcmp
+#include <functional>   // std::hash
+#include <string_view>  // std::string_view
+#include <vector>       // std::vector
+
+#include "def.h"
+#include "log.h"
+#include "parallel.h"
+#include "tflite_generated.hpp"
+
+// Merging of byte-identical buffers, such as tied weights, repeated shape
+// constants and zero biases. Buffers are hashed in parallel, candidates
+// with the same size and hash are compared byte for byte, and every tensor
+// of a duplicate moves to the first buffer holding the bytes. Duplicates
+// keep their index but not their data, as in release_unread_buffers, so
+// nothing else needs renumbering.
+
+namespace detail {
+
+// Buffers that may be merged: holding data, and read by neither variables,
+// whose data is their initial state, nor metadata, which refers to buffers
+// by index.
+std::vector<bool> mergeable_buffers(const tflite::ModelT& model_table) {
+  std::vector<bool> mergeable(model_table.buffers.size());
+  for (size_t i = 0; i < mergeable.size(); ++i) {
+    mergeable[i] = !model_table.buffers[i]->data.empty();
+  }
+  for (const PtrType<tflite::SubGraphT>& subgraph : model_table.subgraphs) {
+    for (const PtrType<tflite::TensorT>& tensor : subgraph->tensors) {
+      if (tensor->is_variable && tensor->buffer < mergeable.size()) {
+        mergeable[tensor->buffer] = false;
+      }
+    }
+  }
+  for (const PtrType<tflite::MetadataT>& metadata : model_table.metadata) {
+    if (metadata->buffer < mergeable.size()) {
+      mergeable[metadata->buffer] = false;
+    }
+  }
+  return mergeable;
+}
+
+}  // namespace detail
+
+// Points every tensor on a duplicate buffer at the first buffer with the
+// same bytes and drops the duplicates' data. Buffers are hashed on `jobs`
+// threads. Returns the bytes saved.
+size_t merge_duplicate_buffers(tflite::ModelT& model_table, size_t jobs) {
+  std::chrono::steady_clock::time_point start =
+      std::chrono::steady_clock::now();
+  const std::vector<bool> mergeable = detail::mergeable_buffers(model_table);
+  std::vector<uint32_t> candidates;
+  for (size_t i = 0; i < mergeable.size(); ++i) {
+    if (mergeable[i]) {
+      candidates.emplace_back(i);
+    }
+  }
+  auto bytes_of = [&](uint32_t index) {
+    const std::vector<uint8_t>& data = model_table.buffers[index]->data;
+    return std::string_view(reinterpret_cast<const char*>(data.data()),
+                            data.size());
+  };
+
+  // largest first, so no thread is left with a big one at the end
+  std::ranges::sort(candidates, [&](uint32_t a, uint32_t b) {
+    return model_table.buffers[a]->data.size() >
+           model_table.buffers[b]->data.size();
+  });
+  std::vector<uint64_t> hashes(model_table.buffers.size(), 0);
+  parallel_for(candidates.size(), jobs, [&](size_t index) {
+    hashes[candidates[index]] =
+        std::hash<std::string_view>()(bytes_of(candidates[index]));
+  });
+
+  // equal bytes end up next to each other, lowest index first
+  std::ranges::sort(candidates, [&](uint32_t a, uint32_t b) {
+    const size_t size_a = model_table.buffers[a]->data.size(),
+                 size_b = model_table.buffers[b]->data.size();
+    if (size_a != size_b) {
+      return size_a < size_b;
+    }
+    return hashes[a] != hashes[b] ? hashes[a] < hashes[b] : a < b;
+  });
+  std::vector<uint32_t> target(model_table.buffers.size());
+  for (size_t i = 0; i < target.size(); ++i) {
+    target[i] = i;
+  }
+  size_t merged = 0, saved = 0;
+  for (size_t begin = 0, end = 0; begin < candidates.size(); begin = end) {
+    const uint32_t first = candidates[begin];
+    const size_t size = model_table.buffers[first]->data.size();
+    end = begin + 1;
+    while (end < candidates.size() &&
+           model_table.buffers[candidates[end]]->data.size() == size &&
+           hashes[candidates[end]] == hashes[first]) {
+      ++end;
+    }
+    // the hash only proposed the group; a collision keeps its own copy
+    for (size_t i = begin + 1; i < end; ++i) {
+      for (size_t j = begin; j < i; ++j) {
+        if (target[candidates[j]] == candidates[j] &&
+            bytes_of(candidates[j]) == bytes_of(candidates[i])) {
+          target[candidates[i]] = candidates[j];
+          ++merged;
+          saved += size;
+          break;
+        }
+      }
+    }
+  }
+
+  for (const PtrType<tflite::SubGraphT>& subgraph : model_table.subgraphs) {
+    for (const PtrType<tflite::TensorT>& tensor : subgraph->tensors) {
+      if (tensor->buffer < target.size()) {
+        tensor->buffer = target[tensor->buffer];
+      }
+    }
+  }
+  for (size_t i = 0; i < target.size(); ++i) {
+    if (target[i] != i) {
+      model_table.buffers[i]->data = std::vector<uint8_t>();
+    }
+  }
+
+  std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+  log_info("Merged {} duplicate buffers of {} in {:.3f} s, saving {} KB.",
+           merged,
+           candidates.size(),
+           elapsed.count(),
+           saved >> 10);
+  return saved;
+}
@@ -0,0 +1,950 @@
+#pragma once
+
+#include <algorithm>  // std::max std::min std::clamp std::fill
+#include <cmath>      // std::exp std::tanh std::isinf
+#include <cstddef>    // size_t
+#include <cstdint>    // int8_t int16_t int32_t int64_t uint8_t uint16_t
+#include <cstring>    // std::memcpy
+#include <functional>  // std::plus std::minus std::multiplies std::divides
+#include <limits>      // std::numeric_limits
+#include <optional>    // std::optional std::nullopt
+#include <span>        // std::span
+#include <utility>     // std::move
+#include <vector>      // std::vector
+
+#include "def.h"
+#include "half.h"
+#include "log.h"
+#include "schema.h"
+#include "tflite_generated.hpp"
+
+// Reference float executor for the operators that make up common float
+// models. It is meant for observing real values (fixtures, calibration,
+// folding), not for speed: kernels are plain loops over NHWC data. Every
+// value is held as float; int32 shape and index tensors survive the round
+// trip exactly.
+
+struct TensorValue {
+  std::vector<int32_t> shape;
+  std::vector<float> data;
+};
+
+namespace detail {
+
+template <typename T>
+void widen(const std::vector<uint8_t>& bytes, std::vector<float>& data) {
+  data.resize(bytes.size() / sizeof(T));
+  for (size_t i = 0; i < data.size(); ++i) {
+    T value;
+    std::memcpy(&value, bytes.data() + i * sizeof(T), sizeof(T));
+    data[i] = static_cast<float>(value);
+  }
+}
+
+size_t shape_size(const std::vector<int32_t>& shape) {
+  size_t size = 1;
+  for (int32_t dim : shape) {
+    size *= dim;
+  }
+  return size;
+}
+
+float activate(float x, tflite::ActivationFunctionType activation) {
+  switch (activation) {
+    case tflite::ActivationFunctionType::RELU:
+      return std::max(x, 0.0f);
+    case tflite::ActivationFunctionType::RELU_N1_TO_1:
+      return std::clamp(x, -1.0f, 1.0f);
+    case tflite::ActivationFunctionType::RELU6:
+      return std::clamp(x, 0.0f, 6.0f);
+    case tflite::ActivationFunctionType::TANH:
+      return std::tanh(x);
+    case tflite::ActivationFunctionType::SIGN_BIT:
+      return std::signbit(x) ? 1.0f : 0.0f;
+    default:
+      return x;
+  }
+}
+
+void activate(std::vector<float>& data,
+              tflite::ActivationFunctionType activation) {
+  if (activation != tflite::ActivationFunctionType::NONE) {
+    for (float& x : data) {
+      x = activate(x, activation);
+    }
+  }
+}
+
+// Output extent and leading padding of one spatial axis, as tflite computes
+// them.
+std::pair<int32_t, int32_t> window(tflite::Padding padding,
+                                   int32_t in,
+                                   int32_t filter,
+                                   int32_t stride,
+                                   int32_t dilation) {
+  int32_t effective = (filter - 1) * dilation + 1;
+  if (padding == tflite::Padding::VALID) {
+    return {(in - effective + stride) / stride, 0};
+  }
+  int32_t out = (in + stride - 1) / stride;
+  int32_t total = std::max((out - 1) * stride + effective - in, 0);
+  return {out, total / 2};
+}
+
+template <typename T>
+const T& options_or_default(const T* options) {
+  static const T defaults;
+  return options != nullptr ? *options : defaults;
+}
+
+bool conv_2d(const tflite::Conv2DOptionsT& o,
+             const TensorValue& input,
+             const TensorValue& filter,
+             const TensorValue* bias,
+             TensorValue& output) {
+  if (input.shape.size() != 4 || filter.shape.size() != 4) {
+    return false;
+  }
+  const int32_t n = input.shape[0], h = input.shape[1], w = input.shape[2],
+                c = input.shape[3], oc = filter.shape[0],
+                kh = filter.shape[1], kw = filter.shape[2],
+                fc = filter.shape[3];
+  if (fc <= 0 || c % fc != 0 || oc % (c / fc) != 0) {
+    return false;
+  }
+  const int32_t groups = c / fc, group_channels = oc / groups;
+  auto [oh, pad_h] =
+      window(o.padding, h, kh, o.stride_h, o.dilation_h_factor);
+  auto [ow, pad_w] =
+      window(o.padding, w, kw, o.stride_w, o.dilation_w_factor);
+  output.shape = {n, oh, ow, oc};
+  output.data.assign(shape_size(output.shape), 0.0f);
+
+  float* out = output.data.data();
+  for (int32_t b = 0; b < n; ++b) {
+    for (int32_t y = 0; y < oh; ++y) {
+      for (int32_t x = 0; x < ow; ++x) {
+        for (int32_t o_c = 0; o_c < oc; ++o_c, ++out) {
+          const int32_t first = o_c / group_channels * fc;
+          float acc = bias ? bias->data[o_c] : 0.0f;
+          for (int32_t ky = 0; ky < kh; ++ky) {
+            const int32_t iy = y * o.stride_h - pad_h +
+                               ky * o.dilation_h_factor;
+            if (iy < 0 || iy >= h) {
+              continue;
+            }
+            for (int32_t kx = 0; kx < kw; ++kx) {
+              const int32_t ix = x * o.stride_w - pad_w +
+                                 kx * o.dilation_w_factor;
+              if (ix < 0 || ix >= w) {
+                continue;
+              }
+              const float* in =
+                  &input.data[((size_t(b) * h + iy) * w + ix) * c + first];
+              const float* weights =
+                  &filter.data[((size_t(o_c) * kh + ky) * kw + kx) * fc];
+              for (int32_t i_c = 0; i_c < fc; ++i_c) {
+                acc += in[i_c] * weights[i_c];
+              }
+            }
+          }
+          *out = activate(acc, o.fused_activation_function);
+        }
+      }
+    }
+  }
+  return true;
+}
+
+bool depthwise_conv_2d(const tflite::DepthwiseConv2DOptionsT& o,
+                       const TensorValue& input,
+                       const TensorValue& filter,
+                       const TensorValue* bias,
+                       TensorValue& output) {
+  if (input.shape.size() != 4 || filter.shape.size() != 4) {
+    return false;
+  }
+  const int32_t n = input.shape[0], h = input.shape[1], w = input.shape[2],
+                c = input.shape[3], kh = filter.shape[1],
+                kw = filter.shape[2], oc = filter.shape[3];
+  if (c <= 0 || oc % c != 0) {
+    return false;
+  }
+  const int32_t multiplier = oc / c;
+  auto [oh, pad_h] =
+      window(o.padding, h, kh, o.stride_h, o.dilation_h_factor);
+  auto [ow, pad_w] =
+      window(o.padding, w, kw, o.stride_w, o.dilation_w_factor);
+  output.shape = {n, oh, ow, oc};
+  output.data.assign(shape_size(output.shape), 0.0f);
+
+  float* out = output.data.data();
+  for (int32_t b = 0; b < n; ++b) {
+    for (int32_t y = 0; y < oh; ++y) {
+      for (int32_t x = 0; x < ow; ++x) {
+        for (int32_t o_c = 0; o_c < oc; ++o_c, ++out) {
+          const int32_t i_c = o_c / multiplier;
+          float acc = bias ? bias->data[o_c] : 0.0f;
+          for (int32_t ky = 0; ky < kh; ++ky) {
+            const int32_t iy = y * o.stride_h - pad_h +
+                               ky * o.dilation_h_factor;
+            if (iy < 0 || iy >= h) {
+              continue;
+            }
+            for (int32_t kx = 0; kx < kw; ++kx) {
+              const int32_t ix = x * o.stride_w - pad_w +
+                                 kx * o.dilation_w_factor;
+              if (ix < 0 || ix >= w) {
+                continue;
+              }
+              acc += input.data[((size_t(b) * h + iy) * w + ix) * c + i_c] *
+                     filter.data[(size_t(ky) * kw + kx) * oc + o_c];
+            }
+          }
+          *out = activate(acc, o.fused_activation_function);
+        }
+      }
+    }
+  }
+  return true;
+}
+
+bool pool_2d(const tflite::Pool2DOptionsT& o,
+             bool average,
+             const TensorValue& input,
+             TensorValue& output) {
+  if (input.shape.size() != 4) {
+    return false;
+  }
+  const int32_t n = input.shape[0], h = input.shape[1], w = input.shape[2],
+                c = input.shape[3];
+  auto [oh, pad_h] = window(o.padding, h, o.filter_height, o.stride_h, 1);
+  auto [ow, pad_w] = window(o.padding, w, o.filter_width, o.stride_w, 1);
+  output.shape = {n, oh, ow, c};
+  output.data.assign(shape_size(output.shape), 0.0f);
+
+  float* out = output.data.data();
+  for (int32_t b = 0; b < n; ++b) {
+    for (int32_t y = 0; y < oh; ++y) {
+      for (int32_t x = 0; x < ow; ++x) {
+        const int32_t y0 = std::max(y * o.stride_h - pad_h, 0),
+                      y1 = std::min(y * o.stride_h - pad_h + o.filter_height,
+                                    h),
+                      x0 = std::max(x * o.stride_w - pad_w, 0),
+                      x1 = std::min(x * o.stride_w - pad_w + o.filter_width,
+                                    w);
+        for (int32_t ch = 0; ch < c; ++ch, ++out) {
+          float acc = average ? 0.0f : -std::numeric_limits<float>::max();
+          for (int32_t iy = y0; iy < y1; ++iy) {
+            for (int32_t ix = x0; ix < x1; ++ix) {
+              float v = input.data[((size_t(b) * h + iy) * w + ix) * c + ch];
+              acc = average ? acc + v : std::max(acc, v);
+            }
+          }
+          // averages count only the taps inside the input, as tflite does
+          if (average) {
+            acc /= std::max((y1 - y0) * (x1 - x0), 1);
+          }
+          *out = activate(acc, o.fused_activation_function);
+        }
+      }
+    }
+  }
+  return true;
+}
+
+bool fully_connected(const tflite::FullyConnectedOptionsT& o,
+                     const TensorValue& input,
+                     const TensorValue& weights,
+                     const TensorValue* bias,
+                     TensorValue& output) {
+  if (weights.shape.size() != 2 || weights.shape[1] <= 0) {
+    return false;
+  }
+  const size_t units = weights.shape[0], depth = weights.shape[1],
+               batches = input.data.size() / depth;
+  if (batches * depth != input.data.size()) {
+    return false;
+  }
+  if (o.keep_num_dims) {
+    output.shape = input.shape;
+    output.shape.back() = units;
+  } else {
+    output.shape = {static_cast<int32_t>(batches),
+                    static_cast<int32_t>(units)};
+  }
+  output.data.resize(batches * units);
+  for (size_t b = 0; b < batches; ++b) {
+    for (size_t u = 0; u < units; ++u) {
+      float acc = bias ? bias->data[u] : 0.0f;
+      for (size_t d = 0; d < depth; ++d) {
+        acc += input.data[b * depth + d] * weights.data[u * depth + d];
+      }
+      output.data[b * units + u] = activate(acc, o.fused_activation_function);
+    }
+  }
+  return true;
+}
+
+// Elementwise binary operator with numpy broadcasting.
+template <typename Fn>
+bool binary(const TensorValue& a,
+            const TensorValue& b,
+            TensorValue& output,
+            tflite::ActivationFunctionType activation,
+            Fn&& fn) {
+  const size_t rank = std::max(a.shape.size(), b.shape.size());
+  std::vector<int32_t> a_shape(rank - a.shape.size(), 1),
+      b_shape(rank - b.shape.size(), 1);
+  a_shape.insert(a_shape.end(), a.shape.begin(), a.shape.end());
+  b_shape.insert(b_shape.end(), b.shape.begin(), b.shape.end());
+
+  output.shape.resize(rank);
+  for (size_t i = 0; i < rank; ++i) {
+    if (a_shape[i] != b_shape[i] && a_shape[i] != 1 && b_shape[i] != 1) {
+      return false;
+    }
+    output.shape[i] = a_shape[i] == 1 ? b_shape[i] : a_shape[i];
+  }
+  output.data.resize(shape_size(output.shape));
+
+  // strides of zero repeat a broadcast operand
+  std::vector<size_t> a_stride(rank), b_stride(rank);
+  for (size_t i = rank, sa = 1, sb = 1; i-- > 0;) {
+    a_stride[i] = a_shape[i] == 1 ? 0 : sa;
+    b_stride[i] = b_shape[i] == 1 ? 0 : sb;
+    sa *= a_shape[i];
+    sb *= b_shape[i];
+  }
+  std::vector<int32_t> index(rank, 0);
+  for (size_t i = 0, ia = 0, ib = 0; i < output.data.size(); ++i) {
+    output.data[i] = activate(fn(a.data[ia], b.data[ib]), activation);
+    for (size_t d = rank; d-- > 0;) {
+      ia += a_stride[d];
+      ib += b_stride[d];
+      if (++index[d] < output.shape[d]) {
+        break;
+      }
+      ia -= a_stride[d] * index[d];
+      ib -= b_stride[d] * index[d];
+      index[d] = 0;
+    }
+  }
+  return true;
+}
+
+// Sum or mean over `axes`, which may be negative.
+bool reduce(const TensorValue& input,
+            const TensorValue& axes,
+            bool keep_dims,
+            bool mean,
+            TensorValue& output) {
+  const int32_t rank = input.shape.size();
+  std::vector<bool> reduced(rank, false);
+  for (float axis : axes.data) {
+    int32_t a = static_cast<int32_t>(axis);
+    a = a < 0 ? a + rank : a;
+    if (a < 0 || a >= rank) {
+      return false;
+    }
+    reduced[a] = true;
+  }
+
+  output.shape.clear();
+  std::vector<size_t> stride(rank);  // output stride per input axis
+  size_t count = 1;
+  for (int32_t i = rank, s = 1; i-- > 0;) {
+    stride[i] = reduced[i] ? 0 : s;
+    s *= reduced[i] ? 1 : input.shape[i];
+    count *= reduced[i] ? input.shape[i] : 1;
+  }
+  for (int32_t i = 0; i < rank; ++i) {
+    if (!reduced[i]) {
+      output.shape.emplace_back(input.shape[i]);
+    } else if (keep_dims) {
+      output.shape.emplace_back(1);
+    }
+  }
+  output.data.assign(shape_size(output.shape), 0.0f);
+
+  std::vector<int32_t> index(rank, 0);
+  for (size_t i = 0, o = 0; i < input.data.size(); ++i) {
+    output.data[o] += input.data[i];
+    for (int32_t d = rank; d-- > 0;) {
+      o += stride[d];
+      if (++index[d] < input.shape[d]) {
+        break;
+      }
+      o -= stride[d] * index[d];
+      index[d] = 0;
+    }
+  }
+  if (mean && count > 0) {
+    for (float& x : output.data) {
+      x /= count;
+    }
+  }
+  return true;
+}
+
+bool pad(const TensorValue& input,
+         const TensorValue& paddings,
+         float value,
+         TensorValue& output) {
+  const size_t rank = input.shape.size();
+  if (paddings.data.size() != 2 * rank) {
+    return false;
+  }
+  output.shape.resize(rank);
+  for (size_t i = 0; i < rank; ++i) {
+    output.shape[i] = input.shape[i] + paddings.data[2 * i] +
+                      paddings.data[2 * i + 1];
+  }
+  output.data.assign(shape_size(output.shape), value);
+
+  std::vector<size_t> stride(rank);
+  for (size_t i = rank, s = 1; i-- > 0;) {
+    stride[i] = s;
+    s *= output.shape[i];
+  }
+  std::vector<int32_t> index(rank, 0);
+  for (size_t i = 0; i < input.data.size(); ++i) {
+    size_t o = 0;
+    for (size_t d = 0; d < rank; ++d) {
+      o += (index[d] + static_cast<size_t>(paddings.data[2 * d])) * stride[d];
+    }
+    output.data[o] = input.data[i];
+    for (size_t d = rank; d-- > 0;) {
+      if (++index[d] < input.shape[d]) {
+        break;
+      }
+      index[d] = 0;
+    }
+  }
+  return true;
+}
+
+bool concatenation(const tflite::ConcatenationOptionsT& o,
+                   std::span<const TensorValue* const> inputs,
+                   TensorValue& output) {
+  const int32_t rank = inputs[0]->shape.size();
+  const int32_t axis = o.axis < 0 ? o.axis + rank : o.axis;
+  if (axis < 0 || axis >= rank) {
+    return false;
+  }
+  size_t outer = 1;
+  for (int32_t i = 0; i < axis; ++i) {
+    outer *= inputs[0]->shape[i];
+  }
+  output.shape = inputs[0]->shape;
+  output.shape[axis] = 0;
+  for (const TensorValue* input : inputs) {
+    output.shape[axis] += input->shape[axis];
+  }
+  output.data.clear();
+  output.data.reserve(shape_size(output.shape));
+  for (size_t i = 0; i < outer; ++i) {
+    for (const TensorValue* input : inputs) {
+      const size_t inner = input->data.size() / std::max<size_t>(outer, 1);
+      output.data.insert(output.data.end(),
+                         input->data.begin() + i * inner,
+                         input->data.begin() + (i + 1) * inner);
+    }
+  }
+  activate(output.data, o.fused_activation_function);
+  return true;
+}
+
+bool transpose(const TensorValue& input,
+               const TensorValue& permutation,
+               TensorValue& output) {
+  const size_t rank = input.shape.size();
+  if (permutation.data.size() != rank) {
+    return false;
+  }
+  std::vector<size_t> in_stride(rank);
+  for (size_t i = rank, s = 1; i-- > 0;) {
+    in_stride[i] = s;
+    s *= input.shape[i];
+  }
+  output.shape.resize(rank);
+  std::vector<size_t> stride(rank);  // input stride per output axis
+  for (size_t i = 0; i < rank; ++i) {
+    size_t axis = static_cast<size_t>(permutation.data[i]);
+    if (axis >= rank) {
+      return false;
+    }
+    output.shape[i] = input.shape[axis];
+    stride[i] = in_stride[axis];
+  }
+  output.data.resize(input.data.size());
+  std::vector<int32_t> index(rank, 0);
+  for (size_t o = 0, i = 0; o < output.data.size(); ++o) {
+    output.data[o] = input.data[i];
+    for (size_t d = rank; d-- > 0;) {
+      i += stride[d];
+      if (++index[d] < output.shape[d]) {
+        break;
+      }
+      i -= stride[d] * index[d];
+      index[d] = 0;
+    }
+  }
+  return true;
+}
+
+// Resolves a requested shape with at most one -1 against `size` elements.
+bool resolve_shape(std::vector<int32_t> shape,
+                   size_t size,
+                   std::vector<int32_t>& resolved) {
+  size_t known = 1;
+  int32_t unknown = -1;
+  for (size_t i = 0; i < shape.size(); ++i) {
+    if (shape[i] < 0) {
+      if (unknown >= 0) {
+        return false;
+      }
+      unknown = i;
+    } else {
+      known *= shape[i];
+    }
+  }
+  if (unknown >= 0) {
+    shape[unknown] = known == 0 ? 0 : size / known;
+  }
+  if (shape_size(shape) != size) {
+    return false;
+  }
+  resolved = std::move(shape);
+  return true;
+}
+
+void dequantize(const tflite::TensorT& tensor,
+                const TensorValue& input,
+                TensorValue& output) {
+  output.shape = input.shape;
+  output.data = input.data;
+  const tflite::QuantizationParametersT* q = tensor.quantization.get();
+  if (q == nullptr || q->scale.empty()) {
+    return;  // float16 weights were widened when loaded
+  }
+  size_t channels = q->scale.size(), inner = 1;
+  if (channels > 1) {
+    for (size_t i = q->quantized_dimension + 1; i < input.shape.size(); ++i) {
+      inner *= input.shape[i];
+    }
+  }
+  for (size_t i = 0; i < output.data.size(); ++i) {
+    size_t channel = channels > 1 ? i / inner % channels : 0;
+    float zero_point =
+        q->zero_point.empty() ? 0.0f : q->zero_point[channel];
+    output.data[i] = (output.data[i] - zero_point) * q->scale[channel];
+  }
+}
+
+}  // namespace detail
+
+// Value of a constant tensor, widened to float, or nothing if the tensor
+// has no data or a type that cannot be widened.
+std::optional<TensorValue> constant_value(const tflite::ModelT& model_table,
+                                          const tflite::TensorT& tensor) {
+  if (tensor.buffer >= model_table.buffers.size()) {
+    return std::nullopt;
+  }
+  const std::vector<uint8_t>& bytes = model_table.buffers[tensor.buffer]->data;
+  if (bytes.empty()) {
+    return std::nullopt;
+  }
+  TensorValue value;
+  value.shape = tensor.shape;
+  switch (tensor.type) {
+    case tflite::TensorType::FLOAT32: {
+      detail::widen<float>(bytes, value.data);
+      break;
+    }
+    case tflite::TensorType::FLOAT16: {
+      value.data.resize(bytes.size() / 2);
+      for (size_t i = 0; i < value.data.size(); ++i) {
+        uint16_t half;
+        std::memcpy(&half, bytes.data() + 2 * i, sizeof(half));
+        value.data[i] = half_to_float(half);
+      }
+      break;
+    }
+    case tflite::TensorType::INT32: {
+      detail::widen<int32_t>(bytes, value.data);
+      break;
+    }
+    case tflite::TensorType::INT64: {
+      detail::widen<int64_t>(bytes, value.data);
+      break;
+    }
+    case tflite::TensorType::INT16: {
+      detail::widen<int16_t>(bytes, value.data);
+      break;
+    }
+    case tflite::TensorType::INT8: {
+      detail::widen<int8_t>(bytes, value.data);
+      break;
+    }
+    case tflite::TensorType::UINT8:
+    case tflite::TensorType::BOOL: {
+      detail::widen<uint8_t>(bytes, value.data);
+      break;
+    }
+    default: {
+      return std::nullopt;
+    }
+  }
+  if (detail::shape_size(value.shape) != value.data.size()) {
+    return std::nullopt;
+  }
+  return value;
+}
+
+// Evaluates one builtin operator. `inputs` holds nullptr for omitted
+// optional inputs. Returns false for operators, options or types the
+// executor does not implement; `outputs` is then unspecified.
+bool evaluate_operator(const tflite::ModelT& model_table,
+                       const tflite::SubGraphT& subgraph,
+                       const tflite::OperatorT& op,
+                       std::span<const TensorValue* const> inputs,
+                       std::span<TensorValue> outputs) {
+  using tflite::BuiltinOperator;
+  using detail::options_or_default;
+
+  for (int32_t output : op.outputs) {
+    tflite::TensorType type = subgraph.tensors[output]->type;
+    if (type != tflite::TensorType::FLOAT32 &&
+        type != tflite::TensorType::INT32) {
+      return false;
+    }
+  }
+  if (inputs.empty() || inputs[0] == nullptr || outputs.size() != 1) {
+    return false;
+  }
+  auto input = [&](size_t i) -> const TensorValue* {
+    return i < inputs.size() ? inputs[i] : nullptr;
+  };
+  const tflite::BuiltinOptionsUnion& options = op.builtin_options;
+  const TensorValue& x = *inputs[0];
+  TensorValue& y = outputs[0];
+
+  switch (builtin_code(*model_table.operator_codes[op.opcode_index])) {
+    case BuiltinOperator::CONV_2D: {
+      return input(1) && detail::conv_2d(
+                             options_or_default(options.AsConv2DOptions()),
+                             x,
+                             *input(1),
+                             input(2),
+                             y);
+    }
+    case BuiltinOperator::DEPTHWISE_CONV_2D: {
+      return input(1) &&
+             detail::depthwise_conv_2d(
+                 options_or_default(options.AsDepthwiseConv2DOptions()),
+                 x,
+                 *input(1),
+                 input(2),
+                 y);
+    }
+    case BuiltinOperator::FULLY_CONNECTED: {
+      return input(1) &&
+             detail::fully_connected(
+                 options_or_default(options.AsFullyConnectedOptions()),
+                 x,
+                 *input(1),
+                 input(2),
+                 y);
+    }
+    case BuiltinOperator::AVERAGE_POOL_2D:
+    case BuiltinOperator::MAX_POOL_2D: {
+      return detail::pool_2d(
+          options_or_default(options.AsPool2DOptions()),
+          builtin_code(*model_table.operator_codes[op.opcode_index]) ==
+              BuiltinOperator::AVERAGE_POOL_2D,
+          x,
+          y);
+    }
+    case BuiltinOperator::ADD: {
+      return input(1) &&
+             detail::binary(
+                 x,
+                 *input(1),
+                 y,
+                 options_or_default(options.AsAddOptions())
+                     .fused_activation_function,
+                 std::plus<float>());
+    }
+    case BuiltinOperator::SUB: {
+      return input(1) &&
+             detail::binary(
+                 x,
+                 *input(1),
+                 y,
+                 options_or_default(options.AsSubOptions())
+                     .fused_activation_function,
+                 std::minus<float>());
+    }
+    case BuiltinOperator::MUL: {
+      return input(1) &&
+             detail::binary(
+                 x,
+                 *input(1),
+                 y,
+                 options_or_default(options.AsMulOptions())
+                     .fused_activation_function,
+                 std::multiplies<float>());
+    }
+    case BuiltinOperator::DIV: {
+      return input(1) &&
+             detail::binary(
+                 x,
+                 *input(1),
+                 y,
+                 options_or_default(options.AsDivOptions())
+                     .fused_activation_function,
+                 std::divides<float>());
+    }
+    case BuiltinOperator::MAXIMUM:
+    case BuiltinOperator::MINIMUM: {
+      bool maximum = builtin_code(*model_table.operator_codes[
+                         op.opcode_index]) == BuiltinOperator::MAXIMUM;
+      return input(1) && detail::binary(x,
+                                        *input(1),
+                                        y,
+                                        tflite::ActivationFunctionType::NONE,
+                                        [maximum](float a, float b) {
+                                          return maximum ? std::max(a, b)
+                                                         : std::min(a, b);
+                                        });
+    }
+    case BuiltinOperator::MEAN:
+    case BuiltinOperator::SUM: {
+      return input(1) &&
+             detail::reduce(
+                 x,
+                 *input(1),
+                 options_or_default(options.AsReducerOptions()).keep_dims,
+                 builtin_code(*model_table.operator_codes[op.opcode_index]) ==
+                     BuiltinOperator::MEAN,
+                 y);
+    }
+    case BuiltinOperator::PAD:
+    case BuiltinOperator::PADV2: {
+      float value = input(2) && !input(2)->data.empty()
+                        ? input(2)->data[0]
+                        : 0.0f;
+      return input(1) && detail::pad(x, *input(1), value, y);
+    }
+    case BuiltinOperator::CONCATENATION: {
+      for (const TensorValue* value : inputs) {
+        if (value == nullptr) {
+          return false;
+        }
+      }
+      return detail::concatenation(
+          options_or_default(options.AsConcatenationOptions()), inputs, y);
+    }
+    case BuiltinOperator::TRANSPOSE: {
+      return input(1) && detail::transpose(x, *input(1), y);
+    }
+    case BuiltinOperator::RESHAPE: {
+      std::vector<int32_t> shape =
+          options_or_default(options.AsReshapeOptions()).new_shape;
+      if (input(1) != nullptr) {
+        shape.assign(input(1)->data.begin(), input(1)->data.end());
+      } else if (shape.empty()) {
+        shape = subgraph.tensors[op.outputs[0]]->shape;
+      }
+      y.data = x.data;
+      return detail::resolve_shape(std::move(shape), x.data.size(), y.shape);
+    }
+    case BuiltinOperator::SQUEEZE: {
+      const std::vector<int32_t>& dims =
+          options_or_default(options.AsSqueezeOptions()).squeeze_dims;
+      const int32_t rank = x.shape.size();
+      y.shape.clear();
+      for (int32_t i = 0; i < rank; ++i) {
+        bool squeezed =
+            x.shape[i] == 1 &&
+            (dims.empty() ||
+             std::ranges::find(dims, i) != dims.end() ||
+             std::ranges::find(dims, i - rank) != dims.end());
+        if (!squeezed) {
+          y.shape.emplace_back(x.shape[i]);
+        }
+      }
+      y.data = x.data;
+      return true;
+    }
+    case BuiltinOperator::SOFTMAX: {
+      const float beta = options_or_default(options.AsSoftmaxOptions()).beta;
+      const size_t depth = x.shape.empty() ? 1 : x.shape.back();
+      y = x;
+      for (size_t begin = 0; begin + depth <= y.data.size(); begin += depth) {
+        float* row = y.data.data() + begin;
+        float max = *std::max_element(row, row + depth), sum = 0.0f;
+        for (size_t i = 0; i < depth; ++i) {
+          row[i] = std::exp((row[i] - max) * beta);
+          sum += row[i];
+        }
+        for (size_t i = 0; i < depth; ++i) {
+          row[i] /= sum;
+        }
+      }
+      return true;
+    }
+    case BuiltinOperator::LOGISTIC: {
+      y = x;
+      for (float& v : y.data) {
+        v = 1.0f / (1.0f + std::exp(-v));
+      }
+      return true;
+    }
+    case BuiltinOperator::TANH: {
+      y = x;
+      detail::activate(y.data, tflite::ActivationFunctionType::TANH);
+      return true;
+    }
+    case BuiltinOperator::RELU: {
+      y = x;
+      detail::activate(y.data, tflite::ActivationFunctionType::RELU);
+      return true;
+    }
+    case BuiltinOperator::RELU6: {
+      y = x;
+      detail::activate(y.data, tflite::ActivationFunctionType::RELU6);
+      return true;
+    }
+    case BuiltinOperator::RELU_N1_TO_1: {
+      y = x;
+      detail::activate(y.data, tflite::ActivationFunctionType::RELU_N1_TO_1);
+      return true;
+    }
+    case BuiltinOperator::LEAKY_RELU: {
+      const float alpha =
+          options_or_default(options.AsLeakyReluOptions()).alpha;
+      y = x;
+      for (float& v : y.data) {
+        v = v < 0.0f ? v * alpha : v;
+      }
+      return true;
+    }
+    case BuiltinOperator::HARD_SWISH: {
+      y = x;
+      for (float& v : y.data) {
+        v = v * std::clamp(v + 3.0f, 0.0f, 6.0f) / 6.0f;
+      }
+      return true;
+    }
+    case BuiltinOperator::DEQUANTIZE: {
+      detail::dequantize(*subgraph.tensors[op.inputs[0]], x, y);
+      return true;
+    }
+    case BuiltinOperator::SHAPE: {
+      y.shape = {static_cast<int32_t>(x.shape.size())};
+      y.data.assign(x.shape.begin(), x.shape.end());
+      return true;
+    }
+    default: {
+      return false;
+    }
+  }
+}
+
+// Runs one subgraph of a model on the reference executor, operator by
+// operator in model order. Constants are widened once; activations are
+// dropped after their last reader so memory follows the live set.
+class ModelRunner {
+ public:
+  explicit ModelRunner(const tflite::ModelT& model_table,
+                       size_t subgraph_index = 0)
+      : model_table_(model_table),
+        subgraph_(*model_table.subgraphs[subgraph_index]),
+        values_(subgraph_.tensors.size()),
+        last_use_(subgraph_.tensors.size(), 0) {
+    for (size_t i = 0; i < subgraph_.tensors.size(); ++i) {
+      values_[i] = constant_value(model_table_, *subgraph_.tensors[i]);
+    }
+    for (size_t i = 0; i < subgraph_.operators.size(); ++i) {
+      for (int32_t input : subgraph_.operators[i]->inputs) {
+        if (input >= 0) {
+          last_use_[input] = i;
+        }
+      }
+    }
+    for (int32_t output : subgraph_.outputs) {
+      last_use_[output] = subgraph_.operators.size();
+    }
+  }
+
+  const tflite::SubGraphT& subgraph() const {
+    return subgraph_;
+  }
+
+  // Feeds the `position`-th input of the subgraph.
+  void set_input(size_t position, TensorValue value) {
+    values_[subgraph_.inputs[position]] = std::move(value);
+  }
+
+  // Value of a tensor, if it is a constant or has been computed and is still
+  // live.
+  const std::optional<TensorValue>& value(int32_t tensor_index) const {
+    return values_[tensor_index];
+  }
+
+  // Runs the operators in order, calling `observe(operator_index)` when the
+  // inputs of an operator are ready and `done(operator_index)` once its
+  // outputs are. Stops at the first operator it cannot evaluate and returns
+  // the number of operators run.
+  template <typename Observe, typename Done>
+  size_t run(Observe&& observe, Done&& done) {
+    std::vector<const TensorValue*> inputs;
+    std::vector<TensorValue> outputs;
+    for (size_t i = 0; i < subgraph_.operators.size(); ++i) {
+      const tflite::OperatorT& op = *subgraph_.operators[i];
+      inputs.clear();
+      for (int32_t input : op.inputs) {
+        if (input >= 0 && !values_[input].has_value()) {
+          log_warning("Reference run stops at operator {}: tensor {} has no "
+                      "value.",
+                      i,
+                      input);
+          return i;
+        }
+        inputs.emplace_back(input >= 0 ? &*values_[input] : nullptr);
+      }
+      observe(i);
+
+      outputs.assign(op.outputs.size(), TensorValue());
+      if (!evaluate_operator(model_table_, subgraph_, op, inputs, outputs)) {
+        log_warning("Reference run stops at operator {} ({}), which it does "
+                    "not implement.",
+                    i,
+                    opcode_name(*model_table_.operator_codes[op.opcode_index]));
+        return i;
+      }
+      for (size_t o = 0; o < op.outputs.size(); ++o) {
+        values_[op.outputs[o]] = std::move(outputs[o]);
+      }
+      done(i);
+
+      for (int32_t input : op.inputs) {
+        if (input >= 0 && last_use_[input] == i &&
+            subgraph_.tensors[input]->buffer < model_table_.buffers.size() &&
+            model_table_.buffers[subgraph_.tensors[input]->buffer]
+                ->data.empty()) {
+          values_[input].reset();
+        }
+      }
+    }
+    return subgraph_.operators.size();
+  }
+
+ private:
+  const tflite::ModelT& model_table_;
+  const tflite::SubGraphT& subgraph_;
+  std::vector<std::optional<TensorValue>> values_;
+  std::vector<size_t> last_use_;
+};
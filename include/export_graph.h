@@ -0,0 +1,327 @@
+#pragma once
+
+#include <algorithm>    // std::ranges::find std::max
+#include <cstddef>      // size_t
+#include <cstdint>      // int32_t uint32_t uint64_t
+#include <string_view>  // std::string_view
+#include <vector>       // std::vector
+
+#include <fmt/format.h>
+
+#include "blocks.h"
+#include "buffered_output.h"
+#include "def.h"
+#include "inspect.h"
+#include "schema.h"
+#include "summary.h"
+#include "tflite_generated.hpp"
+
+// Export of the operator/tensor graph of every subgraph as DOT and JSON,
+// read straight from a verified FlatBuffer. Both files are streamed in one
+// walk over the tables, so nothing grows with the model but a few integers
+// per tensor.
+//
+// With a block catalog, every occurrence of a repeated block but the first
+// collapses into one node; the first is drawn in full, framed as the block.
+// Tensors that only live inside a collapsed occurrence are left out.
+
+namespace detail {
+
+template <typename T>
+T at(const flatbuffers::Vector<T>* vector, size_t i) {
+  return vector->Get(i);
+}
+
+// Collapsed occurrences of one subgraph and the tensors they hide.
+class GraphFolding {
+ public:
+  GraphFolding(const tflite::SubGraph& subgraph,
+               size_t subgraph_index,
+               const BlockCatalog* blocks) {
+    const size_t n_operators = vector_size(subgraph.operators());
+    const size_t n_tensors = vector_size(subgraph.tensors());
+    occurrence_.assign(n_operators, -1);
+    first_.assign(n_operators, -1);
+    block_at_.assign(n_operators, -1);
+    length_at_.assign(n_operators, 1);
+    if (blocks == nullptr) {
+      return;
+    }
+    for (size_t b = 0; b < blocks->blocks.size(); ++b) {
+      const BlockType& block = blocks->blocks[b];
+      if (block.subgraph_index != subgraph_index) {
+        continue;
+      }
+      first_[block.starts.front()] = b;
+      for (size_t k = 1; k < block.starts.size(); ++k) {
+        for (size_t i = 0; i < block.length; ++i) {
+          occurrence_[block.starts[k] + i] = block.starts[k];
+        }
+        block_at_[block.starts[k]] = b;
+        length_at_[block.starts[k]] = block.length;
+      }
+    }
+
+    // a tensor made inside a collapsed occurrence stays visible only if
+    // something behind the occurrence reads it
+    std::vector<int32_t> producer_occurrence(n_tensors, -1);
+    std::vector<int32_t> last_reader(n_tensors, -1);
+    for (size_t i = 0; i < n_operators; ++i) {
+      const tflite::Operator* op = subgraph.operators()->Get(i);
+      for (size_t j = 0; j < vector_size(op->inputs()); ++j) {
+        int32_t t = at(op->inputs(), j);
+        if (t >= 0 && static_cast<size_t>(t) < n_tensors) {
+          last_reader[t] = i;
+        }
+      }
+      for (size_t j = 0; j < vector_size(op->outputs()); ++j) {
+        int32_t t = at(op->outputs(), j);
+        if (t >= 0 && static_cast<size_t>(t) < n_tensors) {
+          producer_occurrence[t] = occurrence_[i];
+        }
+      }
+    }
+    for (size_t j = 0; j < vector_size(subgraph.outputs()); ++j) {
+      int32_t t = at(subgraph.outputs(), j);
+      if (t >= 0 && static_cast<size_t>(t) < n_tensors) {
+        last_reader[t] = n_operators;
+      }
+    }
+    hidden_.assign(n_tensors, false);
+    producer_.assign(n_tensors, -1);
+    for (size_t t = 0; t < n_tensors; ++t) {
+      int32_t start = producer_occurrence[t];
+      producer_[t] = start;
+      if (start >= 0) {
+        hidden_[t] = last_reader[t] < start + length_at_[start];
+      }
+    }
+  }
+
+  // Start of the collapsed occurrence holding an operator, or -1.
+  int32_t occurrence(size_t operator_index) const {
+    return occurrence_[operator_index];
+  }
+
+  // Block whose first occurrence starts at an operator, or -1.
+  int32_t first_of(size_t operator_index) const {
+    return first_[operator_index];
+  }
+
+  // Block and length of the collapsed occurrence starting at an operator.
+  int32_t block_at(int32_t start) const {
+    return block_at_[start];
+  }
+
+  size_t block_length(int32_t start) const {
+    return length_at_[start];
+  }
+
+  bool hidden(int32_t tensor_index) const {
+    return !hidden_.empty() && hidden_[tensor_index];
+  }
+
+  // Start of the collapsed occurrence producing a tensor, or -1.
+  int32_t producer(int32_t tensor_index) const {
+    return producer_.empty() ? -1 : producer_[tensor_index];
+  }
+
+ private:
+  std::vector<int32_t> occurrence_;
+  std::vector<int32_t> first_;
+  std::vector<int32_t> block_at_;
+  std::vector<int32_t> length_at_;
+  std::vector<bool> hidden_;
+  std::vector<int32_t> producer_;
+};
+
+uint64_t tensor_bytes(const tflite::Tensor& tensor) {
+  uint64_t count = 1;
+  for (size_t i = 0; i < vector_size(tensor.shape()); ++i) {
+    int32_t dim = at(tensor.shape(), i);
+    if (dim < 0) {
+      return 0;
+    }
+    count *= dim;
+  }
+  return (count * tensor_type_bits(tensor.type()) + 7) / 8;
+}
+
+}  // namespace detail
+
+// Writes <model>.dot and <model>.graph.json into `folder`. `blocks` may be
+// null, which draws every operator.
+void export_graph(const tflite::Model* model,
+                  std::string_view model_name,
+                  const fs::path& folder,
+                  const BlockCatalog* blocks) {
+  detail::FilePtr dot_file = detail::open_for_writing(
+      folder / fmt::format("{}.dot", model_name));
+  detail::FilePtr json_file = detail::open_for_writing(
+      folder / fmt::format("{}.graph.json", model_name));
+  BufferedOutput dot(dot_file.get()), json(json_file.get());
+  const size_t n_buffers = detail::vector_size(model->buffers());
+  const size_t n_codes = detail::vector_size(model->operator_codes());
+
+  dot.print("digraph {{\nnode [fontsize=10];\n");
+  json.print("{{\n\"model\": ");
+  detail::print_json_string(json, model_name);
+  json.print(",\n\"subgraphs\": [");
+
+  std::vector<int32_t> inputs, outputs;
+  for (size_t s = 0; s < detail::vector_size(model->subgraphs()); ++s) {
+    const tflite::SubGraph& subgraph = *model->subgraphs()->Get(s);
+    const detail::GraphFolding folding(subgraph, s, blocks);
+    const size_t n_tensors = detail::vector_size(subgraph.tensors());
+
+    dot.print("subgraph cluster_{} {{\nlabel=", s);
+    detail::print_json_string(
+        dot,
+        subgraph.name() ? subgraph.name()->string_view()
+                        : std::string_view("main"));
+    dot.print(";\n");
+    json.print("{}\n{{\"name\": ", s == 0 ? "" : ",");
+    detail::print_json_string(json,
+                              subgraph.name() ? subgraph.name()->string_view()
+                                              : std::string_view());
+
+    json.print(",\n\"tensors\": [");
+    for (size_t t = 0; t < n_tensors; ++t) {
+      const tflite::Tensor& tensor = *subgraph.tensors()->Get(t);
+      const tflite::Buffer* buffer =
+          tensor.buffer() < n_buffers ? model->buffers()->Get(tensor.buffer())
+                                      : nullptr;
+      const size_t buffer_bytes =
+          buffer ? detail::vector_size(buffer->data()) : 0;
+      const std::string_view name =
+          tensor.name() ? tensor.name()->string_view() : std::string_view();
+      const char* type = tflite::EnumNameTensorType(tensor.type());
+
+      json.print("{}\n{{\"name\": ", t == 0 ? "" : ",");
+      detail::print_json_string(json, name);
+      json.print(", \"type\": \"{}\", \"shape\": [", type);
+      detail::print_shape(json, tensor.shape(), ", ");
+      json.print("], \"bytes\": {}, \"buffer\": {}, \"buffer_bytes\": {}}}",
+                 detail::tensor_bytes(tensor),
+                 tensor.buffer(),
+                 buffer_bytes);
+
+      if (folding.hidden(t)) {
+        continue;
+      }
+      dot.print("t{}_{} [shape=ellipse{} label=\"",
+                s,
+                t,
+                buffer_bytes > 0 ? " style=filled fillcolor=lightgrey" : "");
+      if (name.find_first_of("\"\\") == std::string_view::npos) {
+        dot.print("{}", name);
+      } else {
+        for (char c : name) {
+          dot.print("{}", c == '"' || c == '\\' ? '_' : c);
+        }
+      }
+      dot.print("\\n{} [", type);
+      detail::print_shape(dot, tensor.shape(), ",");
+      dot.print("]\\n{} B", detail::tensor_bytes(tensor));
+      if (buffer_bytes > 0) {
+        dot.print(", buffer {}", tensor.buffer());
+      }
+      dot.print("\"];\n");
+    }
+
+    json.print("],\n\"operators\": [");
+    const size_t n_operators = detail::vector_size(subgraph.operators());
+    bool first_node = true;
+    int32_t open_block_end = -1;
+    for (size_t i = 0; i < n_operators; ++i) {
+      const tflite::Operator& op = *subgraph.operators()->Get(i);
+      const int32_t occurrence = folding.occurrence(i);
+      if (occurrence >= 0 && static_cast<size_t>(occurrence) != i) {
+        continue;  // drawn with the first operator of the occurrence
+      }
+
+      // boundary of the node: one operator, or a whole occurrence
+      const size_t end =
+          occurrence >= 0 ? i + folding.block_length(occurrence) : i + 1;
+      inputs.clear();
+      outputs.clear();
+      for (size_t k = i; k < end; ++k) {
+        const tflite::Operator& inner = *subgraph.operators()->Get(k);
+        for (size_t j = 0; j < detail::vector_size(inner.inputs()); ++j) {
+          int32_t t = detail::at(inner.inputs(), j);
+          if (t < 0 || static_cast<size_t>(t) >= n_tensors) {
+            continue;  // omitted optional input
+          }
+          bool outside = occurrence < 0 ||
+                         (folding.producer(t) != occurrence &&
+                          std::ranges::find(inputs, t) == inputs.end());
+          if (outside) {
+            inputs.emplace_back(t);
+          }
+        }
+        for (size_t j = 0; j < detail::vector_size(inner.outputs()); ++j) {
+          int32_t t = detail::at(inner.outputs(), j);
+          if (t >= 0 && static_cast<size_t>(t) < n_tensors &&
+              !folding.hidden(t)) {
+            outputs.emplace_back(t);
+          }
+        }
+      }
+
+      if (folding.first_of(i) >= 0) {
+        const int32_t b = folding.first_of(i);
+        dot.print("subgraph cluster_{}_block{} {{\nlabel=\"block {} x{}\";\n"
+                  "style=dashed;\n",
+                  s,
+                  b,
+                  b,
+                  blocks->blocks[b].starts.size());
+        open_block_end = i + blocks->blocks[b].length;
+      }
+
+      json.print("{}\n{{", first_node ? "" : ",");
+      first_node = false;
+      if (occurrence >= 0) {
+        const int32_t b = folding.block_at(occurrence);
+        dot.print("o{}_{} [shape=box3d label=\"block {}\\nops {}-{}\"];\n",
+                  s,
+                  i,
+                  b,
+                  i,
+                  end - 1);
+        json.print("\"block\": {}, \"first\": {}, \"length\": {}",
+                   b,
+                   i,
+                   end - i);
+      } else {
+        const std::string opcode =
+            op.opcode_index() < n_codes
+                ? opcode_name(*model->operator_codes()->Get(op.opcode_index()))
+                : std::string("?");
+        dot.print("o{}_{} [shape=box label=\"{} {}\"];\n", s, i, i, opcode);
+        json.print("\"index\": {}, \"opcode\": ", i);
+        detail::print_json_string(json, opcode);
+      }
+      json.print(", \"inputs\": [{}], \"outputs\": [{}]}}",
+                 fmt::join(inputs, ", "),
+                 fmt::join(outputs, ", "));
+
+      for (int32_t t : inputs) {
+        if (!folding.hidden(t)) {
+          dot.print("t{}_{} -> o{}_{};\n", s, t, s, i);
+        }
+      }
+      for (int32_t t : outputs) {
+        dot.print("o{}_{} -> t{}_{};\n", s, i, s, t);
+      }
+      if (open_block_end >= 0 && end >= static_cast<size_t>(open_block_end)) {
+        dot.print("}}\n");
+        open_block_end = -1;
+      }
+    }
+    dot.print("}}\n");
+    json.print("]}}");
+  }
+  dot.print("}}\n");
+  json.print("]\n}}\n");
+}
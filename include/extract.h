@@ -0,0 +1,649 @@
+#pragma once
+
+#include <algorithm>    // std::lower_bound std::ranges::find
+#include <array>        // std::array
+#include <cstddef>      // size_t
+#include <cstdint>      // int32_t uint8_t uint32_t
+#include <string>       // std::string
+#include <string_view>  // std::string_view
+#include <vector>       // std::vector
+
+#include <fmt/core.h>
+
+#include "def.h"
+#include "layout.h"
+#include "log.h"
+#include "schema.h"
+#include "tflite_generated.hpp"
+#include "utility.h"
+
+namespace detail {
+
+void append_operator_tensors(const tflite::OperatorT& op,
+                             std::vector<int32_t>& tensors) {
+  for (const std::vector<int32_t>* indices :
+       {&op.inputs, &op.outputs, &op.intermediates}) {
+    for (int32_t index : *indices) {
+      if (index >= 0) {  // -1 marks an omitted optional input
+        tensors.emplace_back(index);
+      }
+    }
+  }
+}
+
+}  // namespace detail
+
+// Sorted source indices of the tensors an operator touches. An extracted
+// operator's tensor `i` is the source tensor `tensors[i]`.
+void collect_operator_tensors(const tflite::OperatorT& op,
+                              std::vector<int32_t>& tensors) {
+  tensors.clear();
+  detail::append_operator_tensors(op, tensors);
+  deduplicate(tensors);
+}
+
+// Serializes single operators, or runs of consecutive operators, of an
+// unpacked model straight into a builder.
+// Tensors, options and weights are read from the source objects and written
+// once into the output, so no intermediate ModelT is built and nothing of the
+// source is cloned. Every worker owns one extractor; its scratch vectors keep
+// their capacity between operators.
+//
+// The operators land alone in subgraph 0. Its inputs are the tensors they
+// read but do not produce, its outputs those they produce and nothing after
+// them in the range reads, or that are read behind the range or are outputs
+// of the source subgraph. Subgraphs that control flow
+// options refer to, directly or through the operators of other referenced
+// subgraphs, follow it whole and renumbered, so WHILE, IF, CALL_ONCE and
+// CALL operators stay runnable.
+//
+// A DEQUANTIZE that decodes a constant read by the operators, as compact
+// weight transforms insert them, is extracted with them wherever it sits.
+//
+// When the source subgraph has a signature, subgraph 0 gets one under its
+// key over its inputs and outputs, named after the source signature where
+// it names the tensor and after the tensor otherwise. Signatures of carried
+// subgraphs are kept. Of the metadata only entries that hold for any part of
+// the model are kept; descriptions of the full model's inputs and outputs
+// would be wrong for a piece of it.
+class OperatorExtractor {
+ public:
+  OperatorExtractor(const tflite::ModelT& model_table,
+                    const WeightLayout& layout)
+      : model_table_(model_table),
+        layout_(layout),
+        subgraph_map_(model_table.subgraphs.size(), -1),
+        signatures_(model_table.subgraphs.size(), nullptr),
+        decoders_(model_table.subgraphs.size()) {
+    for (size_t s = 0; s < model_table.subgraphs.size(); ++s) {
+      const tflite::SubGraphT& subgraph = *model_table.subgraphs[s];
+      decoders_[s].assign(subgraph.tensors.size(), -1);
+      for (size_t i = 0; i < subgraph.operators.size(); ++i) {
+        if (decodes_constant(subgraph, *subgraph.operators[i])) {
+          decoders_[s][subgraph.operators[i]->outputs[0]] = i;
+        }
+      }
+    }
+    for (const PtrType<tflite::SignatureDefT>& signature :
+         model_table.signature_defs) {
+      if (signature->subgraph_index < signatures_.size()) {
+        signatures_[signature->subgraph_index] = signature.get();
+      }
+    }
+    for (const PtrType<tflite::MetadataT>& metadata : model_table.metadata) {
+      if (std::ranges::find(kept_metadata_names, metadata->name) !=
+              kept_metadata_names.end() &&
+          metadata->buffer < model_table.buffers.size()) {
+        metadata_.emplace_back(metadata.get());
+      }
+    }
+  }
+
+  // Collects the tensors, subgraphs and buffers an operator depends on and
+  // returns an upper estimate of the serialized size, for reserving the
+  // builder.
+  size_t prepare(size_t subgraph_index, size_t operator_index) {
+    return prepare(subgraph_index, operator_index, operator_index + 1);
+  }
+
+  // Same for the operators [begin, end) of a subgraph, extracted together.
+  size_t prepare(size_t subgraph_index, size_t begin, size_t end) {
+    const tflite::SubGraphT& subgraph =
+        *model_table_.subgraphs[subgraph_index];
+    subgraph_index_ = subgraph_index;
+    subgraph_ = &subgraph;
+    operators_.clear();
+    for (size_t i = begin; i < end; ++i) {
+      operators_.emplace_back(i);
+      for (int32_t input : subgraph.operators[i]->inputs) {
+        if (input >= 0 && decoders_[subgraph_index][input] >= 0) {
+          operators_.emplace_back(decoders_[subgraph_index][input]);
+        }
+      }
+    }
+    deduplicate(operators_);
+
+    tensors_.clear();
+    for (size_t i : operators_) {
+      detail::append_operator_tensors(*subgraph.operators[i], tensors_);
+    }
+    deduplicate(tensors_);
+    collect_subgraphs();
+    collect_boundary();
+
+    // retained weights dominate the output, the rest is tables and padding
+    size_t size_hint = 4096 + 256 * tensors_.size();
+    for (size_t i : operators_) {
+      size_hint += subgraph.operators[i]->custom_options.size();
+    }
+    buffers_.clear();
+    buffers_.emplace_back(0);  // the empty sentinel buffer stays at 0
+    for (int32_t index : tensors_) {
+      buffers_.emplace_back(subgraph.tensors[index]->buffer);
+    }
+    for (int32_t referenced_index : subgraphs_) {
+      const tflite::SubGraphT& referenced =
+          *model_table_.subgraphs[referenced_index];
+      size_hint += 256 * (referenced.tensors.size() +
+                          referenced.operators.size());
+      for (const PtrType<tflite::TensorT>& tensor : referenced.tensors) {
+        buffers_.emplace_back(tensor->buffer);
+      }
+      for (const PtrType<tflite::OperatorT>& inner : referenced.operators) {
+        size_hint += inner->custom_options.size();
+      }
+    }
+    for (const tflite::MetadataT* metadata : metadata_) {
+      buffers_.emplace_back(metadata->buffer);
+    }
+    deduplicate(buffers_);
+
+    for (uint32_t buffer_index : buffers_) {
+      size_hint +=
+          layout_.reserve(model_table_.buffers[buffer_index]->data.size());
+    }
+    return size_hint;
+  }
+
+  // Writes the model holding the prepared operators and the subgraphs they
+  // refer to into `builder` and finishes it.
+  void pack(flatbuffers::FlatBufferBuilder& builder) {
+    const tflite::SubGraphT& subgraph = *subgraph_;
+
+    // weights first: the builder grows downwards, so they end up at the tail
+    pack_buffers(builder,
+                 model_table_,
+                 buffers_,
+                 layout_,
+                 buffer_data_offsets_,
+                 buffer_offsets_);
+
+    subgraph_offsets_.clear();
+    {
+      tensor_offsets_.clear();
+      for (int32_t index : tensors_) {
+        tensor_offsets_.emplace_back(
+            pack_tensor(builder, *subgraph.tensors[index]));
+      }
+      flatbuffers::Offset<flatbuffers::Vector<
+          flatbuffers::Offset<tflite::Tensor>>>
+          tensors = builder.CreateVector(tensor_offsets_);
+      operator_offsets_.clear();
+      for (size_t i : operators_) {
+        operator_offsets_.emplace_back(
+            pack_operator(builder, *subgraph.operators[i], true));
+      }
+      subgraph_offsets_.emplace_back(tflite::CreateSubGraph(
+          builder,
+          tensors,
+          remap(builder, inputs_),
+          remap(builder, outputs_),
+          builder.CreateVector(operator_offsets_),
+          subgraph.name.empty() ? 0 : builder.CreateString(subgraph.name)));
+    }
+    for (int32_t subgraph_index : subgraphs_) {
+      subgraph_offsets_.emplace_back(
+          pack_subgraph(builder, *model_table_.subgraphs[subgraph_index]));
+    }
+
+    // without a source signature there is no key that cannot collide
+    signature_offsets_.clear();
+    if (const tflite::SignatureDefT* source = signatures_[subgraph_index_]) {
+      signature_offsets_.emplace_back(
+          pack_extracted_signature(builder, *source));
+    }
+    for (int32_t subgraph_index : subgraphs_) {
+      if (const tflite::SignatureDefT* signature =
+              signatures_[subgraph_index]) {
+        signature_offsets_.emplace_back(pack_signature(builder, *signature));
+      }
+    }
+
+    metadata_offsets_.clear();
+    indices_.clear();
+    for (const tflite::MetadataT* metadata : metadata_) {
+      metadata_offsets_.emplace_back(
+          tflite::CreateMetadata(builder,
+                                 builder.CreateString(metadata->name),
+                                 buffer_index(metadata->buffer)));
+      indices_.emplace_back(buffer_index(metadata->buffer));
+    }
+    flatbuffers::Offset<flatbuffers::Vector<int32_t>> metadata_buffer =
+        model_table_.metadata_buffer.empty() ? 0
+                                             : builder.CreateVector(indices_);
+
+    operator_code_offsets_.clear();
+    for (const PtrType<tflite::OperatorCodeT>& code :
+         model_table_.operator_codes) {
+      operator_code_offsets_.emplace_back(
+          tflite::CreateOperatorCode(builder, code.get()));
+    }
+
+    flatbuffers::Offset<flatbuffers::String> description =
+        model_table_.description.empty()
+            ? 0
+            : builder.CreateString(model_table_.description);
+    finish_model(
+        builder,
+        tflite::CreateModel(builder,
+                            model_table_.version,
+                            builder.CreateVector(operator_code_offsets_),
+                            builder.CreateVector(subgraph_offsets_),
+                            description,
+                            builder.CreateVector(buffer_offsets_),
+                            metadata_buffer,
+                            builder.CreateVector(metadata_offsets_),
+                            builder.CreateVector(signature_offsets_)),
+        layout_);
+  }
+
+  // Source tensors the prepared range reads from outside, in the order of
+  // the subgraph inputs of its extracted model.
+  const std::vector<int32_t>& inputs() const {
+    return inputs_;
+  }
+
+  // Index in the extracted model of a source tensor of the prepared range.
+  int32_t tensor_index(int32_t source_index) const {
+    if (source_index < 0) {
+      return source_index;
+    }
+    return std::lower_bound(tensors_.begin(), tensors_.end(), source_index) -
+           tensors_.begin();
+  }
+
+ private:
+  // Metadata that stays true for any part of the model.
+  static constexpr std::array<std::string_view, 2> kept_metadata_names = {
+      "min_runtime_version", "CONVERSION_METADATA"};
+
+  bool decodes_constant(const tflite::SubGraphT& subgraph,
+                        const tflite::OperatorT& decoder) const {
+    if (builtin_code(*model_table_.operator_codes[decoder.opcode_index]) !=
+            tflite::BuiltinOperator::DEQUANTIZE ||
+        decoder.inputs.size() != 1 || decoder.outputs.size() != 1 ||
+        decoder.inputs[0] < 0 || decoder.outputs[0] < 0) {
+      return false;
+    }
+    uint32_t buffer = subgraph.tensors[decoder.inputs[0]]->buffer;
+    return buffer < model_table_.buffers.size() &&
+           !model_table_.buffers[buffer]->data.empty();
+  }
+
+  // Breadth-first closure of the subgraphs the prepared operators refer to.
+  // The scratch map is reset through the previous closure, so this costs
+  // nothing for the common operator without control flow.
+  void collect_subgraphs() {
+    for (int32_t subgraph_index : subgraphs_) {
+      subgraph_map_[subgraph_index] = -1;
+    }
+    subgraphs_.clear();
+
+    auto include = [this](int32_t subgraph_index) {
+      if (subgraph_index < 0 ||
+          static_cast<size_t>(subgraph_index) >= subgraph_map_.size()) {
+        log_warning("Operator refers to missing subgraph {}, leaving it.",
+                    subgraph_index);
+      } else if (subgraph_map_[subgraph_index] < 0) {
+        subgraph_map_[subgraph_index] = 1 + subgraphs_.size();
+        subgraphs_.emplace_back(subgraph_index);
+      }
+    };
+    for (size_t i : operators_) {
+      for_each_subgraph_reference(subgraph_->operators[i]->builtin_options,
+                                  include);
+    }
+    // the closure grows while it is walked
+    for (size_t i = 0; i < subgraphs_.size(); ++i) {
+      for (const PtrType<tflite::OperatorT>& inner :
+           model_table_.subgraphs[subgraphs_[i]]->operators) {
+        for_each_subgraph_reference(inner->builtin_options, include);
+      }
+    }
+  }
+
+  uint32_t buffer_index(uint32_t source_index) const {
+    return std::lower_bound(buffers_.begin(), buffers_.end(), source_index) -
+           buffers_.begin();
+  }
+
+  int32_t subgraph_index(int32_t source_index) const {
+    if (source_index < 0 ||
+        static_cast<size_t>(source_index) >= subgraph_map_.size()) {
+      return source_index;
+    }
+    return subgraph_map_[source_index];
+  }
+
+  // Source tensors at the boundary of the prepared range, each once and in
+  // order of first use. Omitted tensors, constants and variables are never
+  // part of it.
+  void collect_boundary() {
+    inputs_.clear();
+    outputs_.clear();
+    auto add = [this](std::vector<int32_t>& boundary, int32_t index) {
+      if (index >= 0 && !is_state_or_constant(*subgraph_->tensors[index]) &&
+          std::ranges::find(boundary, index) == boundary.end()) {
+        boundary.emplace_back(index);
+      }
+    };
+    if (operators_.size() == 1) {
+      const tflite::OperatorT& op = *subgraph_->operators[operators_[0]];
+      for (int32_t index : op.inputs) {
+        add(inputs_, index);
+      }
+      for (int32_t index : op.outputs) {
+        add(outputs_, index);
+      }
+      return;
+    }
+
+    // a tensor is an output unless only later prepared operators read it
+    indices_.clear();  // produced so far
+    for (size_t i : operators_) {
+      const tflite::OperatorT& op = *subgraph_->operators[i];
+      for (int32_t index : op.inputs) {
+        if (std::ranges::find(indices_, index) == indices_.end()) {
+          add(inputs_, index);
+        }
+      }
+      indices_.insert(indices_.end(), op.outputs.begin(), op.outputs.end());
+    }
+    // decoded weights stay internal; other readers decode their own copy
+    for (size_t i : operators_) {
+      for (int32_t index : subgraph_->operators[i]->outputs) {
+        const bool decoded = index >= 0 &&
+                             decoders_[subgraph_index_][index] >= 0 &&
+                             std::ranges::find(subgraph_->outputs, index) ==
+                                 subgraph_->outputs.end();
+        if (!decoded && is_read_after(index, i)) {
+          add(outputs_, index);
+        }
+      }
+    }
+  }
+
+  bool is_state_or_constant(const tflite::TensorT& tensor) const {
+    return tensor.is_variable ||
+           (tensor.buffer < model_table_.buffers.size() &&
+            !model_table_.buffers[tensor.buffer]->data.empty());
+  }
+
+  // Whether anything but the prepared operators after `operator_index`
+  // needs `tensor_index`.
+  bool is_read_after(int32_t tensor_index, size_t operator_index) const {
+    if (std::ranges::find(subgraph_->outputs, tensor_index) !=
+        subgraph_->outputs.end()) {
+      return true;
+    }
+    bool read_in_range = false;
+    for (size_t i = operator_index + 1; i < subgraph_->operators.size();
+         ++i) {
+      const std::vector<int32_t>& inputs = subgraph_->operators[i]->inputs;
+      if (std::ranges::find(inputs, tensor_index) == inputs.end()) {
+        continue;
+      }
+      if (std::ranges::find(operators_, i) == operators_.end()) {
+        return true;
+      }
+      read_in_range = true;
+    }
+    return !read_in_range;
+  }
+
+  // Translates source tensor indices to output ones.
+  flatbuffers::Offset<flatbuffers::Vector<int32_t>> remap(
+      flatbuffers::FlatBufferBuilder& builder,
+      const std::vector<int32_t>& source_indices) {
+    indices_.clear();
+    for (int32_t index : source_indices) {
+      indices_.emplace_back(tensor_index(index));
+    }
+    return builder.CreateVector(indices_);
+  }
+
+  // Signature of subgraph 0 over its inputs and outputs. A boundary tensor
+  // is named as in the signature of the source subgraph when it has one
+  // there, by its own name otherwise; a name already taken in the same map
+  // gets the source tensor index appended.
+  flatbuffers::Offset<tflite::SignatureDef> pack_extracted_signature(
+      flatbuffers::FlatBufferBuilder& builder,
+      const tflite::SignatureDefT& source) {
+    auto tensor_maps = [&](const std::vector<int32_t>& source_indices) {
+      tensor_map_offsets_.clear();
+      names_.clear();
+      for (int32_t source_index : source_indices) {
+        std::string name = boundary_name(source, source_index);
+        while (std::ranges::find(names_, name) != names_.end()) {
+          name = fmt::format("{}_{}", name, source_index);
+        }
+        tensor_map_offsets_.emplace_back(tflite::CreateTensorMap(
+            builder, builder.CreateString(name), tensor_index(source_index)));
+        names_.emplace_back(std::move(name));
+      }
+      return builder.CreateVector(tensor_map_offsets_);
+    };
+    auto inputs = tensor_maps(inputs_);
+    auto outputs = tensor_maps(outputs_);
+    return tflite::CreateSignatureDef(
+        builder,
+        inputs,
+        outputs,
+        builder.CreateString(source.signature_key),
+        0);
+  }
+
+  std::string boundary_name(const tflite::SignatureDefT& source,
+                            int32_t source_index) const {
+    for (const auto* maps : {&source.inputs, &source.outputs}) {
+      for (const PtrType<tflite::TensorMapT>& map : *maps) {
+        if (map->tensor_index == static_cast<uint32_t>(source_index)) {
+          return map->name;
+        }
+      }
+    }
+    const std::string& name = subgraph_->tensors[source_index]->name;
+    return name.empty() ? fmt::format("tensor_{}", source_index) : name;
+  }
+
+  // Signature of a carried subgraph: tensors keep their indices, only the
+  // subgraph is renumbered.
+  flatbuffers::Offset<tflite::SignatureDef> pack_signature(
+      flatbuffers::FlatBufferBuilder& builder,
+      const tflite::SignatureDefT& signature) {
+    auto tensor_maps = [&](const PtrContainerType<tflite::TensorMapT>& maps) {
+      tensor_map_offsets_.clear();
+      for (const PtrType<tflite::TensorMapT>& map : maps) {
+        tensor_map_offsets_.emplace_back(tflite::CreateTensorMap(
+            builder, builder.CreateString(map->name), map->tensor_index));
+      }
+      return builder.CreateVector(tensor_map_offsets_);
+    };
+    auto inputs = tensor_maps(signature.inputs);
+    auto outputs = tensor_maps(signature.outputs);
+    return tflite::CreateSignatureDef(
+        builder,
+        inputs,
+        outputs,
+        builder.CreateString(signature.signature_key),
+        subgraph_index(signature.subgraph_index));
+  }
+
+  // Packs builtin options, renumbering the subgraphs of control flow.
+  flatbuffers::Offset<void> pack_options(
+      flatbuffers::FlatBufferBuilder& builder,
+      const tflite::BuiltinOptionsUnion& options) {
+    switch (options.type) {
+      case tflite::BuiltinOptions::WhileOptions: {
+        const tflite::WhileOptionsT& o = *options.AsWhileOptions();
+        return tflite::CreateWhileOptions(
+                   builder,
+                   subgraph_index(o.cond_subgraph_index),
+                   subgraph_index(o.body_subgraph_index))
+            .Union();
+      }
+      case tflite::BuiltinOptions::IfOptions: {
+        const tflite::IfOptionsT& o = *options.AsIfOptions();
+        return tflite::CreateIfOptions(
+                   builder,
+                   subgraph_index(o.then_subgraph_index),
+                   subgraph_index(o.else_subgraph_index))
+            .Union();
+      }
+      case tflite::BuiltinOptions::CallOnceOptions: {
+        const tflite::CallOnceOptionsT& o = *options.AsCallOnceOptions();
+        return tflite::CreateCallOnceOptions(
+                   builder, subgraph_index(o.init_subgraph_index))
+            .Union();
+      }
+      case tflite::BuiltinOptions::CallOptions: {
+        const tflite::CallOptionsT& o = *options.AsCallOptions();
+        return tflite::CreateCallOptions(
+                   builder,
+                   subgraph_index(static_cast<int32_t>(o.subgraph)))
+            .Union();
+      }
+      default: {
+        return options.Pack(builder);
+      }
+    }
+  }
+
+  // Packs an operator. The extracted operator has its tensors renumbered;
+  // operators of referenced subgraphs keep theirs, as the whole subgraph is
+  // carried over.
+  flatbuffers::Offset<tflite::Operator> pack_operator(
+      flatbuffers::FlatBufferBuilder& builder,
+      const tflite::OperatorT& op,
+      bool extracted) {
+    auto tensors = [&](const std::vector<int32_t>& indices) {
+      return extracted ? remap(builder, indices)
+                       : builder.CreateVector(indices);
+    };
+    return tflite::CreateOperator(
+        builder,
+        op.opcode_index,
+        tensors(op.inputs),
+        tensors(op.outputs),
+        op.builtin_options.type,
+        pack_options(builder, op.builtin_options),
+        op.custom_options.empty() ? 0 : builder.CreateVector(op.custom_options),
+        op.custom_options_format,
+        op.mutating_variable_inputs.empty()
+            ? 0
+            : builder.CreateVector(op.mutating_variable_inputs),
+        op.intermediates.empty() ? 0 : tensors(op.intermediates));
+  }
+
+  // Packs a referenced subgraph whole, with buffers and subgraph references
+  // renumbered.
+  flatbuffers::Offset<tflite::SubGraph> pack_subgraph(
+      flatbuffers::FlatBufferBuilder& builder,
+      const tflite::SubGraphT& subgraph) {
+    tensor_offsets_.clear();
+    for (const PtrType<tflite::TensorT>& tensor : subgraph.tensors) {
+      tensor_offsets_.emplace_back(pack_tensor(builder, *tensor));
+    }
+    flatbuffers::Offset<flatbuffers::Vector<
+        flatbuffers::Offset<tflite::Tensor>>>
+        tensors = builder.CreateVector(tensor_offsets_);
+
+    operator_offsets_.clear();
+    for (const PtrType<tflite::OperatorT>& op : subgraph.operators) {
+      operator_offsets_.emplace_back(pack_operator(builder, *op, false));
+    }
+    return tflite::CreateSubGraph(
+        builder,
+        tensors,
+        builder.CreateVector(subgraph.inputs),
+        builder.CreateVector(subgraph.outputs),
+        builder.CreateVector(operator_offsets_),
+        subgraph.name.empty() ? 0 : builder.CreateString(subgraph.name));
+  }
+
+  // Same fields as the generated CreateTensor, with the buffer remapped.
+  flatbuffers::Offset<tflite::Tensor> pack_tensor(
+      flatbuffers::FlatBufferBuilder& builder, const tflite::TensorT& tensor) {
+    flatbuffers::Offset<flatbuffers::Vector<
+        flatbuffers::Offset<tflite::VariantSubType>>>
+        variant_tensors = 0;
+    if (!tensor.variant_tensors.empty()) {
+      variant_offsets_.clear();
+      for (const PtrType<tflite::VariantSubTypeT>& variant :
+           tensor.variant_tensors) {
+        variant_offsets_.emplace_back(
+            tflite::CreateVariantSubType(builder, variant.get()));
+      }
+      variant_tensors = builder.CreateVector(variant_offsets_);
+    }
+    return tflite::CreateTensor(
+        builder,
+        tensor.shape.empty() ? 0 : builder.CreateVector(tensor.shape),
+        tensor.type,
+        buffer_index(tensor.buffer),
+        tensor.name.empty() ? 0 : builder.CreateString(tensor.name),
+        tensor.quantization ? tflite::CreateQuantizationParameters(
+                                  builder, tensor.quantization.get())
+                            : 0,
+        tensor.is_variable,
+        tensor.sparsity
+            ? tflite::CreateSparsityParameters(builder, tensor.sparsity.get())
+            : 0,
+        tensor.shape_signature.empty()
+            ? 0
+            : builder.CreateVector(tensor.shape_signature),
+        tensor.has_rank,
+        variant_tensors);
+  }
+
+  const tflite::ModelT& model_table_;
+  WeightLayout layout_;
+  size_t subgraph_index_ = 0;
+  const tflite::SubGraphT* subgraph_ = nullptr;
+  std::vector<size_t> operators_;  // prepared source operators, ascending
+
+  std::vector<int32_t> tensors_;    // sorted source tensor indices
+  std::vector<int32_t> inputs_;     // source boundary tensors, in order
+  std::vector<int32_t> outputs_;
+  std::vector<int32_t> subgraphs_;  // referenced source subgraphs, in order
+  std::vector<int32_t> subgraph_map_;  // source subgraph to output, or -1
+  std::vector<const tflite::SignatureDefT*> signatures_;  // by subgraph
+  std::vector<const tflite::MetadataT*> metadata_;        // kept entries
+  // by subgraph and tensor, the DEQUANTIZE decoding a constant into it or -1
+  std::vector<std::vector<int32_t>> decoders_;
+  std::vector<uint32_t> buffers_;      // sorted source buffer indices
+  std::vector<int32_t> indices_;
+  std::vector<std::string> names_;
+  std::vector<flatbuffers::Offset<flatbuffers::Vector<uint8_t>>>
+      buffer_data_offsets_;
+  std::vector<flatbuffers::Offset<tflite::Buffer>> buffer_offsets_;
+  std::vector<flatbuffers::Offset<tflite::Tensor>> tensor_offsets_;
+  std::vector<flatbuffers::Offset<tflite::Operator>> operator_offsets_;
+  std::vector<flatbuffers::Offset<tflite::SubGraph>> subgraph_offsets_;
+  std::vector<flatbuffers::Offset<tflite::TensorMap>> tensor_map_offsets_;
+  std::vector<flatbuffers::Offset<tflite::SignatureDef>> signature_offsets_;
+  std::vector<flatbuffers::Offset<tflite::Metadata>> metadata_offsets_;
+  std::vector<flatbuffers::Offset<tflite::VariantSubType>> variant_offsets_;
+  std::vector<flatbuffers::Offset<tflite::OperatorCode>>
+      operator_code_offsets_;
+};
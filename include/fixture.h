@@ -0,0 +1,208 @@
+#pragma once
+
+#include <algorithm>  // std::copy_n std::min std::ranges::copy
+#include <cstddef>    // size_t
+#include <cstdint>    // int32_t uint8_t uint32_t uint64_t
+#include <cstring>    // std::memcpy
+#include <map>        // std::map
+#include <memory>     // std::make_shared std::shared_ptr
+#include <optional>   // std::optional
+#include <string>     // std::string
+#include <utility>    // std::move
+#include <vector>     // std::vector
+
+#include <fmt/format.h>
+
+#include "def.h"
+#include "executor.h"
+#include "extract.h"
+#include "image.h"
+#include "layout.h"
+#include "log.h"
+#include "tflite_generated.hpp"
+#include "writer.h"
+
+// Input fixtures record the values every extracted operator saw when the full
+// model ran on a real input, so a split operator can be replayed in
+// isolation. A fixture file is a header, a table of entries and the raw
+// tensor data, each data block aligned to 64 bytes so a reader can mmap the
+// file and point straight into it. All fields are little endian.
+//
+// There is one entry per input of the extracted model. Values are recorded
+// for FLOAT32 and INT32 inputs; the float executor holds no integer-exact
+// value for others, such as the int8 and uint8 activations of quantized
+// models. Their entries have the stored shape and a size of 0.
+
+constexpr char fixture_magic[4] = {'T', 'F', 'I', 'N'};
+constexpr uint32_t fixture_version = 2;
+constexpr size_t fixture_alignment = 64;
+constexpr size_t fixture_max_rank = 8;
+
+struct FixtureHeader {
+  char magic[4];
+  uint32_t version;
+  uint32_t count;  // entries following the header
+  uint32_t reserved;
+};
+
+struct FixtureEntry {
+  uint32_t tensor_index;  // tensor of the extracted model
+  int32_t type;           // tflite::TensorType
+  uint32_t rank;
+  int32_t dims[fixture_max_rank];
+  uint32_t reserved;
+  uint64_t offset;  // from the start of the file, 0 when not recorded
+  uint64_t size;    // in bytes, 0 when not recorded
+};
+
+static_assert(sizeof(FixtureHeader) == 16);
+static_assert(sizeof(FixtureEntry) == 64);
+
+fs::path fixture_file_name(const fs::path& model_name,
+                           size_t subgraph_index,
+                           size_t operator_index) {
+  return fmt::format(
+      "{}_{}_{}.inputs", model_name.string(), subgraph_index, operator_index);
+}
+
+namespace detail {
+
+size_t align_up(size_t value, size_t alignment) {
+  return (value + alignment - 1) / alignment * alignment;
+}
+
+bool is_recorded(const tflite::TensorT& tensor,
+                 const std::optional<TensorValue>& value) {
+  return (tensor.type == tflite::TensorType::FLOAT32 ||
+          tensor.type == tflite::TensorType::INT32) &&
+         value.has_value() && value->shape.size() <= fixture_max_rank;
+}
+
+// Lays out the fixture of one operator: the runtime inputs of its extracted
+// model, in the order of that model's subgraph inputs. `extractor` has the
+// operator prepared as it is split, the DEQUANTIZE operators it reads
+// included. Inputs without a recorded value are counted in `skipped` by
+// type.
+std::vector<uint8_t> pack_fixture(
+    const tflite::SubGraphT& subgraph,
+    const OperatorExtractor& extractor,
+    const ModelRunner& runner,
+    std::map<tflite::TensorType, size_t>& skipped) {
+  const std::vector<int32_t>& inputs = extractor.inputs();
+  size_t offset = detail::align_up(
+      sizeof(FixtureHeader) + inputs.size() * sizeof(FixtureEntry),
+      fixture_alignment);
+  std::vector<FixtureEntry> entries(inputs.size());
+  for (size_t i = 0; i < inputs.size(); ++i) {
+    const tflite::TensorT& tensor = *subgraph.tensors[inputs[i]];
+    const std::optional<TensorValue>& value = runner.value(inputs[i]);
+    FixtureEntry& entry = entries[i];
+    entry = FixtureEntry{};
+    entry.tensor_index =
+        static_cast<uint32_t>(extractor.tensor_index(inputs[i]));
+    entry.type = static_cast<int32_t>(tensor.type);
+    if (!is_recorded(tensor, value)) {
+      entry.rank = std::min(tensor.shape.size(), fixture_max_rank);
+      std::copy_n(tensor.shape.begin(), entry.rank, entry.dims);
+      ++skipped[tensor.type];
+      continue;
+    }
+    entry.rank = value->shape.size();
+    std::ranges::copy(value->shape, entry.dims);
+    entry.offset = offset;
+    entry.size = value->data.size() * sizeof(float);  // int32 is as wide
+    offset = detail::align_up(offset + entry.size, fixture_alignment);
+  }
+
+  std::vector<uint8_t> bytes(offset, 0);
+  FixtureHeader header{{}, fixture_version, uint32_t(inputs.size()), 0};
+  std::memcpy(header.magic, fixture_magic, sizeof(header.magic));
+  std::memcpy(bytes.data(), &header, sizeof(header));
+  if (!entries.empty()) {
+    std::memcpy(bytes.data() + sizeof(header),
+                entries.data(),
+                entries.size() * sizeof(FixtureEntry));
+  }
+  for (size_t i = 0; i < inputs.size(); ++i) {
+    if (entries[i].size == 0) {
+      continue;
+    }
+    const std::vector<float>& data = runner.value(inputs[i])->data;
+    uint8_t* out = bytes.data() + entries[i].offset;
+    if (entries[i].type == static_cast<int32_t>(tflite::TensorType::INT32)) {
+      for (float x : data) {
+        int32_t v = static_cast<int32_t>(x);
+        std::memcpy(out, &v, sizeof(v));
+        out += sizeof(v);
+      }
+    } else {
+      std::memcpy(out, data.data(), entries[i].size);
+    }
+  }
+  return bytes;
+}
+
+}  // namespace detail
+
+// Runs subgraph 0 of the model on the reference executor with `image_path`
+// as its first input and writes the inputs each operator observed to
+// `<model>_0_<op>.inputs` in `model_folder`. Operators behind the first one
+// the executor cannot run get no fixture.
+void save_fixtures(const tflite::ModelT& model_table,
+                   const fs::path& model_name,
+                   const fs::path& model_folder,
+                   const fs::path& image_path,
+                   OutputWriter& writer) {
+  if (model_table.subgraphs.empty() ||
+      model_table.subgraphs[0]->inputs.empty()) {
+    log_warning("{} has no input to feed, skipping fixtures.",
+                model_name.string());
+    return;
+  }
+  ModelRunner runner(model_table);
+  OperatorExtractor extractor(model_table, WeightLayout());
+  const tflite::SubGraphT& subgraph = runner.subgraph();
+  const tflite::TensorT& input = *subgraph.tensors[subgraph.inputs[0]];
+  if (input.type != tflite::TensorType::FLOAT32) {
+    log_warning("Input {} of {} is {}, fixtures need a float input.",
+                input.name,
+                model_name.string(),
+                tflite::EnumNameTensorType(input.type));
+    return;
+  }
+  std::optional<TensorValue> value = image_input(image_path, input.shape);
+  if (!value.has_value()) {
+    return;
+  }
+  runner.set_input(0, std::move(*value));
+
+  size_t written = 0;
+  std::map<tflite::TensorType, size_t> skipped;
+  runner.run(
+      [&](size_t operator_index) {
+        extractor.prepare(0, operator_index);
+        auto bytes = std::make_shared<std::vector<uint8_t>>(
+            detail::pack_fixture(subgraph, extractor, runner, skipped));
+        writer.submit(model_folder /
+                          fixture_file_name(model_name, 0, operator_index),
+                      bytes->data(),
+                      bytes->size(),
+                      [bytes]() {});
+        ++written;
+      },
+      [](size_t) {});
+  log_info("Wrote input fixtures of {} of {} operators from {}.",
+           written,
+           subgraph.operators.size(),
+           image_path.string());
+  if (!skipped.empty()) {
+    std::vector<std::string> counts;
+    for (auto [type, count] : skipped) {
+      counts.emplace_back(
+          fmt::format("{} {}", count, tflite::EnumNameTensorType(type)));
+    }
+    log_warning("Fixtures hold no values for {} operator inputs; their "
+                "entries have a size of 0.",
+                fmt::join(counts, ", "));
+  }
+}
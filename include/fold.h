@@ -0,0 +1,243 @@
+#pragma once
+
+#include <algorithm>  // std::ranges::all_of std::max
+#include <cmath>      // std::abs
+#include <cstddef>    // size_t
+#include <cstdint>    // int32_t uint8_t uint32_t
+#include <cstring>    // std::memcpy
+#include <optional>   // std::optional
+#include <utility>    // std::move
+#include <vector>     // std::vector
+
+#include "def.h"
+#include "executor.h"
+#include "log.h"
+#include "schema.h"
+#include "tflite_generated.hpp"
+
+// Constant folding: operators whose inputs are all constant are evaluated
+// on the reference executor once, their outputs become constants and the
+// operators go away. SHAPE folds as soon as its input has a static shape,
+// constant or not. Folding repeats until nothing changes.
+//
+// The executor computes in float, which is exact for integers only below
+// 2^24 and rounds integer division. INT32 results are therefore folded only
+// for operators that move elements or report a shape, and only while every
+// value stays in that range.
+
+namespace detail {
+
+bool is_constant(const tflite::ModelT& model_table,
+                 const tflite::TensorT& tensor) {
+  return !tensor.is_variable && tensor.buffer < model_table.buffers.size() &&
+         !model_table.buffers[tensor.buffer]->data.empty();
+}
+
+bool has_static_shape(const tflite::TensorT& tensor) {
+  auto known = [](int32_t dim) { return dim >= 0; };
+  return !tensor.shape.empty() && std::ranges::all_of(tensor.shape, known) &&
+         std::ranges::all_of(tensor.shape_signature, known);
+}
+
+// Operators whose output elements are copies of input elements, or the
+// input's dimensions, so an integer result needs no arithmetic.
+bool moves_data(tflite::BuiltinOperator code) {
+  switch (code) {
+    case tflite::BuiltinOperator::SHAPE:
+    case tflite::BuiltinOperator::RESHAPE:
+    case tflite::BuiltinOperator::SQUEEZE:
+    case tflite::BuiltinOperator::CONCATENATION:
+    case tflite::BuiltinOperator::TRANSPOSE:
+    case tflite::BuiltinOperator::PAD:
+    case tflite::BuiltinOperator::PADV2: {
+      return true;
+    }
+    default: {
+      return false;
+    }
+  }
+}
+
+// Whether a float holds each integer of `value` exactly.
+bool exact_integers(const TensorValue& value) {
+  return std::ranges::all_of(
+      value.data, [](float x) { return std::abs(x) < 16777216.0f; });
+}
+
+// Bytes of a value stored as `type`, or nothing for types the executor
+// does not produce. INT32 values must be exact integers.
+std::optional<std::vector<uint8_t>> encode(const TensorValue& value,
+                                           tflite::TensorType type) {
+  std::vector<uint8_t> bytes;
+  if (type == tflite::TensorType::FLOAT32) {
+    bytes.resize(value.data.size() * sizeof(float));
+    std::memcpy(bytes.data(), value.data.data(), bytes.size());
+    return bytes;
+  } else if (type == tflite::TensorType::INT32) {
+    bytes.resize(value.data.size() * sizeof(int32_t));
+    for (size_t i = 0; i < value.data.size(); ++i) {
+      int32_t v = static_cast<int32_t>(value.data[i]);
+      std::memcpy(bytes.data() + i * sizeof(v), &v, sizeof(v));
+    }
+    return bytes;
+  }
+  return std::nullopt;
+}
+
+// Folds what it can of one subgraph in a single pass. Returns the number of
+// operators folded.
+size_t fold_subgraph(tflite::ModelT& model_table,
+                     tflite::SubGraphT& subgraph,
+                     size_t max_growth) {
+  std::vector<bool> is_output(subgraph.tensors.size(), false);
+  for (int32_t output : subgraph.outputs) {
+    is_output[output] = true;
+  }
+
+  PtrContainerType<tflite::OperatorT> kept;
+  kept.reserve(subgraph.operators.size());
+  std::vector<TensorValue> values;
+  std::vector<const TensorValue*> inputs;
+  std::vector<TensorValue> outputs;
+  size_t folded = 0;
+  for (PtrType<tflite::OperatorT>& op : subgraph.operators) {
+    const tflite::BuiltinOperator code =
+        builtin_code(*model_table.operator_codes[op->opcode_index]);
+    const bool shape_only = code == tflite::BuiltinOperator::SHAPE;
+    bool foldable = !op->inputs.empty() && op->outputs.size() == 1 &&
+                    op->outputs[0] >= 0 && !is_output[op->outputs[0]];
+    size_t input_bytes = 0;
+    values.clear();
+    values.reserve(op->inputs.size());
+    for (size_t i = 0; foldable && i < op->inputs.size(); ++i) {
+      if (op->inputs[i] < 0) {
+        continue;
+      }
+      const tflite::TensorT& tensor = *subgraph.tensors[op->inputs[i]];
+      if (shape_only && has_static_shape(tensor)) {
+        values.emplace_back(TensorValue{tensor.shape, {}});
+        continue;
+      }
+      std::optional<TensorValue> value = is_constant(model_table, tensor)
+                                             ? constant_value(model_table,
+                                                              tensor)
+                                             : std::nullopt;
+      if (!value.has_value()) {
+        foldable = false;
+        break;
+      }
+      input_bytes += model_table.buffers[tensor.buffer]->data.size();
+      values.emplace_back(std::move(*value));
+    }
+    if (!foldable) {
+      kept.emplace_back(std::move(op));
+      continue;
+    }
+
+    inputs.clear();
+    for (size_t i = 0, next = 0; i < op->inputs.size(); ++i) {
+      inputs.emplace_back(op->inputs[i] < 0 ? nullptr : &values[next++]);
+    }
+    outputs.assign(1, TensorValue());
+    tflite::TensorT& output = *subgraph.tensors[op->outputs[0]];
+    std::optional<std::vector<uint8_t>> bytes;
+    const bool exact =
+        output.type != tflite::TensorType::INT32 ||
+        (moves_data(code) && std::ranges::all_of(values, exact_integers));
+    if (exact &&
+        evaluate_operator(model_table, subgraph, *op, inputs, outputs) &&
+        (output.type != tflite::TensorType::INT32 ||
+         exact_integers(outputs[0]))) {
+      bytes = encode(outputs[0], output.type);
+    }
+    // a constant much larger than its sources, such as a broadcast, costs
+    // more in the file than it saves at run time
+    if (!bytes.has_value() ||
+        bytes->size() > std::max(max_growth * input_bytes, size_t{1} << 20)) {
+      kept.emplace_back(std::move(op));
+      continue;
+    }
+
+    auto buffer = make_ptr<tflite::BufferT>();
+    buffer->data = std::move(*bytes);
+    model_table.buffers.emplace_back(std::move(buffer));
+    output.buffer = model_table.buffers.size() - 1;
+    output.shape = outputs[0].shape;
+    output.shape_signature.clear();
+    ++folded;
+  }
+  subgraph.operators = std::move(kept);
+  return folded;
+}
+
+// Drops the data of buffers that no remaining operator, subgraph input or
+// output, or metadata refers to any more. Buffers keep their index, so no
+// tensor needs renumbering.
+size_t release_unread_buffers(tflite::ModelT& model_table) {
+  std::vector<bool> read(model_table.buffers.size(), false);
+  auto mark = [&](const tflite::SubGraphT& subgraph, int32_t tensor_index) {
+    if (tensor_index >= 0) {
+      uint32_t buffer = subgraph.tensors[tensor_index]->buffer;
+      if (buffer < read.size()) {
+        read[buffer] = true;
+      }
+    }
+  };
+  for (const PtrType<tflite::SubGraphT>& subgraph : model_table.subgraphs) {
+    for (const PtrType<tflite::OperatorT>& op : subgraph->operators) {
+      for (const std::vector<int32_t>* indices :
+           {&op->inputs, &op->outputs, &op->intermediates}) {
+        for (int32_t index : *indices) {
+          mark(*subgraph, index);
+        }
+      }
+    }
+    for (const std::vector<int32_t>* indices :
+         {&subgraph->inputs, &subgraph->outputs}) {
+      for (int32_t index : *indices) {
+        mark(*subgraph, index);
+      }
+    }
+    for (const PtrType<tflite::TensorT>& tensor : subgraph->tensors) {
+      if (tensor->is_variable && tensor->buffer < read.size()) {
+        read[tensor->buffer] = true;
+      }
+    }
+  }
+  for (const PtrType<tflite::MetadataT>& metadata : model_table.metadata) {
+    if (metadata->buffer < read.size()) {
+      read[metadata->buffer] = true;
+    }
+  }
+  size_t released = 0;
+  for (size_t i = 0; i < read.size(); ++i) {
+    if (!read[i] && !model_table.buffers[i]->data.empty()) {
+      released += model_table.buffers[i]->data.size();
+      model_table.buffers[i]->data = std::vector<uint8_t>();
+    }
+  }
+  return released;
+}
+
+}  // namespace detail
+
+// Folds constant operators of every subgraph until none is left, keeping
+// operators whose result would be more than `max_growth` times the size of
+// its constant inputs (and over 1 MiB). Returns the number of operators
+// folded.
+size_t fold_constants(tflite::ModelT& model_table, size_t max_growth = 4) {
+  size_t folded = 0;
+  for (const PtrType<tflite::SubGraphT>& subgraph : model_table.subgraphs) {
+    size_t round = 0;
+    do {
+      round = detail::fold_subgraph(model_table, *subgraph, max_growth);
+      folded += round;
+    } while (round > 0);
+  }
+  size_t released = detail::release_unread_buffers(model_table);
+  log_info("Folded {} constant operators, releasing {} KB of inputs only "
+           "they read.",
+           folded,
+           released >> 10);
+  return folded;
+}
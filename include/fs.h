@@ -1,43 +1,111 @@
 #pragma once
 
+#include <fcntl.h>     // open O_RDONLY O_CLOEXEC
+#include <sys/mman.h>  // mmap munmap
+#include <unistd.h>    // close
+
+#include <algorithm>      // std::min std::max
 #include <cassert>        // assert
+#include <cerrno>         // errno
+#include <chrono>         // std::chrono::steady_clock
 #include <cstddef>        // size_t
+#include <cstring>        // std::strerror
 #include <fstream>        // std::ifstream std::ios::binary
-#include <functional>     // std::function
 #include <ranges>         // std::cartesian_product
-#include <unordered_map>  // std::unordered_map
-#include <utility>        // std::pair std::make_pair
+#include <utility>        // std::pair std::make_pair std::move
 #include <vector>         // std::vector
 
+#include "alloc_stats.h"
+#include "blocks.h"
+#include "builder.h"
 #include "def.h"
+#include "extract.h"
+#include "fixture.h"
+#include "layout.h"
 #include "log.h"
+#include "parallel.h"
+#include "publish.h"
+#include "summary.h"
 #include "tflite_generated.hpp"
+#include "unique.h"
 #include "utility.h"
+#include "writer.h"
 
-std::pair<RawDataType, size_t> read_binary_from_path(fs::path file_path) {
+// Returns the canonical path of an existing .tflite file, or aborts.
+fs::path checked_model_path(fs::path file_path) {
   file_path = fs::canonical(file_path);
-  RawDataType data = nullptr;
-  size_t size = 0;
   if (file_path.extension() != ".tflite") {
     log_fatal("File format not correct: {}, but we need .tflite.",
               file_path.extension().string());
   } else if (!fs::exists(file_path) || fs::is_directory(file_path)) {
     log_fatal("File {} does not exist or is a directory.", file_path.c_str());
-  } else {
-    std::ifstream input{file_path, std::ios::binary};
-    size = fs::file_size(file_path);
-    const static size_t mb_in_byte = 1024 * 1024;
-    log_info("Opening file {} of {} Bytes ({} MB).",
-             file_path.c_str(),
-             size,
-             (size + mb_in_byte - 1) / mb_in_byte);
-    data = std::make_shared<char[]>(size);
-    input.read(data.get(), size);
   }
+  return file_path;
+}
+
+std::pair<RawDataType, size_t> read_binary_from_path(fs::path file_path) {
+  file_path = checked_model_path(std::move(file_path));
+  std::ifstream input{file_path, std::ios::binary};
+  size_t size = fs::file_size(file_path);
+  const static size_t mb_in_byte = 1024 * 1024;
+  log_info("Opening file {} of {} Bytes ({} MB).",
+           file_path.c_str(),
+           size,
+           (size + mb_in_byte - 1) / mb_in_byte);
+  RawDataType data = std::make_shared<char[]>(size);
+  input.read(data.get(), size);
   return std::make_pair(data, size);
 }
 
-void save_as_tflite(fs::path file_path, const tflite::ModelT& model_table) {
+// Read-only mapping of a model file, for commands that only look at a few
+// tables and should not read the weights.
+class MappedFile {
+ public:
+  explicit MappedFile(fs::path file_path)
+      : path_(checked_model_path(std::move(file_path))) {
+    int fd = ::open(path_.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+      log_fatal("Cannot open {}: {}.", path_.string(), std::strerror(errno));
+    }
+    size_ = fs::file_size(path_);
+    if (size_ > 0) {
+      data_ = ::mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    ::close(fd);
+    if (data_ == MAP_FAILED) {
+      log_fatal("Cannot map {}: {}.", path_.string(), std::strerror(errno));
+    }
+  }
+
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+
+  ~MappedFile() {
+    if (data_ != nullptr) {
+      ::munmap(data_, size_);
+    }
+  }
+
+  const uint8_t* data() const {
+    return static_cast<const uint8_t*>(data_);
+  }
+
+  size_t size() const {
+    return size_;
+  }
+
+  const fs::path& path() const {
+    return path_;
+  }
+
+ private:
+  fs::path path_;
+  void* data_ = nullptr;
+  size_t size_ = 0;
+};
+
+// Outputs are always written with the .tflite extension.
+fs::path tflite_path(fs::path file_path) {
   if (!file_path.has_extension() || file_path.extension() != ".tflite") {
     file_path.replace_extension(".tflite");
     log_warning(
@@ -45,18 +113,31 @@ void save_as_tflite(fs::path file_path, const tflite::ModelT& model_table) {
         "format: {}.",
         file_path.string());
   }
+  return file_path;
+}
 
-  flatbuffers::FlatBufferBuilder builder;
-  builder.Finish(tflite::CreateModel(builder, &model_table),
-                 tflite::ModelIdentifier());
-
-  const uint8_t* saved_data = builder.GetBufferPointer();
-  size_t saved_size = builder.GetSize();
-
-  fs::remove_all(file_path);
+// Hands the finished buffer of a leased builder to the writer. The builder
+// stays leased until the writer is done with its bytes.
+void submit_builder(const fs::path& file_path,
+                    flatbuffers::FlatBufferBuilder* builder,
+                    OutputWriter& writer,
+                    BuilderPool& builders) {
+  writer.submit(file_path,
+                builder->GetBufferPointer(),
+                builder->GetSize(),
+                [&builders, builder]() { builders.release(builder); });
+}
 
-  std::ofstream output(file_path, std::ios::binary | std::ios::out);
-  output.write(reinterpret_cast<const char*>(saved_data), saved_size);
+void save_as_tflite(fs::path file_path,
+                    const tflite::ModelT& model_table,
+                    OutputWriter& writer,
+                    BuilderPool& builders,
+                    size_t size_hint,
+                    const WeightLayout& layout) {
+  file_path = tflite_path(std::move(file_path));
+  flatbuffers::FlatBufferBuilder* builder = builders.acquire(size_hint);
+  finish_model(*builder, pack_model(*builder, model_table, layout), layout);
+  submit_builder(file_path, builder, writer, builders);
 }
 
 void save_summary(const tflite::ModelT& model_table,
@@ -66,127 +147,92 @@ void save_summary(const tflite::ModelT& model_table,
   fs::remove_all(summary_path);
   std::ofstream os(summary_path);
 
-  os << model_name << std::endl;
-  os << model_table.subgraphs.size() << std::endl;  // print subgraph numbers
-  for (PtrType<tflite::SubGraphT> subgraph_ptr : model_table.subgraphs) {
+  os << model_name << '\n';
+  os << model_table.subgraphs.size() << '\n';  // print subgraph numbers
+  for (const PtrType<tflite::SubGraphT>& subgraph_ptr :
+       model_table.subgraphs) {
     int n = subgraph_ptr->tensors.size();
 
-    os << n << std::endl;  // print tensor numbers
-    for (PtrType<tflite::TensorT> tensor_ptr : subgraph_ptr->tensors) {
+    os << n << '\n';  // print tensor numbers
+    for (const PtrType<tflite::TensorT>& tensor_ptr : subgraph_ptr->tensors) {
       os << tensor_ptr->name << '\n'
          << tflite::EnumNameTensorType(tensor_ptr->type) << '\t'
          << tensor_ptr->buffer << '\t'
          << model_table.buffers[tensor_ptr->buffer]->data.size() << '\t'
-         << join(tensor_ptr->shape_signature, " ")
-         << std::endl;
+         << join(tensor_ptr->shape_signature, " ") << '\n';
     }
 
-    os << subgraph_ptr->operators.size() << std::endl;
-    for (PtrType<tflite::OperatorT> operator_ptr : subgraph_ptr->operators) {
+    os << subgraph_ptr->operators.size() << '\n';
+    for (const PtrType<tflite::OperatorT>& operator_ptr :
+         subgraph_ptr->operators) {
       std::vector<int32_t> valid_inputs = operator_ptr->inputs,
                            valid_outputs = operator_ptr->outputs;
-      os << '#' << std::endl;
-      os << join(valid_inputs, " ") << std::endl;
-      os << join(valid_outputs, " ") << std::endl;
+      os << "#\n";
+      os << join(valid_inputs, " ") << '\n';
+      os << join(valid_outputs, " ") << '\n';
     }
   }
 }
 
 void save_operator(fs::path save_path,
-                   const tflite::ModelT& model_table,
-                   PtrType<tflite::SubGraphT> subgraph_ptr,
-                   PtrType<tflite::OperatorT> op_ptr) {
-  PtrType<tflite::OperatorT> new_op = make_ptr<tflite::OperatorT>();
-  new_op->opcode_index = op_ptr->opcode_index;
-  new_op->builtin_options = op_ptr->builtin_options;
-  new_op->custom_options = op_ptr->custom_options;
-  new_op->mutating_variable_inputs = op_ptr->mutating_variable_inputs;
-  new_op->intermediates = op_ptr->intermediates;
-
-  std::vector<int32_t> temp_indices;
-  std::unordered_map<int32_t, int32_t> tensor_indices_map;
-  {
-    temp_indices.reserve(op_ptr->inputs.size() + op_ptr->outputs.size());
-    temp_indices.insert(
-        temp_indices.end(), op_ptr->inputs.begin(), op_ptr->inputs.end());
-    temp_indices.insert(
-        temp_indices.end(), op_ptr->outputs.begin(), op_ptr->outputs.end());
-
-    deduplicate(temp_indices);
-
-    int32_t index = 0;
-    for (int x : temp_indices) {
-      tensor_indices_map.try_emplace(x, index++);
-    }
-  }
-
-  new_op->inputs.reserve(op_ptr->inputs.size());
-  for (int32_t input_index : op_ptr->inputs) {
-    new_op->inputs.emplace_back(tensor_indices_map[input_index]);
-  }
-
-  new_op->outputs.reserve(op_ptr->outputs.size());
-  for (int32_t output_index : op_ptr->outputs) {
-    new_op->outputs.emplace_back(tensor_indices_map[output_index]);
-  }
-
-  // bottom-up construction
-
-  tflite::ModelT new_model_table;
-  new_model_table.version = model_table.version;
-  new_model_table.operator_codes = model_table.operator_codes;
-  new_model_table.description = model_table.description;
-
-  PtrType<tflite::SubGraphT>& new_subgraph =
-      new_model_table.subgraphs.emplace_back(make_ptr<tflite::SubGraphT>());
-  new_subgraph->tensors.reserve(temp_indices.size());
-
-  std::vector<uint32_t> buffer_indices;
-  std::unordered_map<uint32_t, uint32_t> buffer_indices_map;
-  {
-    buffer_indices.reserve(temp_indices.size());
-    for (int32_t index : temp_indices) {
-      PtrType<tflite::TensorT> new_tensor_ptr =
-          new_subgraph->tensors.emplace_back(
-              make_ptr<tflite::TensorT>(*subgraph_ptr->tensors[index]));
-      buffer_indices.emplace_back(new_tensor_ptr->buffer);
-    }
-    buffer_indices.emplace_back(0);
-    deduplicate(buffer_indices);
-    uint32_t index = 0;
-    for (int x : buffer_indices) {
-      buffer_indices_map.try_emplace(x, index++);
-    }
-  }
-
-  new_model_table.buffers.reserve(buffer_indices.size());
-  for (int buffer_index : buffer_indices) {
-    new_model_table.buffers.emplace_back(model_table.buffers[buffer_index]);
-  }
+                   OperatorExtractor& extractor,
+                   size_t subgraph_index,
+                   size_t operator_index,
+                   OutputWriter& writer,
+                   BuilderPool& builders) {
+  save_path = tflite_path(std::move(save_path));
+  flatbuffers::FlatBufferBuilder* builder =
+      builders.acquire(extractor.prepare(subgraph_index, operator_index));
+  extractor.pack(*builder);
+  submit_builder(save_path, builder, writer, builders);
+}
 
-  for (PtrType<tflite::TensorT> new_tensor_ptr : new_subgraph->tensors) {
-    new_tensor_ptr->buffer = buffer_indices_map[new_tensor_ptr->buffer];
+// Splits one model per repeated block type, from its first occurrence, and
+// writes the map of blocks to operators.
+void save_blocks(const tflite::ModelT& model_table,
+                 const OperatorCatalog& catalog,
+                 const fs::path& model_name,
+                 const fs::path& model_folder,
+                 std::vector<OperatorExtractor>& extractors,
+                 std::vector<BuilderPool>& builders,
+                 OutputWriter& writer,
+                 size_t jobs) {
+  BlockCatalog blocks = find_repeated_blocks(model_table, catalog);
+  save_block_map(blocks, model_name, model_folder);
+  parallel_for(blocks.blocks.size(), jobs, [&](size_t index, size_t worker) {
+    const BlockType& block = blocks.blocks[index];
+    flatbuffers::FlatBufferBuilder* builder =
+        builders[worker].acquire(extractors[worker].prepare(
+            block.subgraph_index,
+            block.starts.front(),
+            block.starts.front() + block.length));
+    extractors[worker].pack(*builder);
+    submit_builder(
+        model_folder / block_file_name(model_name, block.subgraph_index, index),
+        builder,
+        writer,
+        builders[worker]);
+  });
+
+  size_t blocked = 0;
+  for (const BlockType& block : blocks.blocks) {
+    blocked += block.length * block.starts.size();
   }
-
-  std::function<bool(int32_t)> is_invalid_tensor = [&](int32_t x) -> bool {
-    return new_subgraph->tensors[x]->shape_signature.empty();
-  };
-
-  new_subgraph->inputs = new_op->inputs;
-  std::erase_if(new_subgraph->inputs, is_invalid_tensor);
-
-  new_subgraph->outputs = new_op->outputs;
-  std::erase_if(new_subgraph->outputs, is_invalid_tensor);
-
-  new_subgraph->operators = {new_op};
-  new_subgraph->name = subgraph_ptr->name;
-
-  save_as_tflite(save_path, new_model_table);
+  log_info("Found {} repeated block types covering {} operators.",
+           blocks.blocks.size(),
+           blocked);
 }
 
 void save_operators(const tflite::ModelT& model_table,
                     fs::path model_name,
-                    fs::path root_folder) {
+                    fs::path root_folder,
+                    OutputWriter& writer,
+                    size_t jobs,
+                    const fs::path& fixture_input,
+                    bool unique_ops,
+                    bool split_blocks,
+                    bool save_model,
+                    const WeightLayout& layout) {
   if (fs::exists(root_folder) && !fs::is_directory(root_folder)) {
     log_fatal("{} exists and is not a folder, abort.", root_folder.string());
     return;
@@ -198,32 +244,127 @@ void save_operators(const tflite::ModelT& model_table,
   fs::path model_folder = root_folder / model_name;
   if (fs::exists(model_folder) && !fs::is_directory(model_folder)) {
     log_fatal("{} exists and is not a folder, abort.", model_folder.string());
+  }
+
+  StagedDirectory staged_folder(model_folder);
+  log_info("Staging outputs of {} in {}.",
+           model_folder.string(),
+           staged_folder.path().string());
+
+  OperatorCatalog catalog;
+  if (unique_ops || split_blocks) {
+    catalog = catalog_operators(model_table);
+  }
+  // under --unique_ops only representatives are written
+  const SplitFiles split_files =
+      unique_ops ? representative_files(catalog) : SplitFiles();
+
+  save_summary(model_table, model_name, staged_folder.path());
+  std::vector<GraphAnalysis> analyses = analyze_graph(model_table);
+  save_summary_json(
+      model_table, analyses, split_files, model_name, staged_folder.path());
+  save_graph(model_table, analyses, model_name, staged_folder.path());
+  for (size_t i = 0; i < analyses.size(); ++i) {
+    log_info("Subgraph {}: critical path of {} operators, at most {} wide, "
+             "{:.2f}x from inter-operator parallelism.",
+             i,
+             analyses[i].critical_path.size(),
+             analyses[i].max_width(),
+             analyses[i].speedup());
+  }
+  save_summary_binary(
+      model_table, split_files, model_name, staged_folder.path());
+
+  std::vector<std::pair<size_t, size_t>> operator_indices;
+  if (unique_ops) {
+    // one representative per configuration, plus the map back to all
+    save_catalog(model_table, catalog, model_name, staged_folder.path());
+    size_t operator_count = 0;
+    for (const OperatorClass& op_class : catalog.classes) {
+      operator_indices.emplace_back(op_class.subgraph_index,
+                                    op_class.operator_index);
+      operator_count += op_class.members.size();
+    }
+    log_info("{} operators fall into {} unique configurations.",
+             operator_count,
+             catalog.classes.size());
   } else {
-    log_warning("Cleaning all contents in {}.", model_folder.string());
-    fs::remove_all(model_folder);
-    fs::create_directories(model_folder);
-  }
-
-  save_summary(model_table, model_name, model_folder);
-
-  for (size_t subgraph_index = 0, N = model_table.subgraphs.size();
-       subgraph_index < N;
-       ++subgraph_index) {
-    PtrType<tflite::SubGraphT> subgraph_ptr =
-        model_table.subgraphs[subgraph_index];
-    const PtrContainerType<tflite::OperatorT>& operators =
-        subgraph_ptr->operators;
-    for (size_t operator_index = 0, M = operators.size(); operator_index < M;
-         ++operator_index) {
-      fs::path save_path =
-          model_folder / (model_name.string()
-                              .append("_")
-                              .append(std::to_string(subgraph_index))
-                              .append("_")
-                              .append(std::to_string(operator_index))
-                              .append(".tflite"));
-      save_operator(
-          save_path, model_table, subgraph_ptr, operators[operator_index]);
+    for (size_t subgraph_index = 0, N = model_table.subgraphs.size();
+         subgraph_index < N;
+         ++subgraph_index) {
+      for (size_t operator_index = 0,
+                  M = model_table.subgraphs[subgraph_index]->operators.size();
+           operator_index < M;
+           ++operator_index) {
+        operator_indices.emplace_back(subgraph_index, operator_index);
+      }
     }
   }
+
+  std::vector<BuilderPool> builders(std::max<size_t>(jobs, 1));
+  std::vector<OperatorExtractor> extractors(
+      std::max<size_t>(jobs, 1), OperatorExtractor(model_table, layout));
+#ifdef SPLIT_TFLITE_ALLOC_STATS
+  size_t allocations = allocation_count();
+#endif
+  std::chrono::steady_clock::time_point start =
+      std::chrono::steady_clock::now();
+  if (save_model) {
+    // the whole transformed model, next to its operators
+    size_t size_hint = 1 << 20;
+    for (const PtrType<tflite::BufferT>& buffer : model_table.buffers) {
+      size_hint += layout.reserve(buffer->data.size());
+    }
+    save_as_tflite(staged_folder.path() / (model_name.string() + ".tflite"),
+                   model_table,
+                   writer,
+                   builders[0],
+                   size_hint,
+                   layout);
+  }
+  parallel_for(operator_indices.size(), jobs, [&](size_t index, size_t worker) {
+    auto [subgraph_index, operator_index] = operator_indices[index];
+    fs::path save_path =
+        staged_folder.path() /
+        operator_file_name(model_name, subgraph_index, operator_index);
+    save_operator(save_path,
+                  extractors[worker],
+                  subgraph_index,
+                  operator_index,
+                  writer,
+                  builders[worker]);
+  });
+  if (split_blocks) {
+    save_blocks(model_table,
+                catalog,
+                model_name,
+                staged_folder.path(),
+                extractors,
+                builders,
+                writer,
+                jobs);
+  }
+  if (!fixture_input.empty()) {
+    save_fixtures(model_table,
+                  model_name,
+                  staged_folder.path(),
+                  fixture_input,
+                  writer);
+  }
+  writer.drain();
+  std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+  log_info("Wrote {} operators with {} on {} threads in {:.3f} s ({:.0f}/s).",
+           operator_indices.size(),
+           writer.name(),
+           std::min(jobs, std::max<size_t>(operator_indices.size(), 1)),
+           elapsed.count(),
+           operator_indices.size() / std::max(elapsed.count(), 1e-9));
+#ifdef SPLIT_TFLITE_ALLOC_STATS
+  log_info("Split used {:.1f} allocations per operator.",
+           static_cast<double>(allocation_count() - allocations) /
+               std::max<size_t>(operator_indices.size(), 1));
+#endif
+
+  staged_folder.commit(jobs);
 }
@@ -0,0 +1,328 @@
+#pragma once
+
+#include <algorithm>  // std::max
+#include <cstddef>    // size_t
+#include <cstdint>    // int32_t uint8_t uint32_t
+#include <cstring>    // std::memcpy
+#include <optional>   // std::optional
+#include <string>     // std::string
+#include <utility>    // std::move
+#include <vector>     // std::vector
+
+#include "def.h"
+#include "executor.h"
+#include "fold.h"
+#include "log.h"
+#include "schema.h"
+#include "tflite_generated.hpp"
+
+// Float graph rewrites that merge an operator into the one producing its
+// input, when that producer's output has no other reader:
+//
+// - a MUL or ADD by a per-channel constant after a convolution or fully
+//   connected operator, as batch normalization leaves behind, scales the
+//   weights and bias or shifts the bias;
+// - a RELU, RELU6 or RELU_N1_TO_1 after a convolution, fully connected, ADD
+//   or MUL becomes the fused activation of that operator.
+//
+// The merged operator takes over the output of the removed one. Rewritten
+// weights and biases are new tensors on new buffers, so weights shared with
+// other operators stay as they are.
+
+namespace detail {
+
+// Axis of the output channels in the weights (input 1) of operators that
+// take a per-channel bias (input 2), or -1.
+int32_t output_channel_axis(tflite::BuiltinOperator builtin) {
+  switch (builtin) {
+    case tflite::BuiltinOperator::CONV_2D:
+    case tflite::BuiltinOperator::FULLY_CONNECTED: {
+      return 0;
+    }
+    case tflite::BuiltinOperator::DEPTHWISE_CONV_2D: {
+      return 3;
+    }
+    default: {
+      return -1;
+    }
+  }
+}
+
+// Fused activation of an operator, or nullptr if it cannot carry one.
+// Options that default sensibly are created where missing.
+tflite::ActivationFunctionType* fused_activation(
+    tflite::OperatorT& op,
+    tflite::BuiltinOperator builtin) {
+  tflite::BuiltinOptionsUnion& options = op.builtin_options;
+  switch (builtin) {
+    case tflite::BuiltinOperator::CONV_2D: {
+      tflite::Conv2DOptionsT* o = options.AsConv2DOptions();
+      return o ? &o->fused_activation_function : nullptr;
+    }
+    case tflite::BuiltinOperator::DEPTHWISE_CONV_2D: {
+      tflite::DepthwiseConv2DOptionsT* o = options.AsDepthwiseConv2DOptions();
+      return o ? &o->fused_activation_function : nullptr;
+    }
+    case tflite::BuiltinOperator::FULLY_CONNECTED: {
+      if (options.AsFullyConnectedOptions() == nullptr) {
+        options.Set(tflite::FullyConnectedOptionsT());
+      }
+      return &options.AsFullyConnectedOptions()->fused_activation_function;
+    }
+    case tflite::BuiltinOperator::ADD: {
+      if (options.AsAddOptions() == nullptr) {
+        options.Set(tflite::AddOptionsT());
+      }
+      return &options.AsAddOptions()->fused_activation_function;
+    }
+    case tflite::BuiltinOperator::MUL: {
+      if (options.AsMulOptions() == nullptr) {
+        options.Set(tflite::MulOptionsT());
+      }
+      return &options.AsMulOptions()->fused_activation_function;
+    }
+    default: {
+      return nullptr;
+    }
+  }
+}
+
+std::optional<tflite::ActivationFunctionType> activation_operator(
+    tflite::BuiltinOperator builtin) {
+  switch (builtin) {
+    case tflite::BuiltinOperator::RELU: {
+      return tflite::ActivationFunctionType::RELU;
+    }
+    case tflite::BuiltinOperator::RELU6: {
+      return tflite::ActivationFunctionType::RELU6;
+    }
+    case tflite::BuiltinOperator::RELU_N1_TO_1: {
+      return tflite::ActivationFunctionType::RELU_N1_TO_1;
+    }
+    default: {
+      return std::nullopt;
+    }
+  }
+}
+
+// Float values of a constant FLOAT32 tensor.
+std::optional<TensorValue> float_constant(const tflite::ModelT& model_table,
+                                          const tflite::SubGraphT& subgraph,
+                                          int32_t tensor_index) {
+  if (tensor_index < 0 ||
+      subgraph.tensors[tensor_index]->type != tflite::TensorType::FLOAT32 ||
+      !is_constant(model_table, *subgraph.tensors[tensor_index])) {
+    return std::nullopt;
+  }
+  return constant_value(model_table, *subgraph.tensors[tensor_index]);
+}
+
+// Adds a FLOAT32 constant tensor on a new buffer and returns its index.
+int32_t add_float_constant(tflite::ModelT& model_table,
+                           tflite::SubGraphT& subgraph,
+                           std::string name,
+                           const TensorValue& value) {
+  auto buffer = make_ptr<tflite::BufferT>();
+  buffer->data.resize(value.data.size() * sizeof(float));
+  std::memcpy(buffer->data.data(), value.data.data(), buffer->data.size());
+  model_table.buffers.emplace_back(std::move(buffer));
+
+  auto tensor = make_ptr<tflite::TensorT>();
+  tensor->name = std::move(name);
+  tensor->shape = value.shape;
+  tensor->type = tflite::TensorType::FLOAT32;
+  tensor->buffer = model_table.buffers.size() - 1;
+  subgraph.tensors.emplace_back(std::move(tensor));
+  return subgraph.tensors.size() - 1;
+}
+
+// Folds `op`, a MUL or ADD of the output of `producer` and a constant with
+// one value or one per output channel, into the weights and bias of
+// `producer`. Returns false, changing nothing, if it does not apply.
+bool fold_affine(tflite::ModelT& model_table,
+                 tflite::SubGraphT& subgraph,
+                 tflite::OperatorT& producer,
+                 tflite::BuiltinOperator producer_builtin,
+                 const tflite::OperatorT& op,
+                 bool multiply,
+                 int32_t input) {
+  const int32_t axis = output_channel_axis(producer_builtin);
+  if (axis < 0 || producer.inputs.size() < 2) {
+    return false;
+  }
+  const int32_t other = op.inputs[op.inputs[0] == input ? 1 : 0];
+  std::optional<TensorValue> weights =
+      float_constant(model_table, subgraph, producer.inputs[1]);
+  std::optional<TensorValue> factor =
+      float_constant(model_table, subgraph, other);
+  if (!weights.has_value() || !factor.has_value() ||
+      static_cast<int32_t>(weights->shape.size()) <= axis) {
+    return false;
+  }
+  const size_t channels = weights->shape[axis];
+  for (size_t d = 0; d + 1 < factor->shape.size(); ++d) {
+    if (factor->shape[d] != 1) {
+      return false;
+    }
+  }
+  if (factor->data.size() != 1 && factor->data.size() != channels) {
+    return false;
+  }
+  auto at = [&](size_t channel) {
+    return factor->data[factor->data.size() == 1 ? 0 : channel];
+  };
+
+  TensorValue bias{{static_cast<int32_t>(channels)},
+                   std::vector<float>(channels, 0.0f)};
+  if (producer.inputs.size() > 2 && producer.inputs[2] >= 0) {
+    std::optional<TensorValue> current =
+        float_constant(model_table, subgraph, producer.inputs[2]);
+    if (!current.has_value() || current->data.size() != channels) {
+      return false;
+    }
+    bias.data = std::move(current->data);
+  }
+
+  const std::string name = subgraph.tensors[producer.inputs[1]]->name;
+  if (multiply) {
+    size_t inner = 1;
+    for (size_t d = axis + 1; d < weights->shape.size(); ++d) {
+      inner *= weights->shape[d];
+    }
+    for (size_t i = 0; i < weights->data.size(); ++i) {
+      weights->data[i] *= at(i / inner % channels);
+    }
+    for (size_t c = 0; c < channels; ++c) {
+      bias.data[c] *= at(c);
+    }
+    producer.inputs[1] =
+        add_float_constant(model_table, subgraph, name + "_folded", *weights);
+  } else {
+    for (size_t c = 0; c < channels; ++c) {
+      bias.data[c] += at(c);
+    }
+  }
+  producer.inputs.resize(std::max<size_t>(producer.inputs.size(), 3), -1);
+  producer.inputs[2] =
+      add_float_constant(model_table, subgraph, name + "_bias_folded", bias);
+  return true;
+}
+
+// One pass of rewrites over a subgraph. Returns the number of operators
+// removed.
+size_t fuse_subgraph(tflite::ModelT& model_table,
+                     tflite::SubGraphT& subgraph) {
+  const size_t n_tensors = subgraph.tensors.size();
+  std::vector<int32_t> producer(n_tensors, -1);
+  std::vector<uint32_t> readers(n_tensors, 0);
+  for (size_t i = 0; i < subgraph.operators.size(); ++i) {
+    for (int32_t input : subgraph.operators[i]->inputs) {
+      if (input >= 0) {
+        ++readers[input];
+      }
+    }
+    for (int32_t output : subgraph.operators[i]->outputs) {
+      if (output >= 0) {
+        producer[output] = i;
+      }
+    }
+  }
+  for (int32_t output : subgraph.outputs) {
+    ++readers[output];
+  }
+
+  auto builtin = [&](const tflite::OperatorT& op) {
+    return builtin_code(*model_table.operator_codes[op.opcode_index]);
+  };
+  auto is_float = [&](int32_t tensor_index) {
+    return subgraph.tensors[tensor_index]->type == tflite::TensorType::FLOAT32;
+  };
+  std::vector<bool> removed(subgraph.operators.size(), false);
+  size_t fused = 0;
+  for (size_t j = 0; j < subgraph.operators.size(); ++j) {
+    tflite::OperatorT& op = *subgraph.operators[j];
+    const tflite::BuiltinOperator op_builtin = builtin(op);
+    const std::optional<tflite::ActivationFunctionType> activation =
+        activation_operator(op_builtin);
+    const bool affine = op_builtin == tflite::BuiltinOperator::MUL ||
+                        op_builtin == tflite::BuiltinOperator::ADD;
+    if ((!activation.has_value() && !affine) || op.outputs.size() != 1 ||
+        op.outputs[0] < 0 || !is_float(op.outputs[0])) {
+      continue;
+    }
+
+    // the operand computed by the candidate producer
+    int32_t input = -1;
+    for (size_t k = 0; k < (affine ? 2 : 1) && k < op.inputs.size(); ++k) {
+      const int32_t t = op.inputs[k];
+      if (t >= 0 && producer[t] >= 0 && !removed[producer[t]] &&
+          readers[t] == 1 && is_float(t)) {
+        input = t;
+      }
+    }
+    if (input < 0) {
+      continue;
+    }
+    tflite::OperatorT& source = *subgraph.operators[producer[input]];
+    const tflite::BuiltinOperator source_builtin = builtin(source);
+    if (source.outputs.size() != 1 || source.outputs[0] != input) {
+      continue;  // rewritten earlier in this pass
+    }
+    tflite::ActivationFunctionType* source_activation =
+        fused_activation(source, source_builtin);
+    if (source_activation == nullptr ||
+        *source_activation != tflite::ActivationFunctionType::NONE) {
+      continue;
+    }
+
+    if (activation.has_value()) {
+      *source_activation = *activation;
+    } else {
+      if (op.inputs.size() != 2 ||
+          !fold_affine(model_table,
+                       subgraph,
+                       source,
+                       source_builtin,
+                       op,
+                       op_builtin == tflite::BuiltinOperator::MUL,
+                       input)) {
+        continue;
+      }
+      *source_activation = *fused_activation(op, op_builtin);
+    }
+    source.outputs[0] = op.outputs[0];
+    removed[j] = true;
+    ++fused;
+  }
+
+  PtrContainerType<tflite::OperatorT> kept;
+  kept.reserve(subgraph.operators.size() - fused);
+  for (size_t i = 0; i < subgraph.operators.size(); ++i) {
+    if (!removed[i]) {
+      kept.emplace_back(std::move(subgraph.operators[i]));
+    }
+  }
+  subgraph.operators = std::move(kept);
+  return fused;
+}
+
+}  // namespace detail
+
+// Applies the rewrites to every subgraph until none applies. Returns the
+// number of operators removed.
+size_t fuse_operators(tflite::ModelT& model_table) {
+  size_t fused = 0;
+  for (const PtrType<tflite::SubGraphT>& subgraph : model_table.subgraphs) {
+    size_t round = 0;
+    do {
+      round = detail::fuse_subgraph(model_table, *subgraph);
+      fused += round;
+    } while (round > 0);
+  }
+  size_t released = detail::release_unread_buffers(model_table);
+  log_info("Fused {} operators into their producers, releasing {} KB of "
+           "replaced weights.",
+           fused,
+           released >> 10);
+  return fused;
+}
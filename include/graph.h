@@ -0,0 +1,268 @@
+#pragma once
+
+#include <algorithm>  // std::max std::ranges::reverse
+#include <cstddef>    // size_t
+#include <cstdint>    // int32_t uint32_t uint64_t
+#include <vector>     // std::vector
+
+#include <fmt/format.h>
+
+#include "buffered_output.h"
+#include "def.h"
+#include "schema.h"
+#include "tflite_generated.hpp"
+#include "utility.h"
+
+// Dataflow analysis of the operators of a subgraph. An operator depends on
+// the producers of its inputs; with every operator weighted by an estimate
+// of its cost, the longest weighted chain bounds the latency of any
+// schedule, and total cost over that bound is the speedup inter-operator
+// parallelism could give at most. Levels group operators by their longest
+// unweighted distance from a source; the width of a level is how many
+// operators could run side by side there.
+
+struct GraphAnalysis {
+  std::vector<uint64_t> cost;  // per operator
+  std::vector<std::vector<uint32_t>> predecessors;
+  std::vector<uint32_t> level;  // per operator
+  std::vector<uint32_t> width;  // operators per level
+  std::vector<uint32_t> critical_path;  // operator indices, in order
+  uint64_t work = 0;
+  uint64_t span = 0;  // cost of the critical path
+
+  double speedup() const {
+    return span == 0 ? 1.0 : static_cast<double>(work) / span;
+  }
+
+  uint32_t max_width() const {
+    return width.empty() ? 0 : *std::ranges::max_element(width);
+  }
+};
+
+namespace detail {
+
+uint64_t known_elements(const tflite::TensorT& tensor) {
+  return static_cast<uint64_t>(std::max<int64_t>(element_count(tensor.shape),
+                                                 1));
+}
+
+int32_t dim(const tflite::TensorT& tensor, size_t axis) {
+  return axis < tensor.shape.size() ? std::max(tensor.shape[axis], 1) : 1;
+}
+
+}  // namespace detail
+
+// Estimated cost of an operator: multiply-accumulates for the operators
+// that are dominated by them, elements read and written for the others.
+uint64_t operator_cost(const tflite::ModelT& model_table,
+                       const tflite::SubGraphT& subgraph,
+                       const tflite::OperatorT& op) {
+  auto tensor = [&](size_t i, const std::vector<int32_t>& indices)
+      -> const tflite::TensorT* {
+    return i < indices.size() && indices[i] >= 0
+               ? subgraph.tensors[indices[i]].get()
+               : nullptr;
+  };
+  const tflite::TensorT* input = tensor(0, op.inputs);
+  const tflite::TensorT* weights = tensor(1, op.inputs);
+  const tflite::TensorT* output = tensor(0, op.outputs);
+  if (output != nullptr && weights != nullptr) {
+    const uint64_t out = detail::known_elements(*output);
+    switch (builtin_code(*model_table.operator_codes[op.opcode_index])) {
+      case tflite::BuiltinOperator::CONV_2D: {
+        return out * detail::dim(*weights, 1) * detail::dim(*weights, 2) *
+               detail::dim(*weights, 3);
+      }
+      case tflite::BuiltinOperator::DEPTHWISE_CONV_2D: {
+        return out * detail::dim(*weights, 1) * detail::dim(*weights, 2);
+      }
+      case tflite::BuiltinOperator::CONV_3D: {
+        return out * detail::dim(*weights, 0) * detail::dim(*weights, 1) *
+               detail::dim(*weights, 2) * detail::dim(*weights, 3);
+      }
+      case tflite::BuiltinOperator::FULLY_CONNECTED: {
+        return out * detail::dim(*weights, 1);
+      }
+      case tflite::BuiltinOperator::BATCH_MATMUL: {
+        return input == nullptr
+                   ? out
+                   : out * detail::dim(*input, input->shape.size() - 1);
+      }
+      case tflite::BuiltinOperator::TRANSPOSE_CONV: {
+        // inputs are output shape, filter, activations
+        const tflite::TensorT* activations = tensor(2, op.inputs);
+        return activations == nullptr
+                   ? out
+                   : detail::known_elements(*activations) *
+                         detail::dim(*weights, 0) * detail::dim(*weights, 1) *
+                         detail::dim(*weights, 2);
+      }
+      default: {
+        break;
+      }
+    }
+  }
+  uint64_t elements = 0;
+  for (const std::vector<int32_t>* indices : {&op.inputs, &op.outputs}) {
+    for (size_t i = 0; i < indices->size(); ++i) {
+      if (const tflite::TensorT* t = tensor(i, *indices)) {
+        elements += detail::known_elements(*t);
+      }
+    }
+  }
+  return std::max<uint64_t>(elements, 1);
+}
+
+GraphAnalysis analyze_subgraph(const tflite::ModelT& model_table,
+                               const tflite::SubGraphT& subgraph) {
+  const size_t n = subgraph.operators.size();
+  GraphAnalysis analysis;
+  analysis.cost.resize(n);
+  analysis.predecessors.resize(n);
+  analysis.level.assign(n, 0);
+
+  std::vector<int32_t> producer(subgraph.tensors.size(), -1);
+  for (size_t i = 0; i < n; ++i) {
+    for (int32_t output : subgraph.operators[i]->outputs) {
+      if (output >= 0) {
+        producer[output] = i;
+      }
+    }
+  }
+
+  // tflite stores operators in an executable order, so predecessors come
+  // first and one forward pass settles every chain
+  std::vector<uint64_t> finish(n, 0);
+  std::vector<int32_t> critical_predecessor(n, -1);
+  for (size_t i = 0; i < n; ++i) {
+    const tflite::OperatorT& op = *subgraph.operators[i];
+    analysis.cost[i] = operator_cost(model_table, subgraph, op);
+    analysis.work += analysis.cost[i];
+
+    std::vector<uint32_t>& predecessors = analysis.predecessors[i];
+    for (int32_t input : op.inputs) {
+      if (input >= 0 && producer[input] >= 0 &&
+          static_cast<size_t>(producer[input]) < i) {
+        predecessors.emplace_back(producer[input]);
+      }
+    }
+    deduplicate(predecessors);
+
+    uint64_t start = 0;
+    for (uint32_t p : predecessors) {
+      analysis.level[i] = std::max(analysis.level[i], analysis.level[p] + 1);
+      if (critical_predecessor[i] < 0 || finish[p] > start) {
+        start = finish[p];
+        critical_predecessor[i] = p;
+      }
+    }
+    finish[i] = start + analysis.cost[i];
+
+    if (analysis.width.size() <= analysis.level[i]) {
+      analysis.width.resize(analysis.level[i] + 1, 0);
+    }
+    ++analysis.width[analysis.level[i]];
+  }
+
+  if (n > 0) {
+    int32_t last = std::ranges::max_element(finish) - finish.begin();
+    analysis.span = finish[last];
+    for (int32_t i = last; i >= 0; i = critical_predecessor[i]) {
+      analysis.critical_path.emplace_back(i);
+    }
+    std::ranges::reverse(analysis.critical_path);
+  }
+  return analysis;
+}
+
+std::vector<GraphAnalysis> analyze_graph(const tflite::ModelT& model_table) {
+  std::vector<GraphAnalysis> analyses;
+  analyses.reserve(model_table.subgraphs.size());
+  for (const PtrType<tflite::SubGraphT>& subgraph : model_table.subgraphs) {
+    analyses.emplace_back(analyze_subgraph(model_table, *subgraph));
+  }
+  return analyses;
+}
+
+// Writes the operator DAG of every subgraph as <model>.graph.dot, one
+// cluster per subgraph with the critical path in red, and as
+// <model>.graph.json with costs, levels and edges.
+void save_graph(const tflite::ModelT& model_table,
+                const std::vector<GraphAnalysis>& analyses,
+                const fs::path& model_name,
+                const fs::path& model_folder) {
+  {
+    detail::FilePtr file = detail::open_for_writing(
+        model_folder / (model_name.string() + ".graph.dot"));
+    BufferedOutput out(file.get());
+    out.print("digraph {{\nnode [shape=box];\n");
+    for (size_t s = 0; s < analyses.size(); ++s) {
+      const GraphAnalysis& analysis = analyses[s];
+      const tflite::SubGraphT& subgraph = *model_table.subgraphs[s];
+      std::vector<bool> critical(analysis.cost.size(), false);
+      for (uint32_t i : analysis.critical_path) {
+        critical[i] = true;
+      }
+      out.print("subgraph cluster_{} {{\nlabel=", s);
+      detail::print_json_string(
+          out,
+          fmt::format("{} speedup {:.2f} width {}",
+                      subgraph.name.empty() ? fmt::format("subgraph {}", s)
+                                            : subgraph.name,
+                      analysis.speedup(),
+                      analysis.max_width()));
+      out.print(";\n");
+      for (size_t i = 0; i < analysis.cost.size(); ++i) {
+        const tflite::OperatorT& op = *subgraph.operators[i];
+        out.print("s{}_{} [label=\"{} {}\\ncost {}\"{}];\n",
+                  s,
+                  i,
+                  i,
+                  opcode_name(*model_table.operator_codes[op.opcode_index]),
+                  analysis.cost[i],
+                  critical[i] ? " color=red" : "");
+        for (uint32_t p : analysis.predecessors[i]) {
+          out.print("s{}_{} -> s{}_{}{};\n",
+                    s,
+                    p,
+                    s,
+                    i,
+                    critical[i] && critical[p] ? " [color=red]" : "");
+        }
+      }
+      out.print("}}\n");
+    }
+    out.print("}}\n");
+  }
+
+  detail::FilePtr file = detail::open_for_writing(
+      model_folder / (model_name.string() + ".graph.json"));
+  BufferedOutput out(file.get());
+  out.print("{{\n\"model\": ");
+  detail::print_json_string(out, model_name.string());
+  out.print(",\n\"subgraphs\": [");
+  for (size_t s = 0; s < analyses.size(); ++s) {
+    const GraphAnalysis& analysis = analyses[s];
+    const tflite::SubGraphT& subgraph = *model_table.subgraphs[s];
+    out.print("{}\n{{\"work\": {}, \"span\": {}, \"speedup\": {:.4f}, "
+              "\"width\": [{}], \"critical_path\": [{}],\n\"operators\": [",
+              s == 0 ? "" : ",",
+              analysis.work,
+              analysis.span,
+              analysis.speedup(),
+              fmt::join(analysis.width, ", "),
+              fmt::join(analysis.critical_path, ", "));
+    for (size_t i = 0; i < analysis.cost.size(); ++i) {
+      const tflite::OperatorT& op = *subgraph.operators[i];
+      out.print("{}\n{{\"opcode\": ", i == 0 ? "" : ",");
+      detail::print_json_string(
+          out, opcode_name(*model_table.operator_codes[op.opcode_index]));
+      out.print(", \"cost\": {}, \"level\": {}, \"predecessors\": [{}]}}",
+                analysis.cost[i],
+                analysis.level[i],
+                fmt::join(analysis.predecessors[i], ", "));
+    }
+    out.print("]}}");
+  }
+  out.print("]\n}}\n");
+}
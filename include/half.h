@@ -0,0 +1,125 @@
+#pragma once
+
+#include <immintrin.h>
+
+#include <algorithm>  // std::min
+#include <cstddef>    // size_t
+#include <cstdint>    // uint16_t uint32_t
+#include <cstring>    // std::memcpy
+
+#include "parallel.h"
+
+// IEEE half precision conversion. The bulk conversion uses AVX-512F or F16C
+// when the CPU has them, chosen once at run time, so the binary keeps
+// running on machines without either.
+
+float half_to_float(uint16_t half) {
+  uint32_t sign = static_cast<uint32_t>(half & 0x8000) << 16,
+           exponent = (half >> 10) & 0x1f, mantissa = half & 0x3ff, bits;
+  if (exponent == 0x1f) {
+    bits = sign | 0x7f800000 | (mantissa << 13);
+  } else if (exponent != 0) {
+    bits = sign | ((exponent + 112) << 23) | (mantissa << 13);
+  } else if (mantissa == 0) {
+    bits = sign;
+  } else {  // subnormal: renormalize
+    exponent = 113;
+    while ((mantissa & 0x400) == 0) {
+      mantissa <<= 1;
+      --exponent;
+    }
+    bits = sign | (exponent << 23) | ((mantissa & 0x3ff) << 13);
+  }
+  float value;
+  std::memcpy(&value, &bits, sizeof(value));
+  return value;
+}
+
+// Rounds to nearest even, overflowing to infinity, like the hardware does.
+uint16_t float_to_half(float value) {
+  uint32_t bits;
+  std::memcpy(&bits, &value, sizeof(bits));
+  const uint32_t sign = (bits >> 16) & 0x8000;
+  const uint32_t magnitude = bits & 0x7fffffff;
+  if (magnitude >= 0x7f800000) {  // inf or nan, keeping nan quiet
+    return sign | 0x7c00 | (magnitude > 0x7f800000 ? 0x200 : 0);
+  }
+  if (magnitude >= 0x477ff000) {  // rounds beyond the largest half
+    return sign | 0x7c00;
+  }
+  if (magnitude < 0x38800000) {  // subnormal half or zero
+    if (magnitude < 0x33000000) {
+      return sign;
+    }
+    const uint32_t exponent = magnitude >> 23;
+    const uint32_t mantissa = (magnitude & 0x7fffff) | 0x800000;
+    const uint32_t shift = 126 - exponent;
+    uint32_t half = mantissa >> shift;
+    const uint32_t rest = mantissa & ((1u << shift) - 1),
+                   halfway = 1u << (shift - 1);
+    half += rest > halfway || (rest == halfway && (half & 1));
+    return sign | half;
+  }
+  uint32_t half = (magnitude - 0x38000000) >> 13;
+  const uint32_t rest = magnitude & 0x1fff;
+  half += rest > 0x1000 || (rest == 0x1000 && (half & 1));
+  return sign | half;
+}
+
+namespace detail {
+
+void float_to_half_scalar(const float* in, uint16_t* out, size_t n) {
+  for (size_t i = 0; i < n; ++i) {
+    out[i] = float_to_half(in[i]);
+  }
+}
+
+[[gnu::target("avx,f16c")]] void float_to_half_f16c(const float* in,
+                                                    uint16_t* out,
+                                                    size_t n) {
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m128i half = _mm256_cvtps_ph(_mm256_loadu_ps(in + i),
+                                   _MM_FROUND_TO_NEAREST_INT);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), half);
+  }
+  float_to_half_scalar(in + i, out + i, n - i);
+}
+
+[[gnu::target("avx512f")]] void float_to_half_avx512(const float* in,
+                                                    uint16_t* out,
+                                                    size_t n) {
+  size_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    __m256i half = _mm512_cvtps_ph(_mm512_loadu_ps(in + i),
+                                   _MM_FROUND_TO_NEAREST_INT);
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i), half);
+  }
+  float_to_half_scalar(in + i, out + i, n - i);
+}
+
+using HalfConversion = void (*)(const float*, uint16_t*, size_t);
+
+HalfConversion select_float_to_half() {
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f")) {
+    return float_to_half_avx512;
+  } else if (__builtin_cpu_supports("f16c")) {
+    return float_to_half_f16c;
+  }
+  return float_to_half_scalar;
+}
+
+}  // namespace detail
+
+// Converts `n` floats to halves. Large arrays are cut into slices that are
+// converted on up to `jobs` threads; a single core cannot saturate memory
+// bandwidth on multi-gigabyte weights.
+void float_to_half(const float* in, uint16_t* out, size_t n, size_t jobs = 1) {
+  static const detail::HalfConversion convert = detail::select_float_to_half();
+  constexpr size_t slice = 1 << 18;
+  parallel_for((n + slice - 1) / slice, jobs, [&](size_t index) {
+    const size_t begin = index * slice;
+    convert(in + begin, out + begin, std::min(slice, n - begin));
+  });
+}
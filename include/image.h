@@ -0,0 +1,174 @@
+#pragma once
+
+#include <png.h>
+
+#include <algorithm>  // std::clamp std::max std::min
+#include <cmath>      // std::abs std::lround
+#include <cstddef>    // size_t
+#include <cstdint>    // int32_t uint8_t
+#include <optional>   // std::optional std::nullopt
+#include <vector>     // std::vector
+
+#include <fmt/format.h>
+
+#include "def.h"
+#include "executor.h"
+#include "log.h"
+
+// 8-bit interleaved image.
+struct Image {
+  size_t width = 0;
+  size_t height = 0;
+  size_t channels = 0;
+  std::vector<uint8_t> pixels;
+};
+
+// Loads a PNG as 8-bit RGB. The alpha channel is dropped rather than
+// composited, which is what PIL's convert('RGB') does.
+std::optional<Image> load_png_rgb(const fs::path& file_path) {
+  png_image png{};
+  png.version = PNG_IMAGE_VERSION;
+  if (!png_image_begin_read_from_file(&png, file_path.c_str())) {
+    log_error("Cannot read {}: {}.", file_path.string(), png.message);
+    return std::nullopt;
+  }
+  png.format = PNG_FORMAT_RGBA;
+  std::vector<uint8_t> rgba(PNG_IMAGE_SIZE(png));
+  if (!png_image_finish_read(&png, nullptr, rgba.data(), 0, nullptr)) {
+    log_error("Cannot decode {}: {}.", file_path.string(), png.message);
+    png_image_free(&png);
+    return std::nullopt;
+  }
+
+  Image image{png.width, png.height, 3, {}};
+  image.pixels.resize(image.width * image.height * 3);
+  for (size_t i = 0, n = image.width * image.height; i < n; ++i) {
+    image.pixels[3 * i] = rgba[4 * i];
+    image.pixels[3 * i + 1] = rgba[4 * i + 1];
+    image.pixels[3 * i + 2] = rgba[4 * i + 2];
+  }
+  return image;
+}
+
+namespace detail {
+
+float bicubic(float x) {
+  constexpr float a = -0.5f;
+  x = std::abs(x);
+  if (x < 1.0f) {
+    return ((a + 2.0f) * x - (a + 3.0f)) * x * x + 1.0f;
+  } else if (x < 2.0f) {
+    return (((x - 5.0f) * x + 8.0f) * x - 4.0f) * a;
+  }
+  return 0.0f;
+}
+
+// Resamples one axis. `stride` steps between samples along the axis,
+// `pitch` between the lines of the other axis.
+void resample_axis(const std::vector<uint8_t>& input,
+                   size_t in_size,
+                   size_t out_size,
+                   size_t lines,
+                   size_t in_line_pitch,
+                   size_t out_line_pitch,
+                   size_t in_stride,
+                   size_t out_stride,
+                   size_t channels,
+                   std::vector<uint8_t>& output) {
+  // like Pillow, widen the kernel when shrinking so every input pixel counts
+  const float scale = static_cast<float>(in_size) / out_size,
+              filter_scale = std::max(scale, 1.0f),
+              support = 2.0f * filter_scale;
+  std::vector<float> weights;
+  for (size_t o = 0; o < out_size; ++o) {
+    const float center = (o + 0.5f) * scale;
+    const size_t first = static_cast<size_t>(
+                     std::max(static_cast<int32_t>(center - support + 0.5f),
+                              0)),
+                 last = std::min(static_cast<size_t>(center + support + 0.5f),
+                                 in_size);
+    weights.assign(last - first, 0.0f);
+    float total = 0.0f;
+    for (size_t i = first; i < last; ++i) {
+      weights[i - first] = bicubic((i - center + 0.5f) / filter_scale);
+      total += weights[i - first];
+    }
+    for (float& weight : weights) {
+      weight = total != 0.0f ? weight / total : 0.0f;
+    }
+
+    for (size_t line = 0; line < lines; ++line) {
+      for (size_t c = 0; c < channels; ++c) {
+        float acc = 0.0f;
+        for (size_t i = first; i < last; ++i) {
+          acc += weights[i - first] *
+                 input[line * in_line_pitch + i * in_stride + c];
+        }
+        output[line * out_line_pitch + o * out_stride + c] =
+            static_cast<uint8_t>(std::clamp(std::lround(acc), 0L, 255L));
+      }
+    }
+  }
+}
+
+}  // namespace detail
+
+// Bicubic resize in two separable passes, horizontal first, each rounded to
+// 8 bits, following Pillow's Image.resize.
+Image resize_bicubic(const Image& image, size_t width, size_t height) {
+  const size_t c = image.channels;
+  Image wide{width, image.height, c, {}};
+  wide.pixels.resize(width * image.height * c);
+  detail::resample_axis(image.pixels,
+                        image.width,
+                        width,
+                        image.height,
+                        image.width * c,
+                        width * c,
+                        c,
+                        c,
+                        c,
+                        wide.pixels);
+
+  Image resized{width, height, c, {}};
+  resized.pixels.resize(width * height * c);
+  detail::resample_axis(wide.pixels,
+                        image.height,
+                        height,
+                        width,
+                        c,
+                        c,
+                        width * c,
+                        width * c,
+                        c,
+                        resized.pixels);
+  return resized;
+}
+
+// Turns a PNG into the value of an NHWC float input: resized to the input's
+// height and width, scaled to [0, 1] and repeated over the batch, as
+// src/test.py prepares coffee.png.
+std::optional<TensorValue> image_input(const fs::path& file_path,
+                                       const std::vector<int32_t>& shape) {
+  if (shape.size() != 4 || shape[3] != 3 ||
+      std::ranges::any_of(shape, [](int32_t dim) { return dim <= 0; })) {
+    log_error("Cannot feed {} to an input of shape [{}], expect [N, H, W, 3].",
+              file_path.string(),
+              fmt::join(shape, ", "));
+    return std::nullopt;
+  }
+  std::optional<Image> image = load_png_rgb(file_path);
+  if (!image.has_value()) {
+    return std::nullopt;
+  }
+  Image resized = resize_bicubic(*image, shape[2], shape[1]);
+
+  TensorValue value{shape, {}};
+  value.data.reserve(resized.pixels.size() * shape[0]);
+  for (int32_t batch = 0; batch < shape[0]; ++batch) {
+    for (uint8_t pixel : resized.pixels) {
+      value.data.emplace_back(pixel / 255.0f);
+    }
+  }
+  return value;
+}
@@ -0,0 +1,66 @@
+#pragma once
+
+#include <cstddef>      // size_t
+#include <cstdio>       // std::FILE
+#include <string_view>  // std::string_view
+
+#include <fmt/format.h>
+
+#include "buffered_output.h"
+#include "schema.h"
+#include "tflite_generated.hpp"
+
+namespace detail {
+
+template <typename T>
+void print_indices(BufferedOutput& out, const flatbuffers::Vector<T>* vector) {
+  if (vector != nullptr) {
+    out.print("{}", fmt::join(vector->begin(), vector->end(), " "));
+  }
+  out.print("\n");
+}
+
+}  // namespace detail
+
+// Prints the summary of a verified model straight from its FlatBuffer,
+// without unpacking it. The layout is the one save_summary writes, so the
+// two can be compared line by line.
+void inspect_model(const tflite::Model* model,
+                   std::string_view model_name,
+                   std::FILE* file) {
+  BufferedOutput out(file);
+  const size_t n_buffers = detail::vector_size(model->buffers());
+
+  out.print("\"{}.txt\"\n", model_name);
+  out.print("{}\n", detail::vector_size(model->subgraphs()));
+  if (model->subgraphs() == nullptr) {
+    return;
+  }
+  for (const tflite::SubGraph* subgraph : *model->subgraphs()) {
+    out.print("{}\n", detail::vector_size(subgraph->tensors()));
+    if (subgraph->tensors() != nullptr) {
+      for (const tflite::Tensor* tensor : *subgraph->tensors()) {
+        const tflite::Buffer* buffer =
+            tensor->buffer() < n_buffers
+                ? model->buffers()->Get(tensor->buffer())
+                : nullptr;
+        out.print("{}\n{}\t{}\t{}\t",
+                  tensor->name() ? tensor->name()->string_view()
+                                 : std::string_view(),
+                  tflite::EnumNameTensorType(tensor->type()),
+                  tensor->buffer(),
+                  buffer ? detail::vector_size(buffer->data()) : 0);
+        detail::print_indices(out, tensor->shape_signature());
+      }
+    }
+
+    out.print("{}\n", detail::vector_size(subgraph->operators()));
+    if (subgraph->operators() != nullptr) {
+      for (const tflite::Operator* op : *subgraph->operators()) {
+        out.print("#\n");
+        detail::print_indices(out, op->inputs());
+        detail::print_indices(out, op->outputs());
+      }
+    }
+  }
+}
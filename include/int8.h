@@ -0,0 +1,199 @@
+#pragma once
+
+#include <immintrin.h>
+
+#include <algorithm>  // std::clamp std::fill std::max
+#include <cmath>      // std::fabs std::round
+#include <cstddef>    // size_t
+#include <cstdint>    // int8_t
+#include <vector>     // std::vector
+
+// Symmetric int8 quantization kernels, rounding half away from zero and
+// clamping to [-127, 127] like the tflite hybrid kernels expect. The loops
+// are bound by memory, so AVX2 is used when the CPU has it, chosen once at
+// run time.
+
+namespace detail {
+
+float abs_max_scalar(const float* in, size_t n) {
+  float result = 0.0f;
+  for (size_t i = 0; i < n; ++i) {
+    result = std::max(result, std::fabs(in[i]));
+  }
+  return result;
+}
+
+void abs_max_columns_scalar(const float* in, size_t n, float* columns) {
+  for (size_t i = 0; i < n; ++i) {
+    columns[i] = std::max(columns[i], std::fabs(in[i]));
+  }
+}
+
+int8_t quantize_one(float value, float inverse_scale) {
+  return static_cast<int8_t>(
+      std::clamp(std::round(value * inverse_scale), -127.0f, 127.0f));
+}
+
+void quantize_int8_scalar(const float* in,
+                          int8_t* out,
+                          size_t n,
+                          float inverse_scale) {
+  for (size_t i = 0; i < n; ++i) {
+    out[i] = quantize_one(in[i], inverse_scale);
+  }
+}
+
+void quantize_int8_columns_scalar(const float* in,
+                                  int8_t* out,
+                                  size_t n,
+                                  const float* inverse_scales) {
+  for (size_t i = 0; i < n; ++i) {
+    out[i] = quantize_one(in[i], inverse_scales[i]);
+  }
+}
+
+[[gnu::target("avx2")]] __m256 abs_avx2(__m256 x) {
+  return _mm256_andnot_ps(_mm256_set1_ps(-0.0f), x);
+}
+
+[[gnu::target("avx2")]] float abs_max_avx2(const float* in, size_t n) {
+  __m256 result = _mm256_setzero_ps();
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    result = _mm256_max_ps(result, abs_avx2(_mm256_loadu_ps(in + i)));
+  }
+  __m128 half = _mm_max_ps(_mm256_castps256_ps128(result),
+                           _mm256_extractf128_ps(result, 1));
+  half = _mm_max_ps(half, _mm_movehl_ps(half, half));
+  half = _mm_max_ss(half, _mm_shuffle_ps(half, half, 1));
+  return std::max(_mm_cvtss_f32(half), abs_max_scalar(in + i, n - i));
+}
+
+[[gnu::target("avx2")]] void abs_max_columns_avx2(const float* in,
+                                                  size_t n,
+                                                  float* columns) {
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    _mm256_storeu_ps(columns + i,
+                     _mm256_max_ps(_mm256_loadu_ps(columns + i),
+                                   abs_avx2(_mm256_loadu_ps(in + i))));
+  }
+  abs_max_columns_scalar(in + i, n - i, columns + i);
+}
+
+// Eight values scaled, rounded and narrowed into the low half of the result.
+[[gnu::target("avx2")]] __m128i quantize_avx2(__m256 x) {
+  // trunc plus one away from zero where the dropped part is at least a half,
+  // which is exact where adding 0.5 first is not
+  const __m256 truncated = _mm256_round_ps(x, _MM_FROUND_TO_ZERO |
+                                                  _MM_FROUND_NO_EXC);
+  const __m256 round_up = _mm256_cmp_ps(
+      abs_avx2(_mm256_sub_ps(x, truncated)), _mm256_set1_ps(0.5f), _CMP_GE_OQ);
+  const __m256 one = _mm256_or_ps(_mm256_set1_ps(1.0f),
+                                  _mm256_and_ps(x, _mm256_set1_ps(-0.0f)));
+  __m256 rounded = _mm256_add_ps(truncated, _mm256_and_ps(round_up, one));
+  rounded = _mm256_min_ps(_mm256_max_ps(rounded, _mm256_set1_ps(-127.0f)),
+                          _mm256_set1_ps(127.0f));
+  const __m256i words = _mm256_cvtps_epi32(rounded);
+  const __m128i shorts = _mm_packs_epi32(_mm256_castsi256_si128(words),
+                                         _mm256_extracti128_si256(words, 1));
+  return _mm_packs_epi16(shorts, shorts);
+}
+
+[[gnu::target("avx2")]] void quantize_int8_avx2(const float* in,
+                                                int8_t* out,
+                                                size_t n,
+                                                float inverse_scale) {
+  const __m256 scale = _mm256_set1_ps(inverse_scale);
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    _mm_storel_epi64(
+        reinterpret_cast<__m128i*>(out + i),
+        quantize_avx2(_mm256_mul_ps(_mm256_loadu_ps(in + i), scale)));
+  }
+  quantize_int8_scalar(in + i, out + i, n - i, inverse_scale);
+}
+
+[[gnu::target("avx2")]] void quantize_int8_columns_avx2(
+    const float* in,
+    int8_t* out,
+    size_t n,
+    const float* inverse_scales) {
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    _mm_storel_epi64(reinterpret_cast<__m128i*>(out + i),
+                     quantize_avx2(_mm256_mul_ps(
+                         _mm256_loadu_ps(in + i),
+                         _mm256_loadu_ps(inverse_scales + i))));
+  }
+  quantize_int8_columns_scalar(in + i, out + i, n - i, inverse_scales + i);
+}
+
+struct Int8Kernels {
+  float (*abs_max)(const float*, size_t);
+  void (*abs_max_columns)(const float*, size_t, float*);
+  void (*quantize)(const float*, int8_t*, size_t, float);
+  void (*quantize_columns)(const float*, int8_t*, size_t, const float*);
+};
+
+const Int8Kernels& int8_kernels() {
+  static const Int8Kernels kernels = [] {
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+      return Int8Kernels{abs_max_avx2,
+                         abs_max_columns_avx2,
+                         quantize_int8_avx2,
+                         quantize_int8_columns_avx2};
+    }
+    return Int8Kernels{abs_max_scalar,
+                       abs_max_columns_scalar,
+                       quantize_int8_scalar,
+                       quantize_int8_columns_scalar};
+  }();
+  return kernels;
+}
+
+}  // namespace detail
+
+// Quantizes `in`, laid out as [outer, channels, inner], with one scale per
+// channel (a single channel gives one scale for the whole array). Writes
+// the scales, max |x| / 127 or 1 for channels of zeros, to `scales`.
+void quantize_int8(const float* in,
+                   int8_t* out,
+                   size_t outer,
+                   size_t channels,
+                   size_t inner,
+                   float* scales) {
+  const detail::Int8Kernels& kernels = detail::int8_kernels();
+  std::fill(scales, scales + channels, 0.0f);
+  for (size_t o = 0; o < outer; ++o) {
+    const float* row = in + o * channels * inner;
+    if (inner == 1) {
+      kernels.abs_max_columns(row, channels, scales);
+      continue;
+    }
+    for (size_t c = 0; c < channels; ++c) {
+      scales[c] = std::max(scales[c], kernels.abs_max(row + c * inner, inner));
+    }
+  }
+
+  std::vector<float> inverse(channels);
+  for (size_t c = 0; c < channels; ++c) {
+    inverse[c] = scales[c] == 0.0f ? 1.0f : 127.0f / scales[c];
+    scales[c] = scales[c] == 0.0f ? 1.0f : scales[c] / 127.0f;
+  }
+  for (size_t o = 0; o < outer; ++o) {
+    const size_t offset = o * channels * inner;
+    if (inner == 1) {
+      kernels.quantize_columns(
+          in + offset, out + offset, channels, inverse.data());
+      continue;
+    }
+    for (size_t c = 0; c < channels; ++c) {
+      kernels.quantize(in + offset + c * inner,
+                       out + offset + c * inner,
+                       inner,
+                       inverse[c]);
+    }
+  }
+}
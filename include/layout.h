@@ -0,0 +1,168 @@
+#pragma once
+
+#include <cstddef>  // size_t
+#include <cstdint>  // uint8_t uint32_t
+#include <vector>   // std::vector
+
+#include "def.h"
+#include "log.h"
+#include "tflite_generated.hpp"
+
+// Placement of buffer data in serialized models. The schema aligns buffer
+// data to 16 bytes. With a larger alignment, every buffer of at least that
+// many bytes starts on a multiple of it and all of them sit at the end of
+// the file, so a runtime can map the weights straight from the file and
+// processes share their pages.
+//
+// The builder grows downwards, so data created first lands at the end of
+// the file. flatbuffers only takes alignments up to 32, so the padding in
+// front of aligned data, and before the root offset so that the finished
+// file is a multiple of the alignment, is written here; an offset aligned
+// from the end is then aligned from the start as well.
+
+constexpr size_t schema_alignment = 16;
+
+namespace detail {
+
+// Zero bytes to push so that `size` more bytes end on a multiple of
+// `alignment` from the end of the buffer.
+size_t padding_for(const flatbuffers::FlatBufferBuilder& builder,
+                   size_t size,
+                   size_t alignment) {
+  return (alignment - (builder.GetSize() + size) % alignment) % alignment;
+}
+
+}  // namespace detail
+
+struct WeightLayout {
+  size_t alignment = schema_alignment;  // a power of two
+
+  bool aligns(size_t size) const {
+    return alignment > schema_alignment && size >= alignment;
+  }
+
+  // Upper estimate of the bytes a buffer takes in the file.
+  size_t reserve(size_t size) const {
+    return size + (aligns(size) ? alignment : schema_alignment);
+  }
+};
+
+// Serializes the buffers `indices` of a model into `buffers`, in the order
+// of `indices`; `data` is scratch space. Aligned buffers are written
+// first, so they sit together at the end of the file.
+void pack_buffers(
+    flatbuffers::FlatBufferBuilder& builder,
+    const tflite::ModelT& model_table,
+    const std::vector<uint32_t>& indices,
+    const WeightLayout& layout,
+    std::vector<flatbuffers::Offset<flatbuffers::Vector<uint8_t>>>& data,
+    std::vector<flatbuffers::Offset<tflite::Buffer>>& buffers) {
+  data.assign(indices.size(), 0);
+  for (bool aligned : {true, false}) {
+    for (size_t i = 0; i < indices.size(); ++i) {
+      const std::vector<uint8_t>& bytes =
+          model_table.buffers[indices[i]]->data;
+      if (bytes.empty() || layout.aligns(bytes.size()) != aligned) {
+        continue;
+      }
+      if (aligned) {
+        builder.Pad(
+            detail::padding_for(builder, bytes.size(), layout.alignment));
+      } else {
+        builder.ForceVectorAlignment(
+            bytes.size(), sizeof(uint8_t), schema_alignment);
+      }
+      data[i] = builder.CreateVector(bytes);
+    }
+  }
+  buffers.clear();
+  for (const flatbuffers::Offset<flatbuffers::Vector<uint8_t>>& offset :
+       data) {
+    buffers.emplace_back(tflite::CreateBuffer(builder, offset));
+  }
+}
+
+// Serializes a whole model with its buffers laid out by `layout`, the
+// buffers first so that they end up at the tail.
+flatbuffers::Offset<tflite::Model> pack_model(
+    flatbuffers::FlatBufferBuilder& builder,
+    const tflite::ModelT& model_table,
+    const WeightLayout& layout) {
+  std::vector<uint32_t> indices(model_table.buffers.size());
+  for (size_t i = 0; i < indices.size(); ++i) {
+    indices[i] = i;
+  }
+  std::vector<flatbuffers::Offset<flatbuffers::Vector<uint8_t>>> data;
+  std::vector<flatbuffers::Offset<tflite::Buffer>> buffers;
+  pack_buffers(builder, model_table, indices, layout, data, buffers);
+
+  std::vector<flatbuffers::Offset<tflite::OperatorCode>> operator_codes;
+  for (const PtrType<tflite::OperatorCodeT>& code :
+       model_table.operator_codes) {
+    operator_codes.emplace_back(tflite::CreateOperatorCode(builder,
+                                                           code.get()));
+  }
+  std::vector<flatbuffers::Offset<tflite::SubGraph>> subgraphs;
+  for (const PtrType<tflite::SubGraphT>& subgraph : model_table.subgraphs) {
+    subgraphs.emplace_back(tflite::CreateSubGraph(builder, subgraph.get()));
+  }
+  std::vector<flatbuffers::Offset<tflite::Metadata>> metadata;
+  for (const PtrType<tflite::MetadataT>& entry : model_table.metadata) {
+    metadata.emplace_back(tflite::CreateMetadata(builder, entry.get()));
+  }
+  std::vector<flatbuffers::Offset<tflite::SignatureDef>> signatures;
+  for (const PtrType<tflite::SignatureDefT>& signature :
+       model_table.signature_defs) {
+    signatures.emplace_back(
+        tflite::CreateSignatureDef(builder, signature.get()));
+  }
+  return tflite::CreateModel(
+      builder,
+      model_table.version,
+      builder.CreateVector(operator_codes),
+      builder.CreateVector(subgraphs),
+      model_table.description.empty()
+          ? 0
+          : builder.CreateString(model_table.description),
+      builder.CreateVector(buffers),
+      model_table.metadata_buffer.empty()
+          ? 0
+          : builder.CreateVector(model_table.metadata_buffer),
+      builder.CreateVector(metadata),
+      builder.CreateVector(signatures));
+}
+
+// Finishes a model so that the file is a multiple of the alignment, then
+// checks that every aligned buffer landed on a multiple of it.
+void finish_model(flatbuffers::FlatBufferBuilder& builder,
+                  flatbuffers::Offset<tflite::Model> model,
+                  const WeightLayout& layout) {
+  if (layout.alignment > schema_alignment) {
+    // the file identifier and the root offset follow
+    builder.Pad(detail::padding_for(
+        builder,
+        flatbuffers::kFileIdentifierLength + sizeof(flatbuffers::uoffset_t),
+        layout.alignment));
+  }
+  builder.Finish(model, tflite::ModelIdentifier());
+  if (layout.alignment <= schema_alignment) {
+    return;
+  }
+
+  const uint8_t* file = builder.GetBufferPointer();
+  const tflite::Model* packed = tflite::GetModel(file);
+  if (packed->buffers() == nullptr) {
+    return;
+  }
+  for (const tflite::Buffer* buffer : *packed->buffers()) {
+    const flatbuffers::Vector<uint8_t>* data = buffer->data();
+    if (data != nullptr && layout.aligns(data->size()) &&
+        (data->data() - file) % layout.alignment != 0) {
+      log_fatal("Buffer data at offset {} of a {} byte file is not aligned "
+                "to {} bytes.",
+                data->data() - file,
+                builder.GetSize(),
+                layout.alignment);
+    }
+  }
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <algorithm>    // std::min std::max
+#include <atomic>       // std::atomic
+#include <cstddef>      // size_t
+#include <thread>       // std::jthread std::thread
+#include <type_traits>  // std::is_invocable_v
+#include <vector>       // std::vector
+
+size_t default_jobs() {
+  return std::max(1u, std::thread::hardware_concurrency());
+}
+
+// Calls `fn(index)` for every index in [0, n) on up to `jobs` threads, the
+// calling thread included. Indices are handed out one at a time, so uneven
+// work items balance themselves. `fn(index, worker)` additionally receives
+// the id in [0, jobs) of the thread running it, for per-thread state.
+template <typename Fn>
+void parallel_for(size_t n, size_t jobs, Fn&& fn) {
+  auto call = [&fn](size_t index, size_t worker) {
+    if constexpr (std::is_invocable_v<Fn&, size_t, size_t>) {
+      fn(index, worker);
+    } else {
+      fn(index);
+    }
+  };
+
+  jobs = std::min(jobs, n);
+  if (jobs <= 1) {
+    for (size_t index = 0; index < n; ++index) {
+      call(index, 0);
+    }
+    return;
+  }
+
+  std::atomic<size_t> next = 0;
+  auto worker = [&](size_t id) {
+    for (size_t index = next++; index < n; index = next++) {
+      call(index, id);
+    }
+  };
+
+  std::vector<std::jthread> threads;
+  threads.reserve(jobs - 1);
+  for (size_t id = 1; id < jobs; ++id) {
+    threads.emplace_back(worker, id);
+  }
+  worker(0);
+}
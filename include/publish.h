@@ -0,0 +1,187 @@
+#pragma once
+
+#include <fcntl.h>   // open sync_file_range O_RDONLY O_DIRECTORY AT_FDCWD
+#include <signal.h>  // kill
+#include <unistd.h>  // close fsync getpid
+
+#include <fmt/core.h>
+
+#include <cerrno>        // errno ESRCH
+#include <charconv>      // std::from_chars
+#include <cstdio>        // renameat2 RENAME_EXCHANGE
+#include <cstring>       // std::strerror
+#include <string>        // std::string
+#include <string_view>   // std::string_view
+#include <system_error>  // std::error_code
+#include <thread>        // std::thread
+#include <utility>       // std::move
+#include <vector>        // std::vector
+
+#include "def.h"
+#include "log.h"
+#include "parallel.h"
+
+namespace detail {
+
+void sync_path(const fs::path& path, bool directory) {
+  int fd = ::open(path.c_str(), O_RDONLY | (directory ? O_DIRECTORY : 0));
+  if (fd < 0) {
+    log_fatal("Cannot open {}: {}.", path.string(), std::strerror(errno));
+  }
+  if (::fsync(fd) != 0) {
+    log_fatal("Cannot sync {}: {}.", path.string(), std::strerror(errno));
+  }
+  ::close(fd);
+}
+
+// Starts writeback of a file without waiting for it. Errors surface in the
+// fsync that follows.
+void start_writeback(const fs::path& path) {
+  int fd = ::open(path.c_str(), O_RDONLY);
+  if (fd >= 0) {
+    ::sync_file_range(fd, 0, 0, SYNC_FILE_RANGE_WRITE);
+    ::close(fd);
+  }
+}
+
+// Flushes every file and folder under `root`, and `root` itself. Writeback
+// of all files starts before the first fsync, and the fsyncs run on `jobs`
+// threads, so the device sees the files' writes together.
+void sync_tree(const fs::path& root, size_t jobs) {
+  std::vector<fs::path> files, folders = {root};
+  for (const fs::directory_entry& entry :
+       fs::recursive_directory_iterator(root)) {
+    (entry.is_directory() ? folders : files).emplace_back(entry.path());
+  }
+  parallel_for(files.size(), jobs, [&](size_t index) {
+    start_writeback(files[index]);
+  });
+  parallel_for(files.size(), jobs, [&](size_t index) {
+    sync_path(files[index], false);
+  });
+  for (const fs::path& folder : folders) {
+    sync_path(folder, true);
+  }
+}
+
+// Sibling directories of `target` left behind by earlier runs: every trash
+// folder, and staging folders whose owning process is gone.
+std::vector<fs::path> stale_siblings(const fs::path& target) {
+  const std::string staging_prefix = "." + target.filename().string() +
+                                     ".staging.",
+                    trash_prefix = "." + target.filename().string() +
+                                   ".trash.";
+  std::vector<fs::path> stale;
+  std::error_code ec;
+  for (const fs::directory_entry& entry :
+       fs::directory_iterator(target.parent_path(), ec)) {
+    std::string name = entry.path().filename().string();
+    if (name.starts_with(trash_prefix)) {
+      stale.emplace_back(entry.path());
+    } else if (name.starts_with(staging_prefix)) {
+      std::string_view suffix =
+          std::string_view(name).substr(staging_prefix.size());
+      pid_t pid = 0;
+      std::from_chars(suffix.data(), suffix.data() + suffix.size(), pid);
+      if (pid > 0 && ::kill(pid, 0) != 0 && errno == ESRCH) {
+        stale.emplace_back(entry.path());
+      }
+    }
+  }
+  return stale;
+}
+
+// Deletes `paths` on a detached thread, so that neither the run nor its
+// exit waits for the deletion. Whatever an exit interrupts is found again
+// by the next run's stale_siblings.
+void remove_detached(std::vector<fs::path> paths) {
+  if (paths.empty()) {
+    return;
+  }
+  std::thread([paths = std::move(paths)]() {
+    for (const fs::path& path : paths) {
+      std::error_code ec;
+      fs::remove_all(path, ec);
+      if (ec) {
+        log_warning("Cannot remove {}: {}.", path.string(), ec.message());
+      }
+    }
+  }).detach();
+}
+
+}  // namespace detail
+
+// Output folder that is filled in a private staging directory and published
+// with a single rename, so readers see either the old or the new contents.
+// The replaced folder is deleted on a detached thread right after the swap.
+class StagedDirectory {
+ public:
+  explicit StagedDirectory(fs::path target)
+      : target_(std::move(target)),
+        staging_(sibling("staging")),
+        trash_(sibling("trash")) {
+    std::vector<fs::path> stale = detail::stale_siblings(target_);
+    fs::remove_all(staging_);
+    fs::create_directories(staging_);
+    detail::remove_detached(std::move(stale));
+  }
+
+  StagedDirectory(const StagedDirectory&) = delete;
+  StagedDirectory& operator=(const StagedDirectory&) = delete;
+
+  ~StagedDirectory() {
+    if (!committed_) {
+      log_warning("Discarding unpublished outputs in {}.", staging_.string());
+      std::error_code ec;
+      fs::remove_all(staging_, ec);
+    }
+  }
+
+  const fs::path& path() const {
+    return staging_;
+  }
+
+  // Flushes the staged files on `jobs` threads, then swaps the staging
+  // folder into place.
+  void commit(size_t jobs) {
+    detail::sync_tree(staging_, jobs);
+    // only left by an earlier process with our pid
+    fs::remove_all(trash_);
+
+    if (!fs::exists(target_)) {
+      fs::rename(staging_, target_);
+    } else if (::renameat2(AT_FDCWD,
+                           staging_.c_str(),
+                           AT_FDCWD,
+                           target_.c_str(),
+                           RENAME_EXCHANGE) == 0) {
+      fs::rename(staging_, trash_);
+    } else {
+      log_warning("Atomic exchange is unsupported for {} ({}), renaming.",
+                  target_.string(),
+                  std::strerror(errno));
+      fs::rename(target_, trash_);
+      fs::rename(staging_, target_);
+    }
+    detail::sync_path(target_.parent_path(), true);
+    committed_ = true;
+    log_info("Published {}.", target_.string());
+
+    if (fs::exists(trash_)) {
+      detail::remove_detached({trash_});
+    }
+  }
+
+ private:
+  fs::path sibling(std::string_view kind) const {
+    return target_.parent_path() / fmt::format(".{}.{}.{}",
+                                               target_.filename().string(),
+                                               kind,
+                                               ::getpid());
+  }
+
+  fs::path target_;
+  fs::path staging_;
+  fs::path trash_;
+  bool committed_ = false;
+};
@@ -0,0 +1,82 @@
+#pragma once
+
+#include <algorithm>  // std::ranges::any_of
+#include <cstddef>    // size_t
+#include <cstdint>    // int32_t
+#include <optional>   // std::optional
+#include <utility>    // std::move
+
+#include <fmt/format.h>
+
+#include "buffered_output.h"
+#include "def.h"
+#include "executor.h"
+#include "image.h"
+#include "log.h"
+#include "summary.h"
+#include "tflite_generated.hpp"
+
+// Runs subgraph 0 of the model on the reference executor with `image_path`
+// as its first input, preprocessed as for fixtures, and writes the outputs
+// to `<model>.reference.json` in `folder`. src/check_executor.py compares
+// them with the tflite interpreter. Returns false, after logging why, if the
+// model cannot be fed the image or the executor stops before the end.
+bool save_reference_outputs(const tflite::ModelT& model_table,
+                            const fs::path& model_name,
+                            const fs::path& folder,
+                            const fs::path& image_path) {
+  if (model_table.subgraphs.empty() ||
+      model_table.subgraphs[0]->inputs.empty()) {
+    log_error("{} has no input to feed.", model_name.string());
+    return false;
+  }
+  ModelRunner runner(model_table);
+  const tflite::SubGraphT& subgraph = runner.subgraph();
+  const tflite::TensorT& input = *subgraph.tensors[subgraph.inputs[0]];
+  if (input.type != tflite::TensorType::FLOAT32) {
+    log_error("Input {} of {} is {}, the reference run needs a float input.",
+              input.name,
+              model_name.string(),
+              tflite::EnumNameTensorType(input.type));
+    return false;
+  }
+  std::optional<TensorValue> value = image_input(image_path, input.shape);
+  if (!value.has_value()) {
+    return false;
+  }
+  runner.set_input(0, std::move(*value));
+  size_t ran = runner.run([](size_t) {}, [](size_t) {});
+  if (ran < subgraph.operators.size() ||
+      std::ranges::any_of(subgraph.outputs, [&](int32_t index) {
+        return !runner.value(index).has_value();
+      })) {
+    log_error("Reference run of {} stopped after {} of {} operators.",
+              model_name.string(),
+              ran,
+              subgraph.operators.size());
+    return false;
+  }
+
+  detail::FilePtr file = detail::open_for_writing(
+      folder / (model_name.string() + ".reference.json"));
+  BufferedOutput out(file.get());
+  out.print("{{\n\"version\": {},\n\"model\": ", summary_version);
+  detail::print_json_string(out, model_name.string());
+  out.print(",\n\"image\": ");
+  detail::print_json_string(out, image_path.string());
+  out.print(",\n\"outputs\": [");
+  for (size_t i = 0; i < subgraph.outputs.size(); ++i) {
+    int32_t index = subgraph.outputs[i];
+    const std::optional<TensorValue>& output = runner.value(index);
+    out.print("{}\n{{\"tensor\": {}, \"name\": ", i ? "," : "", index);
+    detail::print_json_string(out, subgraph.tensors[index]->name);
+    out.print(", \"shape\": [{}], \"values\": [{}]}}",
+              fmt::join(output->shape, ", "),
+              fmt::join(output->data, ", "));
+  }
+  out.print("]\n}}\n");
+  log_info("Wrote the reference outputs of {} on {}.",
+           model_name.string(),
+           image_path.string());
+  return true;
+}
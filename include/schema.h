@@ -0,0 +1,175 @@
+#pragma once
+
+#include <algorithm>  // std::max
+#include <cstddef>    // size_t
+#include <cstdint>    // int32_t int64_t uint8_t uint32_t
+#include <string>     // std::string
+#include <vector>     // std::vector
+
+#include "def.h"
+#include "tflite_generated.hpp"
+
+// Builtin code of an operator code. Older files only fill the deprecated
+// int8 field, newer ones only the int32 one, so take the larger, as the
+// tflite runtime does.
+tflite::BuiltinOperator builtin_code(const tflite::OperatorCodeT& code) {
+  return std::max(
+      code.builtin_code,
+      static_cast<tflite::BuiltinOperator>(code.deprecated_builtin_code));
+}
+
+// Printable name of an operator code; custom operators go by their custom
+// code.
+std::string opcode_name(const tflite::OperatorCodeT& code) {
+  tflite::BuiltinOperator builtin = builtin_code(code);
+  if (builtin == tflite::BuiltinOperator::CUSTOM) {
+    return code.custom_code;
+  }
+  return tflite::EnumNameBuiltinOperator(builtin);
+}
+
+// Same for an operator code read straight from a FlatBuffer.
+tflite::BuiltinOperator builtin_code(const tflite::OperatorCode& code) {
+  return std::max(
+      code.builtin_code(),
+      static_cast<tflite::BuiltinOperator>(code.deprecated_builtin_code()));
+}
+
+std::string opcode_name(const tflite::OperatorCode& code) {
+  tflite::BuiltinOperator builtin = builtin_code(code);
+  if (builtin == tflite::BuiltinOperator::CUSTOM) {
+    return code.custom_code() ? code.custom_code()->str() : std::string();
+  }
+  return tflite::EnumNameBuiltinOperator(builtin);
+}
+
+// Bits per element of a tensor type, 0 for types without a fixed size.
+size_t tensor_type_bits(tflite::TensorType type) {
+  switch (type) {
+    case tflite::TensorType::INT4:
+      return 4;
+    case tflite::TensorType::BOOL:
+    case tflite::TensorType::INT8:
+    case tflite::TensorType::UINT8:
+      return 8;
+    case tflite::TensorType::FLOAT16:
+    case tflite::TensorType::INT16:
+    case tflite::TensorType::UINT16:
+      return 16;
+    case tflite::TensorType::FLOAT32:
+    case tflite::TensorType::INT32:
+    case tflite::TensorType::UINT32:
+      return 32;
+    case tflite::TensorType::FLOAT64:
+    case tflite::TensorType::INT64:
+    case tflite::TensorType::UINT64:
+    case tflite::TensorType::COMPLEX64:
+      return 64;
+    case tflite::TensorType::COMPLEX128:
+      return 128;
+    default:
+      return 0;
+  }
+}
+
+// Number of elements of a static shape, or -1 if a dimension is unknown.
+int64_t element_count(const std::vector<int32_t>& shape) {
+  int64_t count = 1;
+  for (int32_t dim : shape) {
+    if (dim < 0) {
+      return -1;
+    }
+    count *= dim;
+  }
+  return count;
+}
+
+// Bytes the tensor occupies at runtime, 0 when the type or shape leaves it
+// undetermined.
+size_t tensor_bytes(const tflite::TensorT& tensor) {
+  int64_t count = element_count(tensor.shape);
+  if (count < 0) {
+    return 0;
+  }
+  return (count * tensor_type_bits(tensor.type) + 7) / 8;
+}
+
+// Calls `fn(index)` for every subgraph the options of a control-flow
+// operator refer to: WHILE condition and body, IF branches, the CALL_ONCE
+// initializer and the CALL target.
+template <typename Fn>
+void for_each_subgraph_reference(const tflite::BuiltinOptionsUnion& options,
+                                 Fn&& fn) {
+  switch (options.type) {
+    case tflite::BuiltinOptions::WhileOptions: {
+      fn(options.AsWhileOptions()->cond_subgraph_index);
+      fn(options.AsWhileOptions()->body_subgraph_index);
+      break;
+    }
+    case tflite::BuiltinOptions::IfOptions: {
+      fn(options.AsIfOptions()->then_subgraph_index);
+      fn(options.AsIfOptions()->else_subgraph_index);
+      break;
+    }
+    case tflite::BuiltinOptions::CallOnceOptions: {
+      fn(options.AsCallOnceOptions()->init_subgraph_index);
+      break;
+    }
+    case tflite::BuiltinOptions::CallOptions: {
+      fn(static_cast<int32_t>(options.AsCallOptions()->subgraph));
+      break;
+    }
+    default: {
+      break;
+    }
+  }
+}
+
+namespace detail {
+
+template <typename T>
+size_t vector_size(const flatbuffers::Vector<T>* vector) {
+  return vector == nullptr ? 0 : vector->size();
+}
+
+enum struct BufferUse : uint8_t { NONE, CONVERT, KEEP };
+
+// Buffers that only ever hold constant FLOAT32 tensors. Buffers shared with
+// anything else, variables, subgraph inputs and outputs or metadata stay as
+// they are.
+std::vector<BufferUse> float_weight_buffers(const tflite::ModelT& model_table) {
+  std::vector<BufferUse> use(model_table.buffers.size(), BufferUse::NONE);
+  auto keep = [&](uint32_t buffer) {
+    if (buffer < use.size()) {
+      use[buffer] = BufferUse::KEEP;
+    }
+  };
+  for (const PtrType<tflite::SubGraphT>& subgraph : model_table.subgraphs) {
+    for (const PtrType<tflite::TensorT>& tensor : subgraph->tensors) {
+      if (tensor->buffer >= use.size() ||
+          model_table.buffers[tensor->buffer]->data.empty()) {
+        continue;
+      }
+      if (tensor->type != tflite::TensorType::FLOAT32 || tensor->is_variable ||
+          tensor->sparsity != nullptr) {
+        keep(tensor->buffer);
+      } else if (use[tensor->buffer] == BufferUse::NONE) {
+        use[tensor->buffer] = BufferUse::CONVERT;
+      }
+    }
+    for (const std::vector<int32_t>* io : {&subgraph->inputs,
+                                           &subgraph->outputs}) {
+      for (int32_t index : *io) {
+        if (index >= 0) {
+          keep(subgraph->tensors[index]->buffer);
+        }
+      }
+    }
+  }
+  for (const PtrType<tflite::MetadataT>& metadata : model_table.metadata) {
+    keep(metadata->buffer);
+  }
+  return use;
+}
+
+}  // namespace detail
@@ -0,0 +1,583 @@
+#pragma once
+
+#include <algorithm>  // std::max std::ranges::any_of
+#include <cstddef>    // size_t
+#include <cstdint>    // int32_t int64_t
+#include <optional>   // std::optional
+#include <string>     // std::string
+#include <utility>    // std::move
+#include <vector>     // std::vector
+
+#include <fmt/format.h>
+
+#include "def.h"
+#include "executor.h"
+#include "log.h"
+#include "schema.h"
+#include "tflite_generated.hpp"
+
+// Shape inference: shapes flow from the subgraph inputs and the constants
+// through the operators in model order, by rules for the common builtin
+// operators. Shapes are signatures, with -1 for a dimension only known at
+// run time; tflite stores them as `shape_signature` and, with those
+// dimensions as 1, as `shape`.
+
+using Shape = std::vector<int32_t>;
+
+namespace detail {
+
+// Shapes of the tensors known so far in one subgraph.
+using KnownShapes = std::vector<std::optional<Shape>>;
+
+std::optional<Shape> stored_shape(const tflite::TensorT& tensor) {
+  if (!tensor.shape_signature.empty()) {
+    return tensor.shape_signature;
+  } else if (!tensor.shape.empty()) {
+    return tensor.shape;
+  }
+  return std::nullopt;
+}
+
+std::optional<Shape> broadcast_shapes(const Shape& a, const Shape& b) {
+  Shape result(std::max(a.size(), b.size()), 1);
+  for (size_t i = 0; i < result.size(); ++i) {
+    int32_t x = i < a.size() ? a[a.size() - 1 - i] : 1;
+    int32_t y = i < b.size() ? b[b.size() - 1 - i] : 1;
+    int32_t& out = result[result.size() - 1 - i];
+    if (x == y || y == 1) {
+      out = x;
+    } else if (x == 1) {
+      out = y;
+    } else if (x < 0 || y < 0) {
+      out = std::max(x, y);  // the known one, if any
+    } else {
+      return std::nullopt;
+    }
+  }
+  return result;
+}
+
+int32_t window_output(int32_t size,
+                      int32_t filter,
+                      int32_t stride,
+                      int32_t dilation,
+                      tflite::Padding padding) {
+  if (size < 0 || filter < 0) {
+    return -1;
+  }
+  stride = std::max(stride, 1);
+  if (padding == tflite::Padding::SAME) {
+    return (size + stride - 1) / stride;
+  }
+  const int32_t extent = (filter - 1) * std::max(dilation, 1) + 1;
+  return std::max((size - extent + stride) / stride, 0);
+}
+
+int64_t known_count(const Shape& shape) {
+  int64_t count = 1;
+  for (int32_t dim : shape) {
+    if (dim < 0) {
+      return -1;
+    }
+    count *= dim;
+  }
+  return count;
+}
+
+// Values of a constant integer input, or nothing.
+std::optional<std::vector<int32_t>> constant_ints(
+    const tflite::ModelT& model_table,
+    const tflite::SubGraphT& subgraph,
+    const tflite::OperatorT& op,
+    size_t slot) {
+  if (slot >= op.inputs.size() || op.inputs[slot] < 0) {
+    return std::nullopt;
+  }
+  const tflite::TensorT& tensor = *subgraph.tensors[op.inputs[slot]];
+  if (tensor.type != tflite::TensorType::INT32 &&
+      tensor.type != tflite::TensorType::INT64) {
+    return std::nullopt;
+  }
+  std::optional<TensorValue> value = constant_value(model_table, tensor);
+  if (!value.has_value()) {
+    return std::nullopt;
+  }
+  return std::vector<int32_t>(value->data.begin(), value->data.end());
+}
+
+int32_t normalize_axis(int32_t axis, size_t rank) {
+  return axis < 0 ? axis + static_cast<int32_t>(rank) : axis;
+}
+
+// Shapes of the outputs of one operator from the shapes of its inputs.
+// Returns false when no rule applies or an input shape is missing.
+bool infer_operator(const tflite::ModelT& model_table,
+                    const tflite::SubGraphT& subgraph,
+                    const tflite::OperatorT& op,
+                    const KnownShapes& known,
+                    std::vector<Shape>& outputs) {
+  using tflite::BuiltinOperator;
+  auto input = [&](size_t slot) -> const Shape* {
+    if (slot >= op.inputs.size() || op.inputs[slot] < 0 ||
+        !known[op.inputs[slot]].has_value()) {
+      return nullptr;
+    }
+    return &*known[op.inputs[slot]];
+  };
+  auto ints = [&](size_t slot) {
+    return constant_ints(model_table, subgraph, op, slot);
+  };
+  const tflite::BuiltinOptionsUnion& options = op.builtin_options;
+  const Shape* x = input(0);
+  if (x == nullptr || op.outputs.empty()) {
+    return false;
+  }
+  const size_t rank = x->size();
+  outputs.assign(1, Shape());
+  Shape& y = outputs[0];
+
+  const BuiltinOperator builtin =
+      builtin_code(*model_table.operator_codes[op.opcode_index]);
+  switch (builtin) {
+    case BuiltinOperator::ABS:
+    case BuiltinOperator::CAST:
+    case BuiltinOperator::CEIL:
+    case BuiltinOperator::COS:
+    case BuiltinOperator::DEQUANTIZE:
+    case BuiltinOperator::ELU:
+    case BuiltinOperator::EXP:
+    case BuiltinOperator::FLOOR:
+    case BuiltinOperator::GELU:
+    case BuiltinOperator::HARD_SWISH:
+    case BuiltinOperator::L2_NORMALIZATION:
+    case BuiltinOperator::LEAKY_RELU:
+    case BuiltinOperator::LOCAL_RESPONSE_NORMALIZATION:
+    case BuiltinOperator::LOG:
+    case BuiltinOperator::LOG_SOFTMAX:
+    case BuiltinOperator::LOGISTIC:
+    case BuiltinOperator::NEG:
+    case BuiltinOperator::QUANTIZE:
+    case BuiltinOperator::RELU:
+    case BuiltinOperator::RELU6:
+    case BuiltinOperator::RELU_N1_TO_1:
+    case BuiltinOperator::ROUND:
+    case BuiltinOperator::RSQRT:
+    case BuiltinOperator::SIN:
+    case BuiltinOperator::SOFTMAX:
+    case BuiltinOperator::SQRT:
+    case BuiltinOperator::SQUARE:
+    case BuiltinOperator::TANH:
+    case BuiltinOperator::ZEROS_LIKE: {
+      y = *x;
+      return true;
+    }
+    case BuiltinOperator::ADD:
+    case BuiltinOperator::SUB:
+    case BuiltinOperator::MUL:
+    case BuiltinOperator::DIV:
+    case BuiltinOperator::POW:
+    case BuiltinOperator::MAXIMUM:
+    case BuiltinOperator::MINIMUM:
+    case BuiltinOperator::SQUARED_DIFFERENCE:
+    case BuiltinOperator::FLOOR_DIV:
+    case BuiltinOperator::FLOOR_MOD:
+    case BuiltinOperator::PRELU:
+    case BuiltinOperator::LESS:
+    case BuiltinOperator::LESS_EQUAL:
+    case BuiltinOperator::GREATER:
+    case BuiltinOperator::GREATER_EQUAL:
+    case BuiltinOperator::EQUAL:
+    case BuiltinOperator::NOT_EQUAL:
+    case BuiltinOperator::LOGICAL_AND:
+    case BuiltinOperator::LOGICAL_OR: {
+      std::optional<Shape> shape =
+          input(1) ? broadcast_shapes(*x, *input(1)) : std::nullopt;
+      if (shape.has_value()) {
+        y = std::move(*shape);
+      }
+      return shape.has_value();
+    }
+    case BuiltinOperator::CONV_2D:
+    case BuiltinOperator::DEPTHWISE_CONV_2D: {
+      const Shape* filter = input(1);
+      if (rank != 4 || filter == nullptr || filter->size() != 4) {
+        return false;
+      }
+      const bool depthwise = builtin == BuiltinOperator::DEPTHWISE_CONV_2D;
+      tflite::Padding padding;
+      int32_t stride_h, stride_w, dilation_h, dilation_w;
+      if (depthwise) {
+        const tflite::DepthwiseConv2DOptionsT& o =
+            detail::options_or_default(options.AsDepthwiseConv2DOptions());
+        padding = o.padding;
+        stride_h = o.stride_h;
+        stride_w = o.stride_w;
+        dilation_h = o.dilation_h_factor;
+        dilation_w = o.dilation_w_factor;
+      } else {
+        const tflite::Conv2DOptionsT& o =
+            detail::options_or_default(options.AsConv2DOptions());
+        padding = o.padding;
+        stride_h = o.stride_h;
+        stride_w = o.stride_w;
+        dilation_h = o.dilation_h_factor;
+        dilation_w = o.dilation_w_factor;
+      }
+      y = {(*x)[0],
+           window_output(
+               (*x)[1], (*filter)[1], stride_h, dilation_h, padding),
+           window_output(
+               (*x)[2], (*filter)[2], stride_w, dilation_w, padding),
+           depthwise ? (*filter)[3] : (*filter)[0]};
+      return true;
+    }
+    case BuiltinOperator::AVERAGE_POOL_2D:
+    case BuiltinOperator::MAX_POOL_2D:
+    case BuiltinOperator::L2_POOL_2D: {
+      if (rank != 4) {
+        return false;
+      }
+      const tflite::Pool2DOptionsT& o =
+          detail::options_or_default(options.AsPool2DOptions());
+      y = {(*x)[0],
+           window_output((*x)[1], o.filter_height, o.stride_h, 1, o.padding),
+           window_output((*x)[2], o.filter_width, o.stride_w, 1, o.padding),
+           (*x)[3]};
+      return true;
+    }
+    case BuiltinOperator::FULLY_CONNECTED: {
+      const Shape* weights = input(1);
+      if (weights == nullptr || weights->size() != 2 || rank == 0) {
+        return false;
+      }
+      if (detail::options_or_default(options.AsFullyConnectedOptions())
+              .keep_num_dims) {
+        y = *x;
+        y.back() = (*weights)[0];
+        return true;
+      }
+      const int64_t count = known_count(*x);
+      y = {count < 0 || (*weights)[1] <= 0
+               ? -1
+               : static_cast<int32_t>(count / (*weights)[1]),
+           (*weights)[0]};
+      return true;
+    }
+    case BuiltinOperator::BATCH_MATMUL: {
+      const Shape* other = input(1);
+      if (other == nullptr || rank < 2 || other->size() < 2) {
+        return false;
+      }
+      const tflite::BatchMatMulOptionsT& o =
+          detail::options_or_default(options.AsBatchMatMulOptions());
+      std::optional<Shape> batch =
+          broadcast_shapes(Shape(x->begin(), x->end() - 2),
+                           Shape(other->begin(), other->end() - 2));
+      if (!batch.has_value()) {
+        return false;
+      }
+      y = std::move(*batch);
+      y.emplace_back(o.adj_x ? x->back() : (*x)[rank - 2]);
+      y.emplace_back(o.adj_y ? (*other)[other->size() - 2] : other->back());
+      return true;
+    }
+    case BuiltinOperator::RESHAPE: {
+      std::optional<std::vector<int32_t>> target = ints(1);
+      if (!target.has_value()) {
+        // a shape computed at run time, or none at all
+        if ((op.inputs.size() > 1 && op.inputs[1] >= 0) ||
+            options.AsReshapeOptions() == nullptr) {
+          return false;
+        }
+        target = options.AsReshapeOptions()->new_shape;
+      }
+      y = std::move(*target);
+      const int64_t count = known_count(*x);
+      int64_t rest = 1;
+      int32_t open = -1;
+      for (size_t i = 0; i < y.size(); ++i) {
+        if (y[i] < 0) {
+          open = i;
+        } else {
+          rest *= y[i];
+        }
+      }
+      if (open >= 0) {
+        y[open] = count < 0 || rest == 0 ? -1 : count / rest;
+      }
+      return true;
+    }
+    case BuiltinOperator::SQUEEZE: {
+      const std::vector<int32_t>& dims =
+          detail::options_or_default(options.AsSqueezeOptions()).squeeze_dims;
+      for (size_t i = 0; i < rank; ++i) {
+        bool squeezed = dims.empty()
+                            ? (*x)[i] == 1
+                            : std::ranges::any_of(dims, [&](int32_t d) {
+                                return normalize_axis(d, rank) ==
+                                       static_cast<int32_t>(i);
+                              });
+        if (!squeezed) {
+          y.emplace_back((*x)[i]);
+        }
+      }
+      return true;
+    }
+    case BuiltinOperator::EXPAND_DIMS: {
+      std::optional<std::vector<int32_t>> axis = ints(1);
+      if (!axis.has_value() || axis->size() != 1) {
+        return false;
+      }
+      int32_t a = normalize_axis((*axis)[0], rank + 1);
+      if (a < 0 || a > static_cast<int32_t>(rank)) {
+        return false;
+      }
+      y = *x;
+      y.insert(y.begin() + a, 1);
+      return true;
+    }
+    case BuiltinOperator::CONCATENATION: {
+      int32_t axis = normalize_axis(
+          detail::options_or_default(options.AsConcatenationOptions()).axis,
+          rank);
+      if (axis < 0 || axis >= static_cast<int32_t>(rank)) {
+        return false;
+      }
+      y = *x;
+      for (size_t i = 1; i < op.inputs.size(); ++i) {
+        const Shape* part = input(i);
+        if (part == nullptr || part->size() != rank) {
+          return false;
+        }
+        y[axis] = y[axis] < 0 || (*part)[axis] < 0 ? -1
+                                                   : y[axis] + (*part)[axis];
+      }
+      return true;
+    }
+    case BuiltinOperator::TRANSPOSE: {
+      std::optional<std::vector<int32_t>> perm = ints(1);
+      if (!perm.has_value() || perm->size() != rank) {
+        return false;
+      }
+      for (int32_t p : *perm) {
+        if (p < 0 || p >= static_cast<int32_t>(rank)) {
+          return false;
+        }
+        y.emplace_back((*x)[p]);
+      }
+      return true;
+    }
+    case BuiltinOperator::PAD:
+    case BuiltinOperator::PADV2:
+    case BuiltinOperator::MIRROR_PAD: {
+      std::optional<std::vector<int32_t>> pads = ints(1);
+      if (!pads.has_value() || pads->size() != 2 * rank) {
+        return false;
+      }
+      y = *x;
+      for (size_t i = 0; i < rank; ++i) {
+        if (y[i] >= 0) {
+          y[i] += (*pads)[2 * i] + (*pads)[2 * i + 1];
+        }
+      }
+      return true;
+    }
+    case BuiltinOperator::MEAN:
+    case BuiltinOperator::SUM:
+    case BuiltinOperator::REDUCE_MAX:
+    case BuiltinOperator::REDUCE_MIN:
+    case BuiltinOperator::REDUCE_PROD:
+    case BuiltinOperator::REDUCE_ANY: {
+      std::optional<std::vector<int32_t>> axes = ints(1);
+      if (!axes.has_value()) {
+        return false;
+      }
+      const bool keep_dims =
+          detail::options_or_default(options.AsReducerOptions()).keep_dims;
+      for (size_t i = 0; i < rank; ++i) {
+        bool reduced = std::ranges::any_of(*axes, [&](int32_t a) {
+          return normalize_axis(a, rank) == static_cast<int32_t>(i);
+        });
+        if (!reduced) {
+          y.emplace_back((*x)[i]);
+        } else if (keep_dims) {
+          y.emplace_back(1);
+        }
+      }
+      return true;
+    }
+    case BuiltinOperator::ARG_MAX:
+    case BuiltinOperator::ARG_MIN: {
+      std::optional<std::vector<int32_t>> axis = ints(1);
+      if (!axis.has_value() || axis->size() != 1) {
+        return false;
+      }
+      for (size_t i = 0; i < rank; ++i) {
+        if (normalize_axis((*axis)[0], rank) != static_cast<int32_t>(i)) {
+          y.emplace_back((*x)[i]);
+        }
+      }
+      return true;
+    }
+    case BuiltinOperator::SHAPE: {
+      y = {static_cast<int32_t>(rank)};
+      return true;
+    }
+    case BuiltinOperator::SLICE: {
+      std::optional<std::vector<int32_t>> begin = ints(1), size = ints(2);
+      if (!begin.has_value() || !size.has_value() || begin->size() != rank ||
+          size->size() != rank) {
+        return false;
+      }
+      for (size_t i = 0; i < rank; ++i) {
+        y.emplace_back((*size)[i] >= 0   ? (*size)[i]
+                       : (*x)[i] < 0     ? -1
+                                         : (*x)[i] - (*begin)[i]);
+      }
+      return true;
+    }
+    case BuiltinOperator::RESIZE_BILINEAR:
+    case BuiltinOperator::RESIZE_NEAREST_NEIGHBOR: {
+      std::optional<std::vector<int32_t>> size = ints(1);
+      if (rank != 4 || !size.has_value() || size->size() != 2) {
+        return false;
+      }
+      y = {(*x)[0], (*size)[0], (*size)[1], (*x)[3]};
+      return true;
+    }
+    case BuiltinOperator::TRANSPOSE_CONV: {
+      // inputs are output shape, filter, activations
+      std::optional<std::vector<int32_t>> shape = ints(0);
+      if (!shape.has_value()) {
+        return false;
+      }
+      y = std::move(*shape);
+      if (const Shape* activations = input(2);
+          activations != nullptr && !activations->empty() && !y.empty()) {
+        y[0] = (*activations)[0];
+      }
+      return true;
+    }
+    case BuiltinOperator::SPLIT: {
+      // inputs are axis, value
+      std::optional<std::vector<int32_t>> axis = ints(0);
+      const Shape* value = input(1);
+      if (!axis.has_value() || axis->size() != 1 || value == nullptr) {
+        return false;
+      }
+      int32_t a = normalize_axis((*axis)[0], value->size());
+      if (a < 0 || a >= static_cast<int32_t>(value->size())) {
+        return false;
+      }
+      y = *value;
+      if (y[a] >= 0) {
+        y[a] /= std::max<int32_t>(op.outputs.size(), 1);
+      }
+      outputs.assign(op.outputs.size(), y);
+      return true;
+    }
+    default: {
+      return false;
+    }
+  }
+}
+
+}  // namespace detail
+
+struct ShapeInference {
+  size_t filled = 0;    // tensors that had no shape and got one
+  size_t changed = 0;   // tensors whose stored shape was replaced
+  std::vector<std::vector<int32_t>> unresolved;  // by subgraph
+};
+
+// Infers the shape of every operator output of every subgraph. Shapes the
+// model stores are kept unless `overwrite` is set, in which case every
+// shape a rule derives replaces the stored one; stored shapes stand in
+// where no rule applies.
+ShapeInference infer_shapes(tflite::ModelT& model_table,
+                            bool overwrite = false) {
+  ShapeInference result;
+  result.unresolved.resize(model_table.subgraphs.size());
+  std::vector<Shape> outputs;
+  for (size_t s = 0; s < model_table.subgraphs.size(); ++s) {
+    tflite::SubGraphT& subgraph = *model_table.subgraphs[s];
+    detail::KnownShapes known(subgraph.tensors.size());
+    std::vector<bool> produced(subgraph.tensors.size(), false);
+    for (const PtrType<tflite::OperatorT>& op : subgraph.operators) {
+      for (int32_t output : op->outputs) {
+        if (output >= 0) {
+          produced[output] = true;
+        }
+      }
+    }
+    for (size_t t = 0; t < subgraph.tensors.size(); ++t) {
+      const tflite::TensorT& tensor = *subgraph.tensors[t];
+      const bool constant =
+          tensor.buffer < model_table.buffers.size() &&
+          !model_table.buffers[tensor.buffer]->data.empty();
+      if (constant) {
+        known[t] = tensor.shape;  // empty is a scalar here
+      } else if (!produced[t]) {
+        known[t] = detail::stored_shape(tensor);
+      }
+    }
+
+    for (const PtrType<tflite::OperatorT>& op : subgraph.operators) {
+      const bool inferred = detail::infer_operator(
+          model_table, subgraph, *op, known, outputs);
+      for (size_t o = 0; o < op->outputs.size(); ++o) {
+        const int32_t index = op->outputs[o];
+        if (index < 0) {
+          continue;
+        }
+        tflite::TensorT& tensor = *subgraph.tensors[index];
+        std::optional<Shape> stored = detail::stored_shape(tensor);
+        if (!inferred || o >= outputs.size() ||
+            (stored.has_value() && !overwrite)) {
+          known[index] = stored;
+          if (!stored.has_value()) {
+            result.unresolved[s].emplace_back(index);
+          }
+          continue;
+        }
+        Shape& shape = outputs[o];
+        if (stored.has_value() && *stored != shape) {
+          ++result.changed;
+        } else if (!stored.has_value() && !shape.empty()) {
+          ++result.filled;
+        }
+        tensor.shape = shape;
+        for (int32_t& dim : tensor.shape) {
+          dim = std::max(dim, 1);
+        }
+        tensor.shape_signature = shape;
+        known[index] = std::move(shape);
+      }
+    }
+  }
+  return result;
+}
+
+// Logs the outcome of shape inference, naming a few unresolved tensors.
+void report_shapes(const tflite::ModelT& model_table,
+                   const ShapeInference& inference) {
+  size_t unresolved = 0;
+  std::vector<std::string> names;
+  for (size_t s = 0; s < inference.unresolved.size(); ++s) {
+    unresolved += inference.unresolved[s].size();
+    for (int32_t index : inference.unresolved[s]) {
+      if (names.size() < 8) {
+        names.emplace_back(fmt::format(
+            "{}:{}", s, model_table.subgraphs[s]->tensors[index]->name));
+      }
+    }
+  }
+  log_info("Inferred shapes: {} filled, {} changed, {} unresolved.",
+           inference.filled,
+           inference.changed,
+           unresolved);
+  if (unresolved > 0) {
+    log_warning("Tensors without a shape include {}.",
+                fmt::join(names, ", "));
+  }
+}
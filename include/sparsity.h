@@ -0,0 +1,535 @@
+#pragma once
+
+#include <immintrin.h>
+
+#include <algorithm>  // std::max std::min std::ranges::sort
+#include <array>      // std::array
+#include <bit>        // std::popcount
+#include <chrono>     // std::chrono::steady_clock
+#include <cstddef>    // size_t
+#include <cstdint>    // int8_t int32_t uint8_t uint16_t uint32_t uint64_t
+#include <cstring>    // std::memcpy
+#include <limits>     // std::numeric_limits
+#include <string>     // std::string
+#include <utility>    // std::move
+#include <vector>     // std::vector
+
+#include <fmt/format.h>
+
+#include "buffered_output.h"
+#include "def.h"
+#include "half.h"
+#include "log.h"
+#include "parallel.h"
+#include "schema.h"
+#include "summary.h"
+#include "tflite_generated.hpp"
+
+// Sparsity of constant buffers. The scan reads a verified FlatBuffer in
+// place: values are widened to float a chunk at a time, and one pass per
+// chunk finds the zeros, as a bit per element, and the range of the values.
+// Zero blocks of 1x4 and 1x16 along the innermost dimension, the layouts
+// sparse kernels use, are counted from the bits.
+//
+// The encoding stores FULLY_CONNECTED float weights that are mostly zeros
+// in the CSR layout of the tflite sparse fully connected kernel: rows dense,
+// columns compressed, only the nonzero values in the buffer.
+
+namespace detail {
+
+constexpr size_t sparsity_chunk = 4096;  // elements, a multiple of 64
+
+struct ChunkScan {
+  float min = std::numeric_limits<float>::infinity();
+  float max = -std::numeric_limits<float>::infinity();
+  double abs_sum = 0.0;
+};
+
+// Scans in[begin, n), setting bit i of `zeros` for every zero of either
+// sign.
+void scan_chunk_tail(const float* in,
+                     size_t begin,
+                     size_t n,
+                     uint64_t* zeros,
+                     ChunkScan& scan) {
+  for (size_t i = begin; i < n; ++i) {
+    const float x = in[i];
+    zeros[i / 64] |= static_cast<uint64_t>(x == 0.0f) << (i % 64);
+    scan.min = std::min(scan.min, x);
+    scan.max = std::max(scan.max, x);
+    scan.abs_sum += x < 0.0f ? -x : x;
+  }
+}
+
+ChunkScan scan_chunk_scalar(const float* in, size_t n, uint64_t* zeros) {
+  ChunkScan scan;
+  scan_chunk_tail(in, 0, n, zeros, scan);
+  return scan;
+}
+
+[[gnu::target("avx2")]] ChunkScan scan_chunk_avx2(const float* in,
+                                                  size_t n,
+                                                  uint64_t* zeros) {
+  const __m256 magnitude = _mm256_castsi256_ps(_mm256_set1_epi32(0x7fffffff));
+  const __m256 zero = _mm256_setzero_ps();
+  __m256 low = _mm256_set1_ps(std::numeric_limits<float>::infinity());
+  __m256 high = _mm256_set1_ps(-std::numeric_limits<float>::infinity());
+  __m256 sum = zero;
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    const __m256 x = _mm256_loadu_ps(in + i);
+    const __m256 a = _mm256_and_ps(x, magnitude);
+    const uint64_t bits =
+        _mm256_movemask_ps(_mm256_cmp_ps(a, zero, _CMP_EQ_OQ));
+    zeros[i / 64] |= bits << (i % 64);
+    low = _mm256_min_ps(low, x);
+    high = _mm256_max_ps(high, x);
+    sum = _mm256_add_ps(sum, a);
+  }
+  alignas(32) float lows[8], highs[8], sums[8];
+  _mm256_store_ps(lows, low);
+  _mm256_store_ps(highs, high);
+  _mm256_store_ps(sums, sum);
+  ChunkScan scan;
+  for (size_t k = 0; k < 8; ++k) {
+    scan.min = std::min(scan.min, lows[k]);
+    scan.max = std::max(scan.max, highs[k]);
+    scan.abs_sum += sums[k];
+  }
+  scan_chunk_tail(in, i, n, zeros, scan);
+  return scan;
+}
+
+ChunkScan scan_chunk(const float* in, size_t n, uint64_t* zeros) {
+  static const auto kernel = [] {
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2") ? scan_chunk_avx2
+                                          : scan_chunk_scalar;
+  }();
+  return kernel(in, n, zeros);
+}
+
+// Writes elements [begin, begin + n) of a buffer stored as `type` to `out`
+// as floats, less the zero point. Other types are left alone.
+void widen(const uint8_t* data,
+           tflite::TensorType type,
+           int32_t zero_point,
+           size_t begin,
+           size_t n,
+           float* out) {
+  switch (type) {
+    case tflite::TensorType::FLOAT32: {
+      std::memcpy(out, data + begin * sizeof(float), n * sizeof(float));
+      break;
+    }
+    case tflite::TensorType::FLOAT16: {
+      for (size_t i = 0; i < n; ++i) {
+        uint16_t half;
+        std::memcpy(&half, data + (begin + i) * sizeof(half), sizeof(half));
+        out[i] = half_to_float(half);
+      }
+      break;
+    }
+    case tflite::TensorType::INT8: {
+      for (size_t i = 0; i < n; ++i) {
+        out[i] = static_cast<int8_t>(data[begin + i]) - zero_point;
+      }
+      break;
+    }
+    default: {
+      break;
+    }
+  }
+}
+
+size_t element_size(tflite::TensorType type) {
+  switch (type) {
+    case tflite::TensorType::FLOAT32: {
+      return 4;
+    }
+    case tflite::TensorType::FLOAT16: {
+      return 2;
+    }
+    default: {
+      return 1;
+    }
+  }
+}
+
+}  // namespace detail
+
+// Sparsity of one constant buffer, read as its first tensor. Values of int8
+// buffers are the stored integers less the zero point.
+struct BufferSparsity {
+  uint32_t buffer = 0;
+  uint32_t subgraph = 0;
+  int32_t tensor = -1;
+  tflite::TensorType type = tflite::TensorType::FLOAT32;
+  uint64_t elements = 0;
+  uint64_t zeros = 0;
+  // zero 1x4 and 1x16 blocks along the innermost dimension; no blocks are
+  // counted when the blocks would straddle rows
+  uint64_t blocks_1x4 = 0, zero_blocks_1x4 = 0;
+  uint64_t blocks_1x16 = 0, zero_blocks_1x16 = 0;
+  float min = std::numeric_limits<float>::infinity();
+  float max = -std::numeric_limits<float>::infinity();
+  double abs_sum = 0.0;
+  // biased float exponent of every value, zeros and subnormals in 0
+  std::array<uint64_t, 256> exponents{};
+};
+
+namespace detail {
+
+void scan_buffer(const uint8_t* data,
+                 int32_t zero_point,
+                 size_t inner,
+                 BufferSparsity& stats) {
+  std::vector<float> values(sparsity_chunk);
+  std::array<uint64_t, sparsity_chunk / 64> zeros;
+  for (size_t begin = 0; begin < stats.elements; begin += sparsity_chunk) {
+    const size_t n = std::min(sparsity_chunk, stats.elements - begin);
+    widen(data, stats.type, zero_point, begin, n, values.data());
+    zeros.fill(0);
+    const ChunkScan scan = scan_chunk(values.data(), n, zeros.data());
+    stats.min = std::min(stats.min, scan.min);
+    stats.max = std::max(stats.max, scan.max);
+    stats.abs_sum += scan.abs_sum;
+
+    // chunks start on a multiple of 16, so blocks never span two chunks;
+    // elements past n have no bit and leave a partial block nonzero
+    for (size_t w = 0; w < (n + 63) / 64; ++w) {
+      const uint64_t z = zeros[w];
+      const uint64_t z4 =
+          z & (z >> 1) & (z >> 2) & (z >> 3) & 0x1111111111111111;
+      const uint64_t z16 =
+          z4 & (z4 >> 4) & (z4 >> 8) & (z4 >> 12) & 0x0001000100010001;
+      stats.zeros += std::popcount(z);
+      stats.zero_blocks_1x4 += std::popcount(z4);
+      stats.zero_blocks_1x16 += std::popcount(z16);
+    }
+    for (size_t i = 0; i < n; ++i) {
+      uint32_t bits;
+      std::memcpy(&bits, &values[i], sizeof(bits));
+      ++stats.exponents[(bits >> 23) & 0xff];
+    }
+  }
+  if (inner % 4 == 0) {
+    stats.blocks_1x4 = stats.elements / 4;
+  } else {
+    stats.zero_blocks_1x4 = 0;
+  }
+  if (inner % 16 == 0) {
+    stats.blocks_1x16 = stats.elements / 16;
+  } else {
+    stats.zero_blocks_1x16 = 0;
+  }
+}
+
+}  // namespace detail
+
+// Scans every constant FLOAT32, FLOAT16 or INT8 buffer of a verified model
+// on `jobs` threads, largest first. Buffers come back in index order.
+std::vector<BufferSparsity> analyze_sparsity(const tflite::Model* model,
+                                             size_t jobs) {
+  const size_t n_buffers = detail::vector_size(model->buffers());
+  std::vector<BufferSparsity> report;
+  std::vector<int32_t> slot(n_buffers, -1);
+  std::vector<const tflite::Tensor*> first;
+  for (size_t s = 0; s < detail::vector_size(model->subgraphs()); ++s) {
+    const tflite::SubGraph* subgraph = model->subgraphs()->Get(s);
+    for (size_t t = 0; t < detail::vector_size(subgraph->tensors()); ++t) {
+      const tflite::Tensor* tensor = subgraph->tensors()->Get(t);
+      const uint32_t b = tensor->buffer();
+      if (b >= n_buffers || slot[b] >= 0 ||
+          detail::vector_size(model->buffers()->Get(b)->data()) == 0 ||
+          tensor->sparsity() != nullptr) {
+        continue;
+      }
+      const tflite::TensorType type = tensor->type();
+      if (type != tflite::TensorType::FLOAT32 &&
+          type != tflite::TensorType::FLOAT16 &&
+          type != tflite::TensorType::INT8) {
+        continue;
+      }
+      slot[b] = report.size();
+      BufferSparsity& stats = report.emplace_back();
+      stats.buffer = b;
+      stats.subgraph = s;
+      stats.tensor = t;
+      stats.type = type;
+      stats.elements = model->buffers()->Get(b)->data()->size() /
+                       detail::element_size(type);
+      first.emplace_back(tensor);
+    }
+  }
+
+  std::vector<size_t> order(report.size());
+  for (size_t i = 0; i < order.size(); ++i) {
+    order[i] = i;
+  }
+  std::ranges::sort(order, [&](size_t a, size_t b) {
+    return report[a].elements > report[b].elements;
+  });
+  parallel_for(order.size(), jobs, [&](size_t index) {
+    BufferSparsity& stats = report[order[index]];
+    const tflite::Tensor* tensor = first[order[index]];
+    const tflite::QuantizationParameters* q = tensor->quantization();
+    const int32_t zero_point =
+        q && detail::vector_size(q->zero_point()) == 1
+            ? static_cast<int32_t>(q->zero_point()->Get(0))
+            : 0;
+    const size_t rank = detail::vector_size(tensor->shape());
+    const size_t inner = rank ? tensor->shape()->Get(rank - 1) : 1;
+    detail::scan_buffer(model->buffers()->Get(stats.buffer)->data()->data(),
+                        zero_point,
+                        inner,
+                        stats);
+  });
+  return report;
+}
+
+// Writes <model>.sparsity.json: for every scanned buffer its first tensor,
+// zero and block zero ratios, value range and mean magnitude, and the count
+// of values per power of two ("-3" counts [2^-3, 2^-2) in magnitude;
+// "zero" counts zeros and subnormals, "nonfinite" infinities and NaNs).
+// Block ratios are null where blocks would straddle rows.
+void save_sparsity(const tflite::Model* model,
+                   const std::vector<BufferSparsity>& report,
+                   const fs::path& model_name,
+                   const fs::path& folder) {
+  detail::FilePtr file = detail::open_for_writing(
+      folder / (model_name.string() + ".sparsity.json"));
+  BufferedOutput out(file.get());
+  auto ratio = [](uint64_t part, uint64_t whole) {
+    return whole ? fmt::format("{:.6f}", static_cast<double>(part) / whole)
+                 : std::string("null");
+  };
+  out.print("{{\n\"version\": {},\n\"model\": ", summary_version);
+  detail::print_json_string(out, model_name.string());
+  out.print(",\n\"buffers\": [");
+  for (size_t i = 0; i < report.size(); ++i) {
+    const BufferSparsity& stats = report[i];
+    const tflite::Tensor* tensor =
+        model->subgraphs()->Get(stats.subgraph)->tensors()->Get(stats.tensor);
+    out.print("{}\n{{\"buffer\": {}, \"subgraph\": {}, \"tensor\": {}, "
+              "\"name\": ",
+              i ? "," : "",
+              stats.buffer,
+              stats.subgraph,
+              stats.tensor);
+    detail::print_json_string(
+        out, tensor->name() ? tensor->name()->string_view() : "");
+    out.print(", \"type\": \"{}\", \"shape\": [",
+              tflite::EnumNameTensorType(stats.type));
+    detail::print_shape(out, tensor->shape(), ", ");
+    out.print("], \"elements\": {}, \"zeros\": {}, \"zero_ratio\": {}, "
+              "\"zero_blocks_1x4\": {}, \"zero_blocks_1x16\": {}, "
+              "\"min\": {}, \"max\": {}, \"mean_abs\": {}, "
+              "\"exponents\": {{",
+              stats.elements,
+              stats.zeros,
+              ratio(stats.zeros, stats.elements),
+              ratio(stats.zero_blocks_1x4, stats.blocks_1x4),
+              ratio(stats.zero_blocks_1x16, stats.blocks_1x16),
+              stats.elements ? stats.min : 0.0f,
+              stats.elements ? stats.max : 0.0f,
+              stats.elements ? stats.abs_sum / stats.elements : 0.0);
+    bool first = true;
+    for (size_t e = 0; e < stats.exponents.size(); ++e) {
+      if (stats.exponents[e] == 0) {
+        continue;
+      }
+      const std::string key = e == 0     ? "zero"
+                              : e == 255 ? "nonfinite"
+                                         : fmt::format("{}", int(e) - 127);
+      out.print("{}\"{}\": {}", first ? "" : ", ", key, stats.exponents[e]);
+      first = false;
+    }
+    out.print("}}}}");
+  }
+  out.print("]\n}}\n");
+}
+
+namespace detail {
+
+// Bytes per index of values below `bound`.
+size_t index_bytes(int32_t bound) {
+  return bound <= 256 ? 1 : bound <= 65536 ? 2 : 4;
+}
+
+// Smallest index vector holding `values`, all below `bound`.
+tflite::SparseIndexVectorUnion index_vector(const std::vector<int32_t>& values,
+                                            int32_t bound) {
+  tflite::SparseIndexVectorUnion vector;
+  switch (index_bytes(bound)) {
+    case 1: {
+      tflite::Uint8VectorT v;
+      v.values.assign(values.begin(), values.end());
+      vector.Set(std::move(v));
+      break;
+    }
+    case 2: {
+      tflite::Uint16VectorT v;
+      v.values.assign(values.begin(), values.end());
+      vector.Set(std::move(v));
+      break;
+    }
+    default: {
+      tflite::Int32VectorT v;
+      v.values = values;
+      vector.Set(std::move(v));
+      break;
+    }
+  }
+  return vector;
+}
+
+}  // namespace detail
+
+// Stores FLOAT32 FULLY_CONNECTED weights with at least `min_zero_ratio` of
+// zeros in CSR form, where that is smaller than dense, for the sparse
+// kernel of that operator (version 8). Buffers read by anything else stay
+// dense. Buffers are encoded on `jobs` threads. Returns the bytes saved.
+size_t sparsify_weights(tflite::ModelT& model_table,
+                        double min_zero_ratio,
+                        size_t jobs) {
+  std::chrono::steady_clock::time_point start =
+      std::chrono::steady_clock::now();
+  std::vector<detail::BufferUse> use =
+      detail::float_weight_buffers(model_table);
+
+  // a buffer qualifies if every read of it is the 2-D weights of a float
+  // fully connected operator, all with the same shape
+  std::vector<const tflite::TensorT*> weights(use.size(), nullptr);
+  for (const PtrType<tflite::SubGraphT>& subgraph : model_table.subgraphs) {
+    auto is_float = [&](const std::vector<int32_t>& indices) {
+      return !indices.empty() && indices[0] >= 0 &&
+             subgraph->tensors[indices[0]]->type ==
+                 tflite::TensorType::FLOAT32;
+    };
+    for (const PtrType<tflite::OperatorT>& op : subgraph->operators) {
+      const bool fully_connected =
+          builtin_code(*model_table.operator_codes[op->opcode_index]) ==
+          tflite::BuiltinOperator::FULLY_CONNECTED;
+      for (size_t slot = 0; slot < op->inputs.size(); ++slot) {
+        if (op->inputs[slot] < 0) {
+          continue;
+        }
+        const tflite::TensorT& tensor = *subgraph->tensors[op->inputs[slot]];
+        const uint32_t buffer = tensor.buffer;
+        if (buffer >= use.size() || use[buffer] != detail::BufferUse::CONVERT) {
+          continue;
+        }
+        const bool sparse_kernel =
+            fully_connected && slot == 1 && is_float(op->inputs) &&
+            is_float(op->outputs) && tensor.shape.size() == 2 &&
+            model_table.buffers[buffer]->data.size() ==
+                element_count(tensor.shape) * sizeof(float) &&
+            (weights[buffer] == nullptr ||
+             weights[buffer]->shape == tensor.shape);
+        if (!sparse_kernel) {
+          use[buffer] = detail::BufferUse::KEEP;
+          continue;
+        }
+        weights[buffer] = &tensor;
+      }
+    }
+  }
+
+  std::vector<uint32_t> buffers;
+  for (size_t i = 0; i < use.size(); ++i) {
+    if (use[i] == detail::BufferUse::CONVERT && weights[i] != nullptr) {
+      buffers.emplace_back(i);
+    }
+  }
+  std::ranges::sort(buffers, [&](uint32_t a, uint32_t b) {
+    return model_table.buffers[a]->data.size() >
+           model_table.buffers[b]->data.size();
+  });
+
+  std::vector<PtrType<tflite::SparsityParametersT>> sparsity(use.size());
+  std::vector<size_t> saved(use.size(), 0);
+  parallel_for(buffers.size(), jobs, [&](size_t index) {
+    const uint32_t buffer = buffers[index];
+    const int32_t rows = weights[buffer]->shape[0],
+                  columns = weights[buffer]->shape[1];
+    std::vector<uint8_t>& data = model_table.buffers[buffer]->data;
+    const float* dense = reinterpret_cast<const float*>(data.data());
+
+    std::vector<int32_t> segments(rows + 1, 0), indices;
+    std::vector<float> values;
+    for (int32_t r = 0; r < rows; ++r) {
+      for (int32_t c = 0; c < columns; ++c) {
+        const float x = dense[static_cast<size_t>(r) * columns + c];
+        if (x != 0.0f) {
+          indices.emplace_back(c);
+          values.emplace_back(x);
+        }
+      }
+      segments[r + 1] = values.size();
+    }
+    const size_t elements = static_cast<size_t>(rows) * columns;
+    const size_t nonzeros = values.size();
+    const size_t encoded =
+        nonzeros * sizeof(float) +
+        nonzeros * detail::index_bytes(columns) +
+        (rows + 1) * detail::index_bytes(static_cast<int32_t>(nonzeros) + 1);
+    if (elements == 0 ||
+        1.0 - static_cast<double>(nonzeros) / elements < min_zero_ratio ||
+        encoded >= data.size()) {
+      return;
+    }
+
+    auto params = make_ptr<tflite::SparsityParametersT>();
+    params->traversal_order = {0, 1};
+    auto row_dim = make_ptr<tflite::DimensionMetadataT>();
+    row_dim->format = tflite::DimensionType::DENSE;
+    row_dim->dense_size = rows;
+    auto column_dim = make_ptr<tflite::DimensionMetadataT>();
+    column_dim->format = tflite::DimensionType::SPARSE_CSR;
+    column_dim->array_segments =
+        detail::index_vector(segments, static_cast<int32_t>(nonzeros) + 1);
+    column_dim->array_indices = detail::index_vector(indices, columns);
+    params->dim_metadata = {std::move(row_dim), std::move(column_dim)};
+
+    saved[buffer] = data.size() - encoded;
+    data.resize(nonzeros * sizeof(float));
+    std::memcpy(data.data(), values.data(), data.size());
+    sparsity[buffer] = std::move(params);
+  });
+
+  size_t encoded = 0, bytes = 0;
+  for (size_t i = 0; i < sparsity.size(); ++i) {
+    encoded += sparsity[i] != nullptr;
+    bytes += saved[i];
+  }
+  for (const PtrType<tflite::SubGraphT>& subgraph : model_table.subgraphs) {
+    for (const PtrType<tflite::TensorT>& tensor : subgraph->tensors) {
+      if (tensor->buffer < sparsity.size() &&
+          sparsity[tensor->buffer] != nullptr) {
+        tensor->sparsity = sparsity[tensor->buffer];
+      }
+    }
+    for (const PtrType<tflite::OperatorT>& op : subgraph->operators) {
+      if (op->inputs.size() < 2 || op->inputs[1] < 0) {
+        continue;
+      }
+      const uint32_t buffer = subgraph->tensors[op->inputs[1]]->buffer;
+      if (buffer < sparsity.size() && sparsity[buffer] != nullptr) {
+        tflite::OperatorCodeT& code =
+            *model_table.operator_codes[op->opcode_index];
+        code.version = std::max(code.version, 8);
+      }
+    }
+  }
+
+  std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+  log_info("Encoded {} of {} fully connected weight buffers as sparse in "
+           "{:.3f} s, saving {} KB.",
+           encoded,
+           buffers.size(),
+           elapsed.count(),
+           bytes >> 10);
+  return bytes;
+}
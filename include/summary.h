@@ -0,0 +1,357 @@
+#pragma once
+
+#include <bit>          // std::endian
+#include <cstddef>      // size_t
+#include <cstdint>      // int32_t uint32_t uint64_t
+#include <cstring>      // std::memcpy
+#include <fstream>      // std::ifstream std::ios::binary
+#include <optional>     // std::optional
+#include <string>       // std::string
+#include <string_view>  // std::string_view
+#include <type_traits>  // std::is_arithmetic_v std::is_enum_v
+#include <utility>      // std::pair
+#include <vector>       // std::vector
+
+#include <fmt/format.h>
+
+#include "buffered_output.h"
+#include "def.h"
+#include "graph.h"
+#include "log.h"
+#include "schema.h"
+#include "tflite_generated.hpp"
+
+// Machine-readable summaries of a split model, written next to the legacy
+// <model>.txt:
+//
+//   <model>.json     versioned JSON, one tensor or operator per line
+//   <model>.summary  the same content in a compact little-endian binary form
+//
+// Both are streamed while walking the model, so memory does not grow with
+// its size. The binary layout, version 1:
+//
+//   file      := "TFSM" u32:version string:model u32:count subgraph*
+//   subgraph  := string:name u32:count tensor* u32:count operator*
+//   tensor    := string:name i8:type u32:buffer u64:bytes u64:buffer_bytes
+//                vector:shape_signature
+//   operator  := string:opcode vector:inputs vector:outputs string:file
+//   string    := u32:length bytes
+//   vector    := u32:length i32*
+//
+// `bytes` is the runtime size of the tensor, 0 if its shape is dynamic, and
+// `buffer_bytes` the size of its constant data. `file` is the split operator
+// relative to the model folder; with --unique_ops, that of the operator
+// written for its class.
+
+constexpr uint32_t summary_version = 1;
+constexpr std::string_view summary_magic = "TFSM";
+
+static_assert(std::endian::native == std::endian::little,
+              "the binary summary is written in host byte order");
+
+struct TensorSummary {
+  std::string name;
+  tflite::TensorType type = tflite::TensorType::FLOAT32;
+  uint32_t buffer = 0;
+  uint64_t bytes = 0;
+  uint64_t buffer_bytes = 0;
+  std::vector<int32_t> shape_signature;
+};
+
+struct OperatorSummary {
+  std::string opcode;
+  std::vector<int32_t> inputs;
+  std::vector<int32_t> outputs;
+  fs::path file;
+};
+
+struct SubgraphSummary {
+  std::string name;
+  std::vector<TensorSummary> tensors;
+  std::vector<OperatorSummary> operators;
+};
+
+struct ModelSummary {
+  uint32_t version = summary_version;
+  std::string model_name;
+  std::vector<SubgraphSummary> subgraphs;
+};
+
+// Name of the file holding one split operator, relative to the model folder.
+fs::path operator_file_name(const fs::path& model_name,
+                            size_t subgraph_index,
+                            size_t operator_index) {
+  return fmt::format(
+      "{}_{}_{}.tflite", model_name.string(), subgraph_index, operator_index);
+}
+
+// Operator whose split file stands for each operator, by subgraph and
+// operator index. Empty when every operator is written to its own file.
+using SplitFiles = std::vector<std::vector<std::pair<uint32_t, uint32_t>>>;
+
+fs::path split_file_name(const fs::path& model_name,
+                         const SplitFiles& split_files,
+                         size_t subgraph_index,
+                         size_t operator_index) {
+  if (split_files.empty()) {
+    return operator_file_name(model_name, subgraph_index, operator_index);
+  }
+  auto [s, o] = split_files[subgraph_index][operator_index];
+  return operator_file_name(model_name, s, o);
+}
+
+namespace detail {
+
+void print_shape(BufferedOutput& out,
+                 const flatbuffers::Vector<int32_t>* shape,
+                 std::string_view separator) {
+  if (shape != nullptr) {
+    out.print("{}", fmt::join(shape->begin(), shape->end(), separator));
+  }
+}
+
+template <typename T>
+  requires std::is_arithmetic_v<T> || std::is_enum_v<T>
+void put(BufferedOutput& out, T value) {
+  out.write(&value, sizeof(value));
+}
+
+void put(BufferedOutput& out, std::string_view text) {
+  put(out, static_cast<uint32_t>(text.size()));
+  out.write(text.data(), text.size());
+}
+
+void put(BufferedOutput& out, const std::vector<int32_t>& values) {
+  put(out, static_cast<uint32_t>(values.size()));
+  out.write(values.data(), values.size() * sizeof(int32_t));
+}
+
+// Bounds-checked cursor over a loaded binary summary.
+class SummaryReader {
+ public:
+  explicit SummaryReader(std::string_view bytes) : bytes_(bytes) {}
+
+  template <typename T>
+    requires std::is_arithmetic_v<T> || std::is_enum_v<T>
+  bool get(T& value) {
+    if (bytes_.size() < sizeof(T)) {
+      return false;
+    }
+    std::memcpy(&value, bytes_.data(), sizeof(T));
+    bytes_.remove_prefix(sizeof(T));
+    return true;
+  }
+
+  bool get(std::string& text) {
+    uint32_t size = 0;
+    if (!get(size) || bytes_.size() < size) {
+      return false;
+    }
+    text.assign(bytes_.substr(0, size));
+    bytes_.remove_prefix(size);
+    return true;
+  }
+
+  bool get(std::vector<int32_t>& values) {
+    uint32_t size = 0;
+    if (!get(size) || bytes_.size() / sizeof(int32_t) < size) {
+      return false;
+    }
+    values.resize(size);
+    std::memcpy(values.data(), bytes_.data(), size * sizeof(int32_t));
+    bytes_.remove_prefix(size * sizeof(int32_t));
+    return true;
+  }
+
+  // Consumes `prefix` if the remaining bytes start with it.
+  bool skip(std::string_view prefix) {
+    if (!bytes_.starts_with(prefix)) {
+      return false;
+    }
+    bytes_.remove_prefix(prefix.size());
+    return true;
+  }
+
+  // Reads a count and checks that at least `min_size` bytes per element
+  // remain, so a corrupt count cannot trigger a huge allocation.
+  bool get_count(uint32_t& count, size_t min_size) {
+    return get(count) && bytes_.size() / min_size >= count;
+  }
+
+  bool done() const {
+    return bytes_.empty();
+  }
+
+ private:
+  std::string_view bytes_;
+};
+
+}  // namespace detail
+
+void save_summary_json(const tflite::ModelT& model_table,
+                       const std::vector<GraphAnalysis>& analyses,
+                       const SplitFiles& split_files,
+                       const fs::path& model_name,
+                       const fs::path& model_folder) {
+  fs::path summary_path = model_folder / (model_name.string() + ".json");
+  detail::FilePtr file = detail::open_for_writing(summary_path);
+  BufferedOutput out(file.get());
+
+  out.print("{{\n\"version\": {},\n\"model\": ", summary_version);
+  detail::print_json_string(out, model_name.string());
+  out.print(",\n\"subgraphs\": [");
+  for (size_t subgraph_index = 0; subgraph_index < model_table.subgraphs.size();
+       ++subgraph_index) {
+    const tflite::SubGraphT& subgraph = *model_table.subgraphs[subgraph_index];
+    out.print("{}\n{{\"name\": ", subgraph_index == 0 ? "" : ",");
+    detail::print_json_string(out, subgraph.name);
+    const GraphAnalysis& analysis = analyses[subgraph_index];
+    out.print(
+        ",\n\"parallelism\": {{\"work\": {}, \"critical_path_cost\": {}, "
+        "\"speedup\": {:.4f}, \"levels\": {}, \"max_width\": {}}}",
+        analysis.work,
+        analysis.span,
+        analysis.speedup(),
+        analysis.width.size(),
+        analysis.max_width());
+
+    out.print(",\n\"tensors\": [");
+    for (size_t i = 0; i < subgraph.tensors.size(); ++i) {
+      const tflite::TensorT& tensor = *subgraph.tensors[i];
+      out.print("{}\n{{\"name\": ", i == 0 ? "" : ",");
+      detail::print_json_string(out, tensor.name);
+      out.print(
+          ", \"type\": \"{}\", \"buffer\": {}, \"bytes\": {}, "
+          "\"buffer_bytes\": {}, \"shape_signature\": [{}]}}",
+          tflite::EnumNameTensorType(tensor.type),
+          tensor.buffer,
+          tensor_bytes(tensor),
+          model_table.buffers[tensor.buffer]->data.size(),
+          fmt::join(tensor.shape_signature, ", "));
+    }
+
+    out.print("],\n\"operators\": [");
+    for (size_t i = 0; i < subgraph.operators.size(); ++i) {
+      const tflite::OperatorT& op = *subgraph.operators[i];
+      out.print("{}\n{{\"opcode\": ", i == 0 ? "" : ",");
+      detail::print_json_string(
+          out, opcode_name(*model_table.operator_codes[op.opcode_index]));
+      out.print(", \"inputs\": [{}], \"outputs\": [{}], \"file\": ",
+                fmt::join(op.inputs, ", "),
+                fmt::join(op.outputs, ", "));
+      detail::print_json_string(
+          out,
+          split_file_name(model_name, split_files, subgraph_index, i)
+              .string());
+      out.print("}}");
+    }
+    out.print("]}}");
+  }
+  out.print("]\n}}\n");
+}
+
+void save_summary_binary(const tflite::ModelT& model_table,
+                         const SplitFiles& split_files,
+                         const fs::path& model_name,
+                         const fs::path& model_folder) {
+  fs::path summary_path = model_folder / (model_name.string() + ".summary");
+  detail::FilePtr file = detail::open_for_writing(summary_path);
+  BufferedOutput out(file.get());
+
+  out.write(summary_magic.data(), summary_magic.size());
+  detail::put(out, summary_version);
+  detail::put(out, model_name.string());
+  detail::put(out, static_cast<uint32_t>(model_table.subgraphs.size()));
+  for (size_t subgraph_index = 0; subgraph_index < model_table.subgraphs.size();
+       ++subgraph_index) {
+    const tflite::SubGraphT& subgraph = *model_table.subgraphs[subgraph_index];
+    detail::put(out, subgraph.name);
+
+    detail::put(out, static_cast<uint32_t>(subgraph.tensors.size()));
+    for (const PtrType<tflite::TensorT>& tensor : subgraph.tensors) {
+      detail::put(out, tensor->name);
+      detail::put(out, tensor->type);
+      detail::put(out, tensor->buffer);
+      detail::put(out, static_cast<uint64_t>(tensor_bytes(*tensor)));
+      detail::put(out,
+                  static_cast<uint64_t>(
+                      model_table.buffers[tensor->buffer]->data.size()));
+      detail::put(out, tensor->shape_signature);
+    }
+
+    detail::put(out, static_cast<uint32_t>(subgraph.operators.size()));
+    for (size_t i = 0; i < subgraph.operators.size(); ++i) {
+      const tflite::OperatorT& op = *subgraph.operators[i];
+      detail::put(out,
+                  opcode_name(*model_table.operator_codes[op.opcode_index]));
+      detail::put(out, op.inputs);
+      detail::put(out, op.outputs);
+      detail::put(
+          out,
+          split_file_name(model_name, split_files, subgraph_index, i)
+              .string());
+    }
+  }
+}
+
+// Loads a binary summary written by save_summary_binary, so tools can list
+// tensors and split files without opening the model. Returns nothing and
+// logs the reason if the file is missing, truncated or of another version.
+std::optional<ModelSummary> load_summary(const fs::path& summary_path) {
+  std::ifstream input{summary_path, std::ios::binary};
+  if (!input) {
+    log_error("Cannot open summary {}.", summary_path.string());
+    return std::nullopt;
+  }
+  std::string bytes(fs::file_size(summary_path), '\0');
+  input.read(bytes.data(), bytes.size());
+
+  detail::SummaryReader reader(bytes);
+  if (!reader.skip(summary_magic)) {
+    log_error("{} is not a model summary.", summary_path.string());
+    return std::nullopt;
+  }
+
+  ModelSummary summary;
+  uint32_t n_subgraphs = 0;
+  if (!reader.get(summary.version) || summary.version != summary_version) {
+    log_error("Summary {} has version {}, expect {}.",
+              summary_path.string(),
+              summary.version,
+              summary_version);
+    return std::nullopt;
+  }
+
+  // the smallest encodings of a subgraph, tensor and operator
+  constexpr size_t subgraph_size = 12, tensor_size = 29, operator_size = 16;
+  bool valid = reader.get(summary.model_name) &&
+               reader.get_count(n_subgraphs, subgraph_size);
+  summary.subgraphs.resize(valid ? n_subgraphs : 0);
+  for (SubgraphSummary& subgraph : summary.subgraphs) {
+    uint32_t n_tensors = 0, n_operators = 0;
+    valid = valid && reader.get(subgraph.name) &&
+            reader.get_count(n_tensors, tensor_size);
+    subgraph.tensors.resize(valid ? n_tensors : 0);
+    for (TensorSummary& tensor : subgraph.tensors) {
+      valid = valid && reader.get(tensor.name) && reader.get(tensor.type) &&
+              reader.get(tensor.buffer) && reader.get(tensor.bytes) &&
+              reader.get(tensor.buffer_bytes) &&
+              reader.get(tensor.shape_signature);
+    }
+
+    valid = valid && reader.get_count(n_operators, operator_size);
+    subgraph.operators.resize(valid ? n_operators : 0);
+    for (OperatorSummary& op : subgraph.operators) {
+      std::string file;
+      valid = valid && reader.get(op.opcode) && reader.get(op.inputs) &&
+              reader.get(op.outputs) && reader.get(file);
+      op.file = file;
+    }
+  }
+
+  if (!valid || !reader.done()) {
+    log_error("Summary {} is truncated or malformed.", summary_path.string());
+    return std::nullopt;
+  }
+  return summary;
+}
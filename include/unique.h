@@ -0,0 +1,238 @@
+#pragma once
+
+#include <cstddef>        // size_t
+#include <cstdint>        // int32_t uint8_t uint32_t uint64_t
+#include <functional>     // std::hash
+#include <string>         // std::string
+#include <string_view>    // std::string_view
+#include <type_traits>    // std::is_arithmetic_v std::is_enum_v
+#include <unordered_map>  // std::unordered_map
+#include <utility>        // std::pair
+#include <vector>         // std::vector
+
+#include <fmt/format.h>
+
+#include "buffered_output.h"
+#include "def.h"
+#include "schema.h"
+#include "summary.h"
+#include "tflite_generated.hpp"
+
+// Operators that differ only in their weights run the same kernel, so a
+// catalog of distinct configurations is enough to profile a model. Two
+// operators are equivalent when they share the operator code and version,
+// the serialized options, the type, shape, constness and kind of
+// quantization of every input, output and intermediate, and the values of
+// constant parameters. Those are the integer constants that are not
+// quantized weights, such as a TRANSPOSE permutation or the begin, end and
+// strides of STRIDED_SLICE, which change the work the kernel does.
+
+struct OperatorClass {
+  // first operator of the class, the one that is written out
+  size_t subgraph_index = 0;
+  size_t operator_index = 0;
+  std::vector<std::pair<size_t, size_t>> members;
+};
+
+struct OperatorCatalog {
+  std::vector<OperatorClass> classes;
+  // class of every operator, by subgraph and operator index
+  std::vector<std::vector<uint32_t>> class_of;
+};
+
+namespace detail {
+
+template <typename T>
+  requires std::is_arithmetic_v<T> || std::is_enum_v<T>
+void append(std::string& key, T value) {
+  key.append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+void append(std::string& key, std::string_view bytes) {
+  append(key, static_cast<uint32_t>(bytes.size()));
+  key.append(bytes);
+}
+
+void append(std::string& key, const std::vector<int32_t>& values) {
+  append(key,
+         std::string_view(reinterpret_cast<const char*>(values.data()),
+                          values.size() * sizeof(int32_t)));
+}
+
+// Whether a constant is a parameter of the kernel rather than weights.
+bool is_parameter(const tflite::TensorT& tensor) {
+  const tflite::QuantizationParametersT* q = tensor.quantization.get();
+  if (q != nullptr && !q->scale.empty()) {
+    return false;
+  }
+  switch (tensor.type) {
+    case tflite::TensorType::INT8:
+    case tflite::TensorType::INT16:
+    case tflite::TensorType::INT32:
+    case tflite::TensorType::INT64:
+    case tflite::TensorType::UINT8:
+    case tflite::TensorType::UINT16:
+    case tflite::TensorType::UINT32:
+    case tflite::TensorType::UINT64:
+    case tflite::TensorType::BOOL: {
+      return true;
+    }
+    default: {
+      return false;
+    }
+  }
+}
+
+void append_tensors(std::string& key,
+                    const tflite::ModelT& model_table,
+                    const tflite::SubGraphT& subgraph,
+                    const std::vector<int32_t>& indices) {
+  append(key, static_cast<uint32_t>(indices.size()));
+  for (int32_t index : indices) {
+    if (index < 0) {
+      append(key, int8_t{-1});
+      continue;
+    }
+    const tflite::TensorT& tensor = *subgraph.tensors[index];
+    const tflite::QuantizationParametersT* q = tensor.quantization.get();
+    const std::vector<uint8_t>& data = model_table.buffers[tensor.buffer]->data;
+    append(key, tensor.type);
+    append(key, static_cast<uint8_t>(!data.empty()));
+    append(key, static_cast<uint32_t>(q == nullptr ? 0 : q->scale.size()));
+    append(key, tensor.shape);
+    append(key, tensor.shape_signature);
+    if (!data.empty() && is_parameter(tensor)) {
+      // parameters are short; a large one, such as a lookup table, is hashed
+      std::string_view bytes(reinterpret_cast<const char*>(data.data()),
+                             data.size());
+      if (bytes.size() <= 256) {
+        append(key, bytes);
+      } else {
+        append(key,
+               static_cast<uint64_t>(std::hash<std::string_view>()(bytes)));
+      }
+    }
+  }
+}
+
+// Canonical byte string of an operator's configuration. Options are
+// compared in their serialized form, which FlatBuffers produces
+// deterministically for equal values.
+void operator_key(const tflite::ModelT& model_table,
+                  const tflite::SubGraphT& subgraph,
+                  const tflite::OperatorT& op,
+                  flatbuffers::FlatBufferBuilder& scratch,
+                  std::string& key) {
+  const tflite::OperatorCodeT& code =
+      *model_table.operator_codes[op.opcode_index];
+  key.clear();
+  append(key, builtin_code(code));
+  append(key, code.custom_code);
+  append(key, code.version);
+
+  append(key, op.builtin_options.type);
+  scratch.Clear();
+  if (op.builtin_options.value != nullptr) {
+    scratch.Finish(op.builtin_options.Pack(scratch));
+  }
+  append(key,
+         std::string_view(
+             reinterpret_cast<const char*>(scratch.GetBufferPointer()),
+             scratch.GetSize()));
+  append(key,
+         std::string_view(
+             reinterpret_cast<const char*>(op.custom_options.data()),
+             op.custom_options.size()));
+
+  append_tensors(key, model_table, subgraph, op.inputs);
+  append_tensors(key, model_table, subgraph, op.outputs);
+  append_tensors(key, model_table, subgraph, op.intermediates);
+}
+
+}  // namespace detail
+
+// Groups the operators of every subgraph into equivalence classes, in order
+// of first appearance.
+OperatorCatalog catalog_operators(const tflite::ModelT& model_table) {
+  OperatorCatalog catalog;
+  std::unordered_map<std::string, uint32_t> classes;
+  flatbuffers::FlatBufferBuilder scratch(256);
+  std::string key;
+
+  catalog.class_of.resize(model_table.subgraphs.size());
+  for (size_t subgraph_index = 0; subgraph_index < model_table.subgraphs.size();
+       ++subgraph_index) {
+    const tflite::SubGraphT& subgraph = *model_table.subgraphs[subgraph_index];
+    catalog.class_of[subgraph_index].reserve(subgraph.operators.size());
+    for (size_t i = 0; i < subgraph.operators.size(); ++i) {
+      detail::operator_key(
+          model_table, subgraph, *subgraph.operators[i], scratch, key);
+      auto [it, inserted] = classes.try_emplace(key, catalog.classes.size());
+      if (inserted) {
+        catalog.classes.emplace_back(OperatorClass{subgraph_index, i, {}});
+      }
+      catalog.classes[it->second].members.emplace_back(subgraph_index, i);
+      catalog.class_of[subgraph_index].emplace_back(it->second);
+    }
+  }
+  return catalog;
+}
+
+// Representative of every operator, whose split file stands for it.
+SplitFiles representative_files(const OperatorCatalog& catalog) {
+  SplitFiles split_files(catalog.class_of.size());
+  for (size_t s = 0; s < catalog.class_of.size(); ++s) {
+    split_files[s].reserve(catalog.class_of[s].size());
+    for (uint32_t class_index : catalog.class_of[s]) {
+      const OperatorClass& op_class = catalog.classes[class_index];
+      split_files[s].emplace_back(op_class.subgraph_index,
+                                  op_class.operator_index);
+    }
+  }
+  return split_files;
+}
+
+// Writes <model>.unique.json: every class with its multiplicity, the file of
+// its representative and its members, then the class of every operator.
+void save_catalog(const tflite::ModelT& model_table,
+                  const OperatorCatalog& catalog,
+                  const fs::path& model_name,
+                  const fs::path& model_folder) {
+  fs::path catalog_path = model_folder / (model_name.string() + ".unique.json");
+  detail::FilePtr file = detail::open_for_writing(catalog_path);
+  BufferedOutput out(file.get());
+
+  out.print("{{\n\"version\": {},\n\"model\": ", summary_version);
+  detail::print_json_string(out, model_name.string());
+  out.print(",\n\"classes\": [");
+  for (size_t i = 0; i < catalog.classes.size(); ++i) {
+    const OperatorClass& op_class = catalog.classes[i];
+    const tflite::OperatorT& op =
+        *model_table.subgraphs[op_class.subgraph_index]
+             ->operators[op_class.operator_index];
+    out.print("{}\n{{\"class\": {}, \"opcode\": ", i == 0 ? "" : ",", i);
+    detail::print_json_string(
+        out, opcode_name(*model_table.operator_codes[op.opcode_index]));
+    out.print(", \"count\": {}, \"file\": ", op_class.members.size());
+    detail::print_json_string(out,
+                              operator_file_name(model_name,
+                                                 op_class.subgraph_index,
+                                                 op_class.operator_index)
+                                  .string());
+    out.print(", \"operators\": [");
+    for (size_t m = 0; m < op_class.members.size(); ++m) {
+      out.print("{}[{}, {}]",
+                m == 0 ? "" : ", ",
+                op_class.members[m].first,
+                op_class.members[m].second);
+    }
+    out.print("]}}");
+  }
+  out.print("],\n\"operator_classes\": [");
+  for (size_t i = 0; i < catalog.class_of.size(); ++i) {
+    out.print("{}\n[{}]",
+              i == 0 ? "" : ",",
+              fmt::join(catalog.class_of[i], ", "));
+  }
+  out.print("]\n}}\n");
+}
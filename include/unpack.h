@@ -0,0 +1,76 @@
+#pragma once
+
+#include <cstddef>          // size_t
+#include <memory>           // std::allocate_shared
+#include <memory_resource>  // std::pmr::monotonic_buffer_resource
+
+#include "def.h"
+#include "tflite_generated.hpp"
+
+// Monotonic arena for the object tree of an unpacked model. It must outlive
+// the tflite::ModelT filled from it.
+class ModelArena {
+ public:
+  explicit ModelArena(size_t initial_size = 1 << 20)
+      : resource_(initial_size) {}
+
+  ModelArena(const ModelArena&) = delete;
+  ModelArena& operator=(const ModelArena&) = delete;
+
+  template <typename T>
+  PtrType<T> make() {
+    return std::allocate_shared<T>(
+        std::pmr::polymorphic_allocator<T>(&resource_));
+  }
+
+ private:
+  std::pmr::monotonic_buffer_resource resource_;
+};
+
+namespace detail {
+
+template <typename T, typename Table>
+void preallocate(PtrContainerType<T>& objects,
+                 const flatbuffers::Vector<flatbuffers::Offset<Table>>* tables,
+                 ModelArena& arena) {
+  if (tables == nullptr) {
+    return;
+  }
+  objects.reserve(tables->size());
+  for (flatbuffers::uoffset_t i = 0; i < tables->size(); ++i) {
+    objects.emplace_back(arena.make<T>());
+  }
+}
+
+}  // namespace detail
+
+// Unpacks `model` into `model_table`. In the SPLIT_TFLITE_ARENA build the
+// tables that exist once per tensor, operator and buffer are first placed in
+// `arena`, each object and its control block in one bump allocation; the
+// generated UnPackTo then fills those objects in place instead of allocating
+// them one by one on the heap.
+void unpack_model(const tflite::Model* model,
+                  tflite::ModelT& model_table,
+                  [[maybe_unused]] ModelArena& arena) {
+#ifdef SPLIT_TFLITE_ARENA
+  detail::preallocate(
+      model_table.operator_codes, model->operator_codes(), arena);
+  detail::preallocate(model_table.buffers, model->buffers(), arena);
+  detail::preallocate(model_table.metadata, model->metadata(), arena);
+  detail::preallocate(model_table.subgraphs, model->subgraphs(), arena);
+  for (flatbuffers::uoffset_t i = 0; i < model_table.subgraphs.size(); ++i) {
+    const tflite::SubGraph* subgraph = model->subgraphs()->Get(i);
+    tflite::SubGraphT& subgraph_table = *model_table.subgraphs[i];
+    detail::preallocate(subgraph_table.tensors, subgraph->tensors(), arena);
+    detail::preallocate(subgraph_table.operators, subgraph->operators(), arena);
+    for (flatbuffers::uoffset_t j = 0; j < subgraph_table.tensors.size();
+         ++j) {
+      if (subgraph->tensors()->Get(j)->quantization() != nullptr) {
+        subgraph_table.tensors[j]->quantization =
+            arena.make<tflite::QuantizationParametersT>();
+      }
+    }
+  }
+#endif
+  model->UnPackTo(&model_table);
+}
@@ -0,0 +1,272 @@
+#pragma once
+
+#include <algorithm>  // std::min std::max
+#include <atomic>     // std::atomic
+#include <chrono>     // std::chrono::steady_clock
+#include <cstddef>    // size_t
+#include <cstdint>    // uint8_t int32_t uint32_t
+#include <string>     // std::string
+#include <utility>    // std::unreachable
+#include <vector>     // std::vector
+
+#include <fmt/core.h>
+
+#include "log.h"
+#include "parallel.h"
+#include "tflite_generated.hpp"
+
+namespace detail {
+
+// Generated tables inherit flatbuffers::Table privately; the field checks
+// used by their Verify() are reached through this view.
+template <typename T>
+const flatbuffers::Table& as_table(const T* object) {
+  return *reinterpret_cast<const flatbuffers::Table*>(object);
+}
+
+template <typename T>
+bool in_range(const flatbuffers::Vector<T>* indices,
+              int64_t lower,
+              int64_t upper) {
+  if (indices == nullptr) {
+    return true;
+  }
+  for (T index : *indices) {
+    if (index < lower || index >= upper) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Verifies the subgraph table and the headers of its vectors. Tensor and
+// operator tables are left to the chunked stage.
+bool verify_subgraph_shallow(flatbuffers::Verifier& verifier,
+                             const tflite::SubGraph* subgraph) {
+  using tflite::SubGraph;
+  const flatbuffers::Table& table = as_table(subgraph);
+  return table.VerifyTableStart(verifier) &&
+         table.VerifyOffset(verifier, SubGraph::VT_TENSORS) &&
+         verifier.VerifyVector(subgraph->tensors()) &&
+         table.VerifyOffset(verifier, SubGraph::VT_INPUTS) &&
+         verifier.VerifyVector(subgraph->inputs()) &&
+         table.VerifyOffset(verifier, SubGraph::VT_OUTPUTS) &&
+         verifier.VerifyVector(subgraph->outputs()) &&
+         table.VerifyOffset(verifier, SubGraph::VT_OPERATORS) &&
+         verifier.VerifyVector(subgraph->operators()) &&
+         table.VerifyOffset(verifier, SubGraph::VT_NAME) &&
+         verifier.VerifyString(subgraph->name()) && verifier.EndTable();
+}
+
+// Same checks as Model::Verify, except that buffers and the tables inside
+// subgraphs are only bounds-checked as vectors here.
+bool verify_model_shallow(flatbuffers::Verifier& verifier,
+                          const tflite::Model* model) {
+  using tflite::Model;
+  const flatbuffers::Table& table = as_table(model);
+  if (!table.VerifyTableStart(verifier) ||
+      !table.VerifyField<uint32_t>(verifier, Model::VT_VERSION, 4) ||
+      !table.VerifyOffset(verifier, Model::VT_OPERATOR_CODES) ||
+      !verifier.VerifyVector(model->operator_codes()) ||
+      !verifier.VerifyVectorOfTables(model->operator_codes()) ||
+      !table.VerifyOffset(verifier, Model::VT_SUBGRAPHS) ||
+      !verifier.VerifyVector(model->subgraphs())) {
+    return false;
+  }
+  if (model->subgraphs() != nullptr) {
+    for (const tflite::SubGraph* subgraph : *model->subgraphs()) {
+      if (subgraph == nullptr ||
+          !verify_subgraph_shallow(verifier, subgraph)) {
+        return false;
+      }
+    }
+  }
+  return table.VerifyOffset(verifier, Model::VT_DESCRIPTION) &&
+         verifier.VerifyString(model->description()) &&
+         table.VerifyOffset(verifier, Model::VT_BUFFERS) &&
+         verifier.VerifyVector(model->buffers()) &&
+         table.VerifyOffset(verifier, Model::VT_METADATA_BUFFER) &&
+         verifier.VerifyVector(model->metadata_buffer()) &&
+         table.VerifyOffset(verifier, Model::VT_METADATA) &&
+         verifier.VerifyVector(model->metadata()) &&
+         verifier.VerifyVectorOfTables(model->metadata()) &&
+         table.VerifyOffset(verifier, Model::VT_SIGNATURE_DEFS) &&
+         verifier.VerifyVector(model->signature_defs()) &&
+         verifier.VerifyVectorOfTables(model->signature_defs()) &&
+         verifier.EndTable();
+}
+
+// A contiguous range of tables verified by one task.
+struct VerifyChunk {
+  enum struct Kind { BUFFERS, TENSORS, OPERATORS };
+
+  Kind kind;
+  uint32_t subgraph;
+  uint32_t begin;
+  uint32_t end;
+};
+
+// Verifies the tables of `chunk` and the indices they hold: tensors must
+// name an existing buffer, operators an existing operator code and tensors.
+bool verify_chunk(flatbuffers::Verifier& verifier,
+                  const tflite::Model* model,
+                  const VerifyChunk& chunk) {
+  const int64_t n_buffers = model->buffers() ? model->buffers()->size() : 0,
+                n_codes = model->operator_codes()
+                              ? model->operator_codes()->size()
+                              : 0;
+  switch (chunk.kind) {
+    case VerifyChunk::Kind::BUFFERS: {
+      for (uint32_t i = chunk.begin; i < chunk.end; ++i) {
+        if (!verifier.VerifyTable(model->buffers()->Get(i))) {
+          return false;
+        }
+      }
+      return true;
+    }
+    case VerifyChunk::Kind::TENSORS: {
+      const tflite::SubGraph* subgraph =
+          model->subgraphs()->Get(chunk.subgraph);
+      for (uint32_t i = chunk.begin; i < chunk.end; ++i) {
+        const tflite::Tensor* tensor = subgraph->tensors()->Get(i);
+        if (!verifier.VerifyTable(tensor) ||
+            (tensor != nullptr && tensor->buffer() >= n_buffers)) {
+          return false;
+        }
+      }
+      return true;
+    }
+    case VerifyChunk::Kind::OPERATORS: {
+      const tflite::SubGraph* subgraph =
+          model->subgraphs()->Get(chunk.subgraph);
+      const int64_t n_tensors =
+          subgraph->tensors() ? subgraph->tensors()->size() : 0;
+      for (uint32_t i = chunk.begin; i < chunk.end; ++i) {
+        const tflite::Operator* op = subgraph->operators()->Get(i);
+        if (!verifier.VerifyTable(op) || op == nullptr ||
+            op->opcode_index() >= n_codes ||
+            !in_range(op->inputs(), -1, n_tensors) ||
+            !in_range(op->outputs(), -1, n_tensors) ||
+            !in_range(op->intermediates(), -1, n_tensors)) {
+          return false;
+        }
+      }
+      return true;
+    }
+    default: {
+      std::unreachable();
+    }
+  }
+}
+
+std::string describe(const VerifyChunk& chunk) {
+  switch (chunk.kind) {
+    case VerifyChunk::Kind::BUFFERS:
+      return fmt::format("buffers [{}, {})", chunk.begin, chunk.end);
+    case VerifyChunk::Kind::TENSORS:
+      return fmt::format("tensors [{}, {}) of subgraph {}",
+                         chunk.begin,
+                         chunk.end,
+                         chunk.subgraph);
+    case VerifyChunk::Kind::OPERATORS:
+      return fmt::format("operators [{}, {}) of subgraph {}",
+                         chunk.begin,
+                         chunk.end,
+                         chunk.subgraph);
+    default:
+      std::unreachable();
+  }
+}
+
+}  // namespace detail
+
+// Checks that `data` is a well-formed tflite model whose indices stay in
+// range, before any of it is dereferenced. The top-level tables are verified
+// once; tensors, operators and buffers are then verified in chunks on `jobs`
+// threads, each with its own verifier over the whole file.
+bool verify_model(const uint8_t* data, size_t size, size_t jobs) {
+  constexpr uint32_t chunk_size = 4096;
+
+  std::chrono::steady_clock::time_point start =
+      std::chrono::steady_clock::now();
+  if (size < 2 * sizeof(flatbuffers::uoffset_t) ||
+      size >= FLATBUFFERS_MAX_BUFFER_SIZE) {
+    log_error("Model size {} Bytes is out of the flatbuffer range.", size);
+    return false;
+  }
+  if (!tflite::ModelBufferHasIdentifier(data)) {
+    log_error("Model lacks the {} file identifier.",
+              tflite::ModelIdentifier());
+    return false;
+  }
+
+  const tflite::Model* model = tflite::GetModel(data);
+  {
+    flatbuffers::Verifier verifier(data, size);
+    if (!detail::verify_model_shallow(verifier, model)) {
+      log_error("Model tables are malformed or truncated.");
+      return false;
+    }
+  }
+
+  std::vector<detail::VerifyChunk> chunks;
+  auto add_chunks = [&](detail::VerifyChunk::Kind kind,
+                        uint32_t subgraph,
+                        uint32_t count) {
+    for (uint32_t begin = 0; begin < count; begin += chunk_size) {
+      chunks.push_back(
+          {kind, subgraph, begin, std::min(count, begin + chunk_size)});
+    }
+  };
+  if (model->buffers() != nullptr) {
+    add_chunks(
+        detail::VerifyChunk::Kind::BUFFERS, 0, model->buffers()->size());
+  }
+  if (model->subgraphs() != nullptr) {
+    for (uint32_t i = 0; i < model->subgraphs()->size(); ++i) {
+      const tflite::SubGraph* subgraph = model->subgraphs()->Get(i);
+      const int64_t n_tensors =
+          subgraph->tensors() ? subgraph->tensors()->size() : 0;
+      if (!detail::in_range(subgraph->inputs(), 0, n_tensors) ||
+          !detail::in_range(subgraph->outputs(), 0, n_tensors)) {
+        log_error("Inputs or outputs of subgraph {} are out of range.", i);
+        return false;
+      }
+      if (subgraph->tensors() != nullptr) {
+        add_chunks(detail::VerifyChunk::Kind::TENSORS,
+                   i,
+                   subgraph->tensors()->size());
+      }
+      if (subgraph->operators() != nullptr) {
+        add_chunks(detail::VerifyChunk::Kind::OPERATORS,
+                   i,
+                   subgraph->operators()->size());
+      }
+    }
+  }
+
+  std::atomic<bool> valid = true;
+  parallel_for(chunks.size(), jobs, [&](size_t index) {
+    if (!valid.load(std::memory_order_relaxed)) {
+      return;
+    }
+    flatbuffers::Verifier verifier(data, size);
+    if (!detail::verify_chunk(verifier, model, chunks[index]) &&
+        valid.exchange(false)) {
+      log_error("Model {} are malformed or out of range.",
+                detail::describe(chunks[index]));
+    }
+  });
+  if (!valid) {
+    return false;
+  }
+
+  std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+  log_info("Verified {} Bytes in {} chunks in {:.3f} s ({:.2f} GB/s).",
+           size,
+           chunks.size(),
+           elapsed.count(),
+           size / std::max(elapsed.count(), 1e-9) / 1e9);
+  return true;
+}
@@ -0,0 +1,349 @@
+#pragma once
+
+#include <algorithm>  // std::max std::min std::ranges::sort
+#include <chrono>     // std::chrono::steady_clock
+#include <cstddef>    // size_t
+#include <cstdint>    // int8_t int32_t int64_t uint8_t uint16_t uint32_t
+#include <map>        // std::map
+#include <string>     // std::string
+#include <utility>    // std::move std::pair
+#include <vector>     // std::vector
+
+#include "def.h"
+#include "half.h"
+#include "int8.h"
+#include "log.h"
+#include "parallel.h"
+#include "schema.h"
+#include "tflite_generated.hpp"
+
+// Weight transforms applied to the unpacked model before it is split, so
+// the full model and every split operator carry the compact weights.
+
+namespace detail {
+
+// Index of an operator code, added if the model has none for `builtin`.
+// The version is raised to at least `version`.
+uint32_t operator_code(tflite::ModelT& model_table,
+                       tflite::BuiltinOperator builtin,
+                       int32_t version) {
+  for (size_t i = 0; i < model_table.operator_codes.size(); ++i) {
+    tflite::OperatorCodeT& code = *model_table.operator_codes[i];
+    if (builtin_code(code) == builtin) {
+      code.version = std::max(code.version, version);
+      return i;
+    }
+  }
+  auto code = make_ptr<tflite::OperatorCodeT>();
+  code->builtin_code = builtin;
+  code->deprecated_builtin_code = static_cast<int8_t>(
+      std::min(static_cast<int32_t>(builtin),
+               static_cast<int32_t>(
+                   tflite::BuiltinOperator::PLACEHOLDER_FOR_GREATER_OP_CODES)));
+  code->version = version;
+  model_table.operator_codes.emplace_back(std::move(code));
+  return model_table.operator_codes.size() - 1;
+}
+
+// Index of an empty buffer, for tensors that lose their constant data.
+uint32_t empty_buffer(tflite::ModelT& model_table) {
+  for (size_t i = 0; i < model_table.buffers.size(); ++i) {
+    if (model_table.buffers[i]->data.empty()) {
+      return i;
+    }
+  }
+  model_table.buffers.emplace_back(make_ptr<tflite::BufferT>());
+  return model_table.buffers.size() - 1;
+}
+
+// Routes the reads of converted tensors through DEQUANTIZE operators: a
+// compact constant on the converted buffer feeds one, and a float copy of
+// the original tensor without data takes its output. Every weight is decoded
+// once per subgraph, right before its first reader, and later readers share
+// the float output; OperatorExtractor takes the DEQUANTIZE along with any
+// of them.
+void insert_dequantize(tflite::ModelT& model_table,
+                       const std::vector<BufferUse>& use,
+                       tflite::TensorType compact_type,
+                       int32_t dequantize_version,
+                       const std::string& suffix) {
+  const uint32_t dequantize = operator_code(
+      model_table, tflite::BuiltinOperator::DEQUANTIZE, dequantize_version);
+  const uint32_t empty = empty_buffer(model_table);
+
+  for (const PtrType<tflite::SubGraphT>& subgraph : model_table.subgraphs) {
+    std::vector<bool> converted(subgraph->tensors.size(), false);
+    for (size_t t = 0; t < subgraph->tensors.size(); ++t) {
+      uint32_t buffer = subgraph->tensors[t]->buffer;
+      converted[t] = buffer < use.size() && use[buffer] == BufferUse::CONVERT;
+    }
+
+    // float output by converted tensor, and by weight for tensors that
+    // share a buffer and shape
+    std::vector<int32_t> decoded(subgraph->tensors.size(), -1);
+    std::map<std::pair<uint32_t, std::vector<int32_t>>, int32_t> weights;
+    PtrContainerType<tflite::OperatorT> operators;
+    operators.reserve(subgraph->operators.size());
+    for (PtrType<tflite::OperatorT>& op : subgraph->operators) {
+      for (int32_t& input : op->inputs) {
+        if (input < 0 || !converted[input]) {
+          continue;
+        }
+        if (decoded[input] >= 0) {
+          input = decoded[input];
+          continue;
+        }
+        const tflite::TensorT& source = *subgraph->tensors[input];
+        auto [weight, inserted] =
+            weights.try_emplace({source.buffer, source.shape}, -1);
+        if (inserted) {
+          // fp16 DEQUANTIZE takes no quantization parameters
+          auto compact = make_ptr<tflite::TensorT>();
+          compact->name = source.name + suffix;
+          compact->shape = source.shape;
+          compact->type = compact_type;
+          compact->buffer = source.buffer;
+          subgraph->tensors.emplace_back(compact);
+
+          auto output = make_ptr<tflite::TensorT>(source);
+          output->buffer = empty;
+          subgraph->tensors.emplace_back(output);
+
+          auto op_dequantize = make_ptr<tflite::OperatorT>();
+          op_dequantize->opcode_index = dequantize;
+          op_dequantize->inputs = {
+              static_cast<int32_t>(subgraph->tensors.size() - 2)};
+          op_dequantize->outputs = {
+              static_cast<int32_t>(subgraph->tensors.size() - 1)};
+          op_dequantize->builtin_options.Set(tflite::DequantizeOptionsT());
+          operators.emplace_back(std::move(op_dequantize));
+          weight->second = subgraph->tensors.size() - 1;
+        }
+        decoded[input] = weight->second;
+        input = weight->second;
+      }
+      operators.emplace_back(std::move(op));
+    }
+    subgraph->operators = std::move(operators);
+
+    // the originals are unread now; they keep their slot but not the data
+    for (size_t t = 0; t < converted.size(); ++t) {
+      if (converted[t]) {
+        subgraph->tensors[t]->buffer = empty;
+      }
+    }
+  }
+}
+
+// Channel axis of the weights (input 1) of operators that have a hybrid
+// kernel, taking int8 weights and float activations, and the operator
+// version that kernel needs. The fully connected hybrid kernel takes a
+// single scale, so its axis is -1.
+struct HybridKernel {
+  int32_t axis = 0;
+  int32_t version = 0;
+};
+
+HybridKernel hybrid_kernel(tflite::BuiltinOperator builtin) {
+  switch (builtin) {
+    case tflite::BuiltinOperator::CONV_2D: {
+      return {0, 5};
+    }
+    case tflite::BuiltinOperator::DEPTHWISE_CONV_2D: {
+      return {3, 6};
+    }
+    case tflite::BuiltinOperator::FULLY_CONNECTED: {
+      return {-1, 3};
+    }
+    default: {
+      return {};
+    }
+  }
+}
+
+}  // namespace detail
+
+// Stores FLOAT32 weights as FLOAT16, dequantized right before their readers
+// the way the tflite converter's float16 quantization does. Buffers are
+// converted on `jobs` threads. Returns the bytes saved.
+size_t convert_weights_to_fp16(tflite::ModelT& model_table, size_t jobs) {
+  std::chrono::steady_clock::time_point start =
+      std::chrono::steady_clock::now();
+  std::vector<detail::BufferUse> use =
+      detail::float_weight_buffers(model_table);
+
+  // small buffers are spread over the threads, large ones are sliced
+  std::vector<uint32_t> small, large;
+  size_t bytes = 0;
+  for (size_t i = 0; i < use.size(); ++i) {
+    if (use[i] == detail::BufferUse::CONVERT) {
+      size_t size = model_table.buffers[i]->data.size();
+      bytes += size;
+      (size < (4 << 20) ? small : large).emplace_back(i);
+    }
+  }
+  auto convert = [&](uint32_t index, size_t slice_jobs) {
+    std::vector<uint8_t>& data = model_table.buffers[index]->data;
+    const size_t n = data.size() / sizeof(float);
+    std::vector<uint8_t> halves(n * sizeof(uint16_t));
+    float_to_half(reinterpret_cast<const float*>(data.data()),
+                  reinterpret_cast<uint16_t*>(halves.data()),
+                  n,
+                  slice_jobs);
+    data = std::move(halves);
+  };
+  parallel_for(small.size(), jobs, [&](size_t i) { convert(small[i], 1); });
+  for (uint32_t index : large) {
+    convert(index, jobs);
+  }
+
+  detail::insert_dequantize(
+      model_table, use, tflite::TensorType::FLOAT16, 3, "_fp16");
+  std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+  log_info("Converted {} float buffers ({} MB) to float16 in {:.3f} s "
+           "({:.2f} GB/s).",
+           small.size() + large.size(),
+           bytes >> 20,
+           elapsed.count(),
+           bytes / std::max(elapsed.count(), 1e-9) / 1e9);
+  return bytes / 2;
+}
+
+// Quantizes the FLOAT32 weights of CONV_2D, DEPTHWISE_CONV_2D and
+// FULLY_CONNECTED to symmetric INT8 with a scale per output channel, for
+// the hybrid kernels of those operators, the way the tflite converter's
+// dynamic range quantization does. Weights under `min_elements`, where the
+// hybrid kernels do not pay off, and buffers read by anything else stay
+// float. Buffers are quantized on `jobs` threads. Returns the bytes saved.
+size_t quantize_weights_to_int8(tflite::ModelT& model_table,
+                                size_t jobs,
+                                int64_t min_elements = 1024) {
+  std::chrono::steady_clock::time_point start =
+      std::chrono::steady_clock::now();
+  std::vector<detail::BufferUse> use =
+      detail::float_weight_buffers(model_table);
+
+  // a buffer qualifies if every read of it is the weights of a hybrid
+  // kernel, all with the same shape and axis
+  constexpr int32_t unread = -2;
+  std::vector<int32_t> axis(use.size(), unread);
+  std::vector<const tflite::TensorT*> weights(use.size(), nullptr);
+  for (const PtrType<tflite::SubGraphT>& subgraph : model_table.subgraphs) {
+    auto is_float = [&](const std::vector<int32_t>& indices) {
+      return !indices.empty() && indices[0] >= 0 &&
+             subgraph->tensors[indices[0]]->type ==
+                 tflite::TensorType::FLOAT32;
+    };
+    for (const PtrType<tflite::OperatorT>& op : subgraph->operators) {
+      const detail::HybridKernel kernel = detail::hybrid_kernel(
+          builtin_code(*model_table.operator_codes[op->opcode_index]));
+      for (size_t slot = 0; slot < op->inputs.size(); ++slot) {
+        if (op->inputs[slot] < 0) {
+          continue;
+        }
+        const tflite::TensorT& tensor = *subgraph->tensors[op->inputs[slot]];
+        const uint32_t buffer = tensor.buffer;
+        if (buffer >= use.size() || use[buffer] != detail::BufferUse::CONVERT) {
+          continue;
+        }
+        const bool hybrid =
+            kernel.version > 0 && slot == 1 && is_float(op->inputs) &&
+            is_float(op->outputs) &&
+            element_count(tensor.shape) >= min_elements &&
+            model_table.buffers[buffer]->data.size() ==
+                element_count(tensor.shape) * sizeof(float) &&
+            kernel.axis < static_cast<int32_t>(tensor.shape.size()) &&
+            (weights[buffer] == nullptr ||
+             (axis[buffer] == kernel.axis &&
+              weights[buffer]->shape == tensor.shape));
+        if (!hybrid) {
+          use[buffer] = detail::BufferUse::KEEP;
+          continue;
+        }
+        axis[buffer] = kernel.axis;
+        weights[buffer] = &tensor;
+      }
+    }
+  }
+
+  std::vector<uint32_t> buffers;
+  size_t bytes = 0;
+  for (size_t i = 0; i < use.size(); ++i) {
+    if (use[i] == detail::BufferUse::CONVERT && axis[i] != unread) {
+      buffers.emplace_back(i);
+      bytes += model_table.buffers[i]->data.size();
+    }
+  }
+  // largest first, so no thread is left with a big one at the end
+  std::ranges::sort(buffers, [&](uint32_t a, uint32_t b) {
+    return model_table.buffers[a]->data.size() >
+           model_table.buffers[b]->data.size();
+  });
+
+  std::vector<PtrType<tflite::QuantizationParametersT>> quantization(
+      use.size());
+  parallel_for(buffers.size(), jobs, [&](size_t index) {
+    const uint32_t buffer = buffers[index];
+    const std::vector<int32_t>& shape = weights[buffer]->shape;
+    size_t outer = 1, channels = 1, inner = 1;
+    for (int32_t d = 0; d < static_cast<int32_t>(shape.size()); ++d) {
+      if (d < axis[buffer]) {
+        outer *= shape[d];
+      } else if (d == axis[buffer]) {
+        channels = shape[d];
+      } else {
+        inner *= shape[d];
+      }
+    }
+    auto params = make_ptr<tflite::QuantizationParametersT>();
+    params->scale.resize(channels);
+    params->zero_point.assign(channels, 0);
+    params->quantized_dimension = std::max(axis[buffer], 0);
+
+    std::vector<uint8_t>& data = model_table.buffers[buffer]->data;
+    std::vector<uint8_t> quantized(outer * channels * inner);
+    quantize_int8(reinterpret_cast<const float*>(data.data()),
+                  reinterpret_cast<int8_t*>(quantized.data()),
+                  outer,
+                  channels,
+                  inner,
+                  params->scale.data());
+    data = std::move(quantized);
+    quantization[buffer] = std::move(params);
+  });
+
+  for (const PtrType<tflite::SubGraphT>& subgraph : model_table.subgraphs) {
+    for (const PtrType<tflite::TensorT>& tensor : subgraph->tensors) {
+      if (tensor->buffer < quantization.size() &&
+          quantization[tensor->buffer] != nullptr) {
+        tensor->type = tflite::TensorType::INT8;
+        tensor->quantization = quantization[tensor->buffer];
+      }
+    }
+  }
+  for (const PtrType<tflite::SubGraphT>& subgraph : model_table.subgraphs) {
+    for (const PtrType<tflite::OperatorT>& op : subgraph->operators) {
+      if (op->inputs.size() < 2 || op->inputs[1] < 0) {
+        continue;
+      }
+      const uint32_t buffer = subgraph->tensors[op->inputs[1]]->buffer;
+      if (buffer < quantization.size() && quantization[buffer] != nullptr) {
+        tflite::OperatorCodeT& code =
+            *model_table.operator_codes[op->opcode_index];
+        code.version = std::max(
+            code.version, detail::hybrid_kernel(builtin_code(code)).version);
+      }
+    }
+  }
+
+  std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+  log_info("Quantized {} weight buffers ({} MB) to int8 in {:.3f} s "
+           "({:.2f} GB/s).",
+           buffers.size(),
+           bytes >> 20,
+           elapsed.count(),
+           bytes / std::max(elapsed.count(), 1e-9) / 1e9);
+  return bytes - bytes / 4;
+}
@@ -0,0 +1,443 @@
+#pragma once
+
+#include <fcntl.h>            // open O_WRONLY O_CREAT O_TRUNC AT_FDCWD
+#include <linux/io_uring.h>   // io_uring_params io_uring_sqe io_uring_cqe
+#include <sys/eventfd.h>      // eventfd
+#include <sys/mman.h>         // mmap munmap
+#include <sys/syscall.h>      // __NR_io_uring_setup __NR_io_uring_enter
+#include <unistd.h>           // close pwrite write syscall
+
+#include <algorithm>           // std::max
+#include <atomic>              // std::atomic_ref
+#include <cerrno>              // errno EINTR
+#include <condition_variable>  // std::condition_variable
+#include <cstdint>             // uint8_t uint64_t uintptr_t
+#include <cstring>             // std::strerror
+#include <deque>               // std::deque
+#include <functional>          // std::function
+#include <mutex>               // std::mutex std::unique_lock
+#include <string>              // std::string
+#include <string_view>         // std::string_view
+#include <thread>              // std::jthread
+#include <vector>              // std::vector
+
+#include "def.h"
+#include "log.h"
+
+enum struct WriterKind { PWRITE, IO_URING };
+
+// Sink for finished output files. Implementations may complete a submission
+// on another thread, so `data` has to stay alive until `done` is invoked.
+class OutputWriter {
+ public:
+  using Callback = std::function<void()>;
+
+  virtual ~OutputWriter() = default;
+
+  virtual void submit(const fs::path& path,
+                      const uint8_t* data,
+                      size_t size,
+                      Callback done) = 0;
+
+  // Blocks until every submitted file is written and closed.
+  virtual void drain() = 0;
+
+  virtual std::string_view name() const = 0;
+};
+
+namespace detail {
+
+void write_file_sync(const fs::path& path, const uint8_t* data, size_t size) {
+  int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    log_fatal("Cannot open {}: {}.", path.string(), std::strerror(errno));
+  }
+  for (size_t written = 0; written < size;) {
+    ssize_t n = ::pwrite(fd, data + written, size - written, written);
+    if (n < 0 && errno != EINTR) {
+      log_fatal("Cannot write {}: {}.", path.string(), std::strerror(errno));
+    }
+    written += std::max<ssize_t>(n, 0);
+  }
+  ::close(fd);
+}
+
+}  // namespace detail
+
+class PwriteWriter : public OutputWriter {
+ public:
+  void submit(const fs::path& path,
+              const uint8_t* data,
+              size_t size,
+              Callback done) override {
+    detail::write_file_sync(path, data, size);
+    done();
+  }
+
+  void drain() override {}
+
+  std::string_view name() const override {
+    return "pwrite";
+  }
+};
+
+// Writes every file as one linked openat -> write... -> close chain on a
+// shared io_uring. Files are opened straight into registered (direct)
+// descriptor slots. io_uring requests belong to the task that submitted them,
+// so workers only enqueue files and ring the doorbell eventfd; a single ring
+// thread, which outlives them, submits everything queued with one
+// io_uring_enter and reaps the completions.
+class IoUringWriter : public OutputWriter {
+ public:
+  explicit IoUringWriter(unsigned queue_depth) {
+    io_uring_params params{};
+    ring_fd_ = static_cast<int>(
+        ::syscall(__NR_io_uring_setup, std::max(queue_depth, 4u), &params));
+    if (ring_fd_ < 0) {
+      log_warning("io_uring_setup failed: {}.", std::strerror(errno));
+      return;
+    }
+    const unsigned required_features = IORING_FEAT_SINGLE_MMAP |
+                                       IORING_FEAT_NODROP |
+                                       IORING_FEAT_LINKED_FILE;
+    if ((params.features & required_features) != required_features) {
+      log_warning("io_uring lacks linked direct descriptors (features {:#x}).",
+                  params.features);
+      return;
+    }
+
+    ring_size_ =
+        std::max(params.sq_off.array + params.sq_entries * sizeof(unsigned),
+                 params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe));
+    ring_ = ::mmap(nullptr,
+                   ring_size_,
+                   PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE,
+                   ring_fd_,
+                   IORING_OFF_SQ_RING);
+    sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+    void* sqes = ::mmap(nullptr,
+                        sqes_size_,
+                        PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE,
+                        ring_fd_,
+                        IORING_OFF_SQES);
+    if (ring_ == MAP_FAILED || sqes == MAP_FAILED) {
+      log_warning("Cannot map io_uring: {}.", std::strerror(errno));
+      return;
+    }
+    sqes_ = static_cast<io_uring_sqe*>(sqes);
+
+    char* ring = static_cast<char*>(ring_);
+    sq_tail_ = reinterpret_cast<unsigned*>(ring + params.sq_off.tail);
+    sq_mask_ = *reinterpret_cast<unsigned*>(ring + params.sq_off.ring_mask);
+    unsigned* sq_array =
+        reinterpret_cast<unsigned*>(ring + params.sq_off.array);
+    for (unsigned i = 0; i < params.sq_entries; ++i) {
+      sq_array[i] = i;
+    }
+    cq_head_ = reinterpret_cast<unsigned*>(ring + params.cq_off.head);
+    cq_tail_ = reinterpret_cast<unsigned*>(ring + params.cq_off.tail);
+    cq_mask_ = *reinterpret_cast<unsigned*>(ring + params.cq_off.ring_mask);
+    cqes_ = reinterpret_cast<io_uring_cqe*>(ring + params.cq_off.cqes);
+
+    std::vector<int> empty_slots(params.sq_entries, -1);
+    if (::syscall(__NR_io_uring_register,
+                  ring_fd_,
+                  IORING_REGISTER_FILES,
+                  empty_slots.data(),
+                  empty_slots.size()) != 0) {
+      log_warning("Cannot register io_uring files: {}.", std::strerror(errno));
+      return;
+    }
+    doorbell_fd_ = ::eventfd(0, EFD_CLOEXEC);
+    if (doorbell_fd_ < 0) {
+      log_warning("Cannot create eventfd: {}.", std::strerror(errno));
+      return;
+    }
+
+    // Every in-flight file owns one direct descriptor slot, and at most
+    // `cq_entries` completions may be outstanding at any time.
+    for (unsigned slot = 0; slot < params.sq_entries; ++slot) {
+      free_slots_.emplace_back(slot);
+    }
+    sq_entries_ = params.sq_entries;
+    free_completions_ = params.cq_entries - 1;
+
+    ring_thread_ = std::jthread([this]() { run(); });
+  }
+
+  IoUringWriter(const IoUringWriter&) = delete;
+  IoUringWriter& operator=(const IoUringWriter&) = delete;
+
+  ~IoUringWriter() override {
+    if (ring_thread_.joinable()) {
+      {
+        std::lock_guard lock(mutex_);
+        stopping_ = true;
+      }
+      ring_doorbell();
+      ring_thread_.join();
+    }
+    if (doorbell_fd_ >= 0) {
+      ::close(doorbell_fd_);
+    }
+    if (sqes_ != nullptr) {
+      ::munmap(sqes_, sqes_size_);
+    }
+    if (ring_ != MAP_FAILED) {
+      ::munmap(ring_, ring_size_);
+    }
+    if (ring_fd_ >= 0) {
+      ::close(ring_fd_);
+    }
+  }
+
+  bool valid() const {
+    return ring_thread_.joinable();
+  }
+
+  void submit(const fs::path& path,
+              const uint8_t* data,
+              size_t size,
+              Callback done) override {
+    const size_t chunks = std::max<size_t>(1, (size + kChunk - 1) / kChunk);
+    // the chain and the doorbell read have to fit the submission queue
+    if (chunks + 3 > sq_entries_) {
+      detail::write_file_sync(path, data, size);
+      done();
+      return;
+    }
+
+    Request* request = new Request{path.string(), data, size, std::move(done)};
+    request->completions = request->pending = static_cast<unsigned>(chunks + 2);
+    {
+      std::unique_lock lock(mutex_);
+      space_.wait(lock, [&]() { return queued_.size() < sq_entries_; });
+      queued_.emplace_back(request);
+      ++outstanding_;
+    }
+    ring_doorbell();
+  }
+
+  void drain() override {
+    std::unique_lock lock(mutex_);
+    idle_.wait(lock, [&]() { return outstanding_ == 0; });
+  }
+
+  std::string_view name() const override {
+    return "io_uring";
+  }
+
+ private:
+  struct Request {
+    std::string path;
+    const uint8_t* data;
+    size_t size;
+    Callback done;
+    unsigned slot = 0;
+    unsigned completions = 0;
+    unsigned pending = 0;
+    size_t written = 0;
+    int error = 0;
+  };
+
+  static constexpr size_t kChunk = size_t{1} << 30;
+  static constexpr uint64_t kOpenTag = 0, kWriteTag = 1, kCloseTag = 2,
+                            kTagMask = 3, kDoorbellTag = 0;
+
+  static uint64_t tag(Request* request, uint64_t kind) {
+    return reinterpret_cast<uintptr_t>(request) | kind;
+  }
+
+  void ring_doorbell() {
+    uint64_t one = 1;
+    while (::write(doorbell_fd_, &one, sizeof(one)) < 0 && errno == EINTR) {
+    }
+  }
+
+  io_uring_sqe* next_sqe() {
+    io_uring_sqe* sqe = &sqes_[sq_tail_local_++ & sq_mask_];
+    *sqe = io_uring_sqe{};
+    ++unsubmitted_;
+    return sqe;
+  }
+
+  void arm_doorbell() {
+    io_uring_sqe* sqe = next_sqe();
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = doorbell_fd_;
+    sqe->addr = reinterpret_cast<uint64_t>(&doorbell_value_);
+    sqe->len = sizeof(doorbell_value_);
+    sqe->user_data = kDoorbellTag;
+  }
+
+  // Moves queued files into the submission queue while descriptor slots,
+  // completion budget and submission entries last. One entry stays free for
+  // the doorbell read, which is armed whatever io_uring_enter left pending.
+  void prepare_queued() {
+    std::lock_guard lock(mutex_);
+    while (!queued_.empty()) {
+      Request* request = queued_.front();
+      if (free_slots_.empty() || free_completions_ < request->completions ||
+          unsubmitted_ + request->completions + 1 > sq_entries_) {
+        break;
+      }
+      queued_.pop_front();
+      request->slot = free_slots_.back();
+      free_slots_.pop_back();
+      free_completions_ -= request->completions;
+      prepare(request);
+    }
+    space_.notify_all();
+  }
+
+  void prepare(Request* request) {
+    io_uring_sqe* sqe = next_sqe();
+    sqe->opcode = IORING_OP_OPENAT;
+    sqe->flags = IOSQE_IO_HARDLINK;
+    sqe->fd = AT_FDCWD;
+    sqe->addr = reinterpret_cast<uint64_t>(request->path.c_str());
+    sqe->len = 0644;
+    sqe->open_flags = O_WRONLY | O_CREAT | O_TRUNC;
+    sqe->file_index = request->slot + 1;
+    sqe->user_data = tag(request, kOpenTag);
+
+    for (size_t offset = 0; offset < std::max<size_t>(request->size, 1);
+         offset += kChunk) {
+      sqe = next_sqe();
+      sqe->opcode = IORING_OP_WRITE;
+      sqe->flags = IOSQE_FIXED_FILE | IOSQE_IO_HARDLINK;
+      sqe->fd = static_cast<int>(request->slot);
+      sqe->addr = reinterpret_cast<uint64_t>(request->data + offset);
+      sqe->len =
+          static_cast<uint32_t>(std::min(kChunk, request->size - offset));
+      sqe->off = offset;
+      sqe->user_data = tag(request, kWriteTag);
+    }
+
+    sqe = next_sqe();
+    sqe->opcode = IORING_OP_CLOSE;
+    sqe->file_index = request->slot + 1;
+    sqe->user_data = tag(request, kCloseTag);
+  }
+
+  void run() {
+    arm_doorbell();
+    while (true) {
+      std::atomic_ref<unsigned>(*sq_tail_).store(sq_tail_local_,
+                                                 std::memory_order_release);
+      long submitted = ::syscall(__NR_io_uring_enter,
+                                 ring_fd_,
+                                 unsubmitted_,
+                                 1,
+                                 IORING_ENTER_GETEVENTS,
+                                 nullptr,
+                                 0);
+      if (submitted < 0) {
+        if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+          log_fatal("io_uring_enter failed: {}.", std::strerror(errno));
+        }
+        submitted = 0;
+      }
+      unsubmitted_ -= static_cast<unsigned>(submitted);
+
+      std::atomic_ref<unsigned> head_ref(*cq_head_);
+      unsigned head = head_ref.load(std::memory_order_relaxed);
+      unsigned tail =
+          std::atomic_ref<unsigned>(*cq_tail_).load(std::memory_order_acquire);
+      bool doorbell = false;
+      for (; head != tail; ++head) {
+        const io_uring_cqe& cqe = cqes_[head & cq_mask_];
+        if (cqe.user_data == kDoorbellTag) {
+          doorbell = true;
+        } else {
+          complete(reinterpret_cast<Request*>(cqe.user_data & ~kTagMask),
+                   cqe.user_data & kTagMask,
+                   cqe.res);
+        }
+      }
+      head_ref.store(head, std::memory_order_release);
+
+      if (doorbell) {
+        std::lock_guard lock(mutex_);
+        if (stopping_ && outstanding_ == 0) {
+          return;
+        }
+        arm_doorbell();
+      }
+      prepare_queued();
+    }
+  }
+
+  void complete(Request* request, uint64_t kind, int result) {
+    if (kind == kWriteTag && result > 0) {
+      request->written += static_cast<size_t>(result);
+    } else if (kind != kCloseTag && result < 0 && request->error == 0) {
+      request->error = -result;
+    }
+    if (--request->pending > 0) {
+      return;
+    }
+
+    if (request->error != 0 || request->written != request->size) {
+      log_warning("io_uring write of {} failed ({}), retrying with pwrite.",
+                  request->path,
+                  std::strerror(request->error));
+      detail::write_file_sync(request->path, request->data, request->size);
+    }
+    request->done();
+
+    bool last = false;
+    {
+      std::lock_guard lock(mutex_);
+      free_slots_.emplace_back(request->slot);
+      free_completions_ += request->completions;
+      last = --outstanding_ == 0 && stopping_;
+    }
+    idle_.notify_all();
+    delete request;
+    // a stop requested with files in flight consumed its doorbell early
+    if (last) {
+      ring_doorbell();
+    }
+  }
+
+  int ring_fd_ = -1;
+  int doorbell_fd_ = -1;
+  uint64_t doorbell_value_ = 0;
+  void* ring_ = MAP_FAILED;
+  size_t ring_size_ = 0;
+  io_uring_sqe* sqes_ = nullptr;
+  size_t sqes_size_ = 0;
+  unsigned* sq_tail_ = nullptr;
+  unsigned sq_tail_local_ = 0;
+  unsigned sq_mask_ = 0;
+  unsigned sq_entries_ = 0;
+  unsigned unsubmitted_ = 0;
+  unsigned* cq_head_ = nullptr;
+  unsigned* cq_tail_ = nullptr;
+  unsigned cq_mask_ = 0;
+  io_uring_cqe* cqes_ = nullptr;
+
+  std::mutex mutex_;
+  std::condition_variable space_;
+  std::condition_variable idle_;
+  std::deque<Request*> queued_;
+  std::vector<unsigned> free_slots_;
+  unsigned free_completions_ = 0;
+  size_t outstanding_ = 0;
+  bool stopping_ = false;
+  std::jthread ring_thread_;
+};
+
+PtrType<OutputWriter> make_writer(WriterKind kind, unsigned queue_depth) {
+  if (kind == WriterKind::IO_URING) {
+    PtrType<IoUringWriter> writer = make_ptr<IoUringWriter>(queue_depth);
+    if (writer->valid()) {
+      return writer;
+    }
+    log_warning("io_uring is unavailable, falling back to pwrite.");
+  }
+  return make_ptr<PwriteWriter>();
+}
@@ -0,0 +1,131 @@
+"""Checks the reference executor against the tflite interpreter.
+
+Folded and fused models are computed by the reference executor
+(include/executor.h), so before they are published this script checks that
+  1. the executor's output of the full model on an image matches the
+     interpreter's, with the image prepared as in src/test.py, and
+  2. the interpreter's output of the transformed model matches its output of
+     the original one.
+Only if both hold, and --output_root_folder is given, is the model split
+there with the same flags.
+
+Usage, from the repository root:
+  python3 src/check_executor.py [--model M] [--image I]
+      [--output_root_folder DIR] [-- split flags]
+The split flags default to --fold_constants --fuse_operators.
+"""
+
+import argparse
+import json
+import pathlib
+import subprocess
+import sys
+import tempfile
+
+import numpy as np
+import tensorflow as tf
+from PIL import Image
+
+
+def interpreter_outputs(model_path, image_path):
+    interpreter = tf.lite.Interpreter(model_path=str(model_path))
+    interpreter.allocate_tensors()
+    input_details = interpreter.get_input_details()
+    input_shape = input_details[0]['shape']
+
+    img = Image.open(image_path).convert('RGB')
+    img = img.resize((input_shape[2], input_shape[1]))
+    img_array = np.array(img, dtype=np.float32) / 255.0
+    img_tensor = np.repeat(np.expand_dims(img_array, axis=0),
+                           input_shape[0], axis=0)
+
+    interpreter.set_tensor(input_details[0]['index'], img_tensor)
+    interpreter.invoke()
+    return [interpreter.get_tensor(output['index'])
+            for output in interpreter.get_output_details()]
+
+
+def executor_outputs(binary, model_path, image_path, folder):
+    subprocess.run([binary, 'reference',
+                    '--input_file', str(model_path),
+                    '--image', str(image_path),
+                    '--output_root_folder', str(folder)], check=True)
+    with open(folder / (model_path.stem + '.reference.json')) as file:
+        reference = json.load(file)
+    return [np.array(output['values'], dtype=np.float32)
+            .reshape(output['shape']) for output in reference['outputs']]
+
+
+def compare(name, expected, actual, atol, rtol):
+    if len(expected) != len(actual):
+        print(f'{name}: {len(actual)} outputs, expected {len(expected)}')
+        return False
+    matched = True
+    for i, (want, got) in enumerate(zip(expected, actual)):
+        if want.shape != got.shape:
+            print(f'{name}: output {i} has shape {got.shape}, expected '
+                  f'{want.shape}')
+            matched = False
+            continue
+        error = np.max(np.abs(want.astype(np.float32) -
+                              got.astype(np.float32)), initial=0.0)
+        ok = np.allclose(got, want, atol=atol, rtol=rtol)
+        if want.ndim == 2:
+            ok = ok and np.array_equal(np.argmax(want, axis=1),
+                                       np.argmax(got, axis=1))
+        print(f'{name}: output {i} max abs error {error:.3g}, '
+              f'{"ok" if ok else "MISMATCH"}')
+        matched = matched and ok
+    return matched
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description='Check the reference executor and the models it '
+                    'transforms against the tflite interpreter.')
+    parser.add_argument('--binary', default='./build/split_tflite')
+    parser.add_argument('--model', default='./data/mobilenet_v2.tflite')
+    parser.add_argument('--image', default='./data/coffee.png')
+    parser.add_argument('--atol', type=float, default=1e-4)
+    parser.add_argument('--rtol', type=float, default=1e-3)
+    parser.add_argument('--output_root_folder',
+                        help='Split the model here once the checks pass')
+    parser.add_argument('split_flags', nargs='*',
+                        default=['--fold_constants', '--fuse_operators'])
+    args = parser.parse_args()
+    model = pathlib.Path(args.model)
+
+    expected = interpreter_outputs(model, args.image)
+    with tempfile.TemporaryDirectory() as scratch:
+        scratch = pathlib.Path(scratch)
+        matched = compare('executor', expected,
+                          executor_outputs(args.binary, model, args.image,
+                                           scratch),
+                          args.atol, args.rtol)
+
+        subprocess.run([args.binary,
+                        '--input_file', str(model),
+                        '--output_root_folder', str(scratch)] +
+                       args.split_flags, check=True)
+        transformed = scratch / model.stem / (model.stem + '.tflite')
+        if not transformed.exists():
+            print(f'{" ".join(args.split_flags)} wrote no transformed model')
+            return 1
+        matched = compare(' '.join(args.split_flags), expected,
+                          interpreter_outputs(transformed, args.image),
+                          args.atol, args.rtol) and matched
+
+    if not matched:
+        print('The reference executor disagrees with the interpreter, '
+              'nothing is published.')
+        return 1
+    if args.output_root_folder:
+        subprocess.run([args.binary,
+                        '--input_file', str(model),
+                        '--output_root_folder', args.output_root_folder] +
+                       args.split_flags, check=True)
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -1,28 +1,426 @@
+#include <chrono>
+#include <optional>
 #include <string>
 #include <string_view>
 #include <vector>
 
+#include "alloc_stats.h"
 #include "argparse.hpp"
+#include "batch.h"
+#include "calibration.h"
+#include "dedup.h"
+#include "export_graph.h"
+#include "fold.h"
 #include "fs.h"
+#include "fuse.h"
+#include "inspect.h"
+#include "reference.h"
+#include "shapes.h"
+#include "sparsity.h"
 #include "tflite_generated.hpp"
+#include "unpack.h"
+#include "verify.h"
+#include "weights.h"
 
 int main(int argc, char** argv) {
 
   const std::string_view input_flag = "--input_file";
   const std::string_view output_flag = "--output_root_folder";
+  const std::string_view jobs_flag = "--jobs";
+  const std::string_view writer_flag = "--writer";
+  const std::string_view queue_depth_flag = "--queue_depth";
+  const std::string_view trust_input_flag = "--trust_input";
+  const std::string_view fixture_input_flag = "--fixture_input";
+  const std::string_view unique_ops_flag = "--unique_ops";
+  const std::string_view split_blocks_flag = "--split_blocks";
+  const std::string_view collapse_blocks_flag = "--collapse_blocks";
+  const std::string_view weights_flag = "--weights";
+  const std::string_view infer_shapes_flag = "--infer_shapes";
+  const std::string_view batch_flag = "--batch";
+  const std::string_view fold_constants_flag = "--fold_constants";
+  const std::string_view fuse_operators_flag = "--fuse_operators";
+  const std::string_view calibration_dir_flag = "--calibration_dir";
+  const std::string_view bins_flag = "--bins";
+  const std::string_view sparse_weights_flag = "--sparse_weights";
+  const std::string_view merge_buffers_flag = "--merge_buffers";
+  const std::string_view weight_alignment_flag = "--weight_alignment";
+  const std::string_view image_flag = "--image";
 
   argparse::ArgumentParser parser("split_tflite");
-  parser.add_argument(input_flag)
-      .required()
-      .help("Input file of tflite format");
+  // not required here: subcommands take their own input
+  parser.add_argument(input_flag).help("Input file of tflite format");
   parser.add_argument(output_flag)
       .default_value(std::filesystem::current_path().string())
       .help("Root directory of output folder");
+  parser.add_argument(jobs_flag)
+      .default_value(default_jobs())
+      .scan<'u', size_t>()
+      .help("Number of threads splitting operators");
+  parser.add_argument(writer_flag)
+      .default_value(std::string("io_uring"))
+      .help("Output backend, io_uring or pwrite");
+  parser.add_argument(queue_depth_flag)
+      .default_value(64u)
+      .scan<'u', unsigned>()
+      .help("Submission queue depth of the io_uring writer");
+  parser.add_argument(trust_input_flag)
+      .default_value(false)
+      .implicit_value(true)
+      .help("Skip verification of the input model");
+  parser.add_argument(fixture_input_flag)
+      .default_value(std::string())
+      .help("PNG image to run the model on, writing the inputs every "
+            "operator sees next to it");
+  parser.add_argument(unique_ops_flag)
+      .default_value(false)
+      .implicit_value(true)
+      .help("Write one operator per distinct configuration and the map of "
+            "every operator to its configuration");
+  parser.add_argument(split_blocks_flag)
+      .default_value(false)
+      .implicit_value(true)
+      .help("Also write one model per repeated block of operators and the "
+            "map of blocks to operators");
+  parser.add_argument(weights_flag)
+      .default_value(std::string("fp32"))
+      .help("Storage of float weights, fp32, fp16 or int8; anything but fp32 "
+            "also writes the transformed model");
+  parser.add_argument(infer_shapes_flag)
+      .default_value(false)
+      .implicit_value(true)
+      .help("Derive the shapes of operator outputs the model leaves out from "
+            "its inputs and write the transformed model");
+  parser.add_argument(batch_flag)
+      .default_value(0u)
+      .scan<'u', unsigned>()
+      .help("Batch size to give the model inputs and activations, 0 to keep "
+            "it; anything else also writes the transformed model");
+  parser.add_argument(fold_constants_flag)
+      .default_value(false)
+      .implicit_value(true)
+      .help("Evaluate operators whose inputs are all constant ahead of time "
+            "and write the transformed model");
+  parser.add_argument(fuse_operators_flag)
+      .default_value(false)
+      .implicit_value(true)
+      .help("Fold batch normalization and RELU-family activations into the "
+            "operators before them and write the transformed model");
+  parser.add_argument(sparse_weights_flag)
+      .default_value(0.0)
+      .scan<'g', double>()
+      .help("Store fully connected float weights with at least this share "
+            "of zeros as sparse, 0 to keep them dense; anything else also "
+            "writes the transformed model");
+  parser.add_argument(merge_buffers_flag)
+      .default_value(false)
+      .implicit_value(true)
+      .help("Store byte-identical buffers once and write the transformed "
+            "model");
+  parser.add_argument(weight_alignment_flag)
+      .default_value(schema_alignment)
+      .scan<'u', size_t>()
+      .help("Alignment in bytes of buffers at least that large, a power of "
+            "two such as 4096, placed at the end of every written model; "
+            "anything over 16 also writes the full model");
+
+  argparse::ArgumentParser inspect_command("inspect");
+  inspect_command.add_description(
+      "Print the summary of a model without unpacking or splitting it");
+  inspect_command.add_argument(input_flag).help("Input file of tflite format");
+  inspect_command.add_argument(jobs_flag)
+      .default_value(default_jobs())
+      .scan<'u', size_t>()
+      .help("Number of threads verifying the model");
+  inspect_command.add_argument(trust_input_flag)
+      .default_value(false)
+      .implicit_value(true)
+      .help("Skip verification of the input model");
+  parser.add_subparser(inspect_command);
+
+  argparse::ArgumentParser export_command("export-graph");
+  export_command.add_description(
+      "Write the operator and tensor graph of a model as DOT and JSON");
+  export_command.add_argument(input_flag).help("Input file of tflite format");
+  export_command.add_argument(output_flag)
+      .default_value(std::filesystem::current_path().string())
+      .help("Directory receiving <model>.dot and <model>.graph.json");
+  export_command.add_argument(jobs_flag)
+      .default_value(default_jobs())
+      .scan<'u', size_t>()
+      .help("Number of threads verifying the model");
+  export_command.add_argument(trust_input_flag)
+      .default_value(false)
+      .implicit_value(true)
+      .help("Skip verification of the input model");
+  export_command.add_argument(collapse_blocks_flag)
+      .default_value(false)
+      .implicit_value(true)
+      .help("Draw repeated blocks once and every repetition as one node");
+  parser.add_subparser(export_command);
+
+  argparse::ArgumentParser calibrate_command("calibrate");
+  calibrate_command.add_description(
+      "Record the range and histogram of every float activation over a "
+      "folder of sample images");
+  calibrate_command.add_argument(input_flag)
+      .help("Input file of tflite format");
+  calibrate_command.add_argument(calibration_dir_flag)
+      .help("Folder of PNG images to run the model on");
+  calibrate_command.add_argument(output_flag)
+      .default_value(std::filesystem::current_path().string())
+      .help("Directory receiving <model>.calibration.json and "
+            "<model>.calibrated.tflite");
+  calibrate_command.add_argument(jobs_flag)
+      .default_value(default_jobs())
+      .scan<'u', size_t>()
+      .help("Number of threads running the samples");
+  calibrate_command.add_argument(trust_input_flag)
+      .default_value(false)
+      .implicit_value(true)
+      .help("Skip verification of the input model");
+  calibrate_command.add_argument(bins_flag)
+      .default_value(size_t{2048})
+      .scan<'u', size_t>()
+      .help("Histogram bins per tensor, a power of two");
+  parser.add_subparser(calibrate_command);
+
+  argparse::ArgumentParser sparsity_command("sparsity");
+  sparsity_command.add_description(
+      "Report the zeros, zero blocks and value distribution of every "
+      "constant buffer");
+  sparsity_command.add_argument(input_flag).help("Input file of tflite format");
+  sparsity_command.add_argument(output_flag)
+      .default_value(std::filesystem::current_path().string())
+      .help("Directory receiving <model>.sparsity.json");
+  sparsity_command.add_argument(jobs_flag)
+      .default_value(default_jobs())
+      .scan<'u', size_t>()
+      .help("Number of threads scanning the buffers");
+  sparsity_command.add_argument(trust_input_flag)
+      .default_value(false)
+      .implicit_value(true)
+      .help("Skip verification of the input model");
+  parser.add_subparser(sparsity_command);
+
+  argparse::ArgumentParser reference_command("reference");
+  reference_command.add_description(
+      "Run the model on an image on the reference executor and write its "
+      "outputs, for src/check_executor.py");
+  reference_command.add_argument(input_flag)
+      .help("Input file of tflite format");
+  reference_command.add_argument(image_flag)
+      .help("PNG image to run the model on, preprocessed as for "
+            "--fixture_input");
+  reference_command.add_argument(output_flag)
+      .default_value(std::filesystem::current_path().string())
+      .help("Directory receiving <model>.reference.json");
+  reference_command.add_argument(jobs_flag)
+      .default_value(default_jobs())
+      .scan<'u', size_t>()
+      .help("Number of threads verifying the model");
+  reference_command.add_argument(trust_input_flag)
+      .default_value(false)
+      .implicit_value(true)
+      .help("Skip verification of the input model");
+  parser.add_subparser(reference_command);
+
   std::vector<std::string> unknown_args = parser.parse_known_args(argc, argv);
   if (!unknown_args.empty()) {
     log_fatal("unknown args: [{}]", fmt::join(unknown_args, ", "));
   }
 
+  if (parser.is_subcommand_used(inspect_command)) {
+    if (!inspect_command.is_used(input_flag)) {
+      log_fatal("{} is required.", input_flag);
+    }
+    std::chrono::steady_clock::time_point start =
+        std::chrono::steady_clock::now();
+    MappedFile file(inspect_command.get<std::string>(input_flag));
+    if (!inspect_command.get<bool>(trust_input_flag) &&
+        !verify_model(
+            file.data(), file.size(), inspect_command.get<size_t>(jobs_flag))) {
+      log_error("{} is not a valid tflite model.", file.path().string());
+      return EXIT_FAILURE;
+    }
+    inspect_model(
+        tflite::GetModel(file.data()), file.path().stem().string(), stdout);
+    std::chrono::duration<double, std::milli> elapsed =
+        std::chrono::steady_clock::now() - start;
+    log_info(
+        "Inspected {} in {:.2f} ms.", file.path().string(), elapsed.count());
+    return EXIT_SUCCESS;
+  }
+  if (parser.is_subcommand_used(export_command)) {
+    if (!export_command.is_used(input_flag)) {
+      log_fatal("{} is required.", input_flag);
+    }
+    std::chrono::steady_clock::time_point start =
+        std::chrono::steady_clock::now();
+    MappedFile file(export_command.get<std::string>(input_flag));
+    if (!export_command.get<bool>(trust_input_flag) &&
+        !verify_model(
+            file.data(), file.size(), export_command.get<size_t>(jobs_flag))) {
+      log_error("{} is not a valid tflite model.", file.path().string());
+      return EXIT_FAILURE;
+    }
+    const tflite::Model* model = tflite::GetModel(file.data());
+
+    // blocks need the operator configurations, so only then is the model
+    // unpacked
+    std::optional<BlockCatalog> blocks;
+    if (export_command.get<bool>(collapse_blocks_flag)) {
+      ModelArena arena(file.size() / 8);
+      tflite::ModelT model_table;
+      unpack_model(model, model_table, arena);
+      blocks = find_repeated_blocks(model_table,
+                                    catalog_operators(model_table));
+    }
+    std::filesystem::path folder = export_command.get<std::string>(output_flag);
+    std::filesystem::create_directories(folder);
+    export_graph(model,
+                 file.path().stem().string(),
+                 folder,
+                 blocks ? &*blocks : nullptr);
+    std::chrono::duration<double, std::milli> elapsed =
+        std::chrono::steady_clock::now() - start;
+    log_info("Exported the graph of {} in {:.2f} ms.",
+             file.path().string(),
+             elapsed.count());
+    return EXIT_SUCCESS;
+  }
+  if (parser.is_subcommand_used(calibrate_command)) {
+    for (std::string_view flag : {input_flag, calibration_dir_flag}) {
+      if (!calibrate_command.is_used(flag)) {
+        log_fatal("{} is required.", flag);
+      }
+    }
+    size_t bins = calibrate_command.get<size_t>(bins_flag);
+    if (bins < 4 || (bins & (bins - 1)) != 0) {
+      log_fatal("{} must be a power of two of at least 4, got {}.",
+                bins_flag,
+                bins);
+    }
+    size_t jobs = calibrate_command.get<size_t>(jobs_flag);
+    std::chrono::steady_clock::time_point start =
+        std::chrono::steady_clock::now();
+    MappedFile file(calibrate_command.get<std::string>(input_flag));
+    if (!calibrate_command.get<bool>(trust_input_flag) &&
+        !verify_model(file.data(), file.size(), jobs)) {
+      log_error("{} is not a valid tflite model.", file.path().string());
+      return EXIT_FAILURE;
+    }
+    ModelArena arena(file.size() / 8);
+    tflite::ModelT model_table;
+    unpack_model(tflite::GetModel(file.data()), model_table, arena);
+
+    std::vector<std::filesystem::path> inputs = calibration_inputs(
+        calibrate_command.get<std::string>(calibration_dir_flag));
+    Calibration calibration = calibrate(model_table, inputs, bins, jobs);
+    if (calibration.samples == 0) {
+      log_error("No sample of {} could be run.",
+                calibrate_command.get<std::string>(calibration_dir_flag));
+      return EXIT_FAILURE;
+    }
+
+    std::filesystem::path folder =
+        calibrate_command.get<std::string>(output_flag);
+    std::filesystem::create_directories(folder);
+    std::string model_name = file.path().stem().string();
+    save_calibration(model_table, calibration, model_name, folder);
+    apply_calibration(model_table, calibration);
+    PtrType<OutputWriter> writer = make_writer(WriterKind::PWRITE, 0);
+    BuilderPool builders(1);
+    save_as_tflite(folder / (model_name + ".calibrated.tflite"),
+                   model_table,
+                   *writer,
+                   builders,
+                   file.size() + (1 << 20),
+                   WeightLayout());
+    writer->drain();
+    std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - start;
+    log_info("Calibrated {} tensors of {} on {} samples in {:.2f} s.",
+             calibration.tensors.size(),
+             file.path().string(),
+             calibration.samples,
+             elapsed.count());
+    return EXIT_SUCCESS;
+  }
+  if (parser.is_subcommand_used(sparsity_command)) {
+    if (!sparsity_command.is_used(input_flag)) {
+      log_fatal("{} is required.", input_flag);
+    }
+    size_t jobs = sparsity_command.get<size_t>(jobs_flag);
+    std::chrono::steady_clock::time_point start =
+        std::chrono::steady_clock::now();
+    MappedFile file(sparsity_command.get<std::string>(input_flag));
+    if (!sparsity_command.get<bool>(trust_input_flag) &&
+        !verify_model(file.data(), file.size(), jobs)) {
+      log_error("{} is not a valid tflite model.", file.path().string());
+      return EXIT_FAILURE;
+    }
+    const tflite::Model* model = tflite::GetModel(file.data());
+    std::vector<BufferSparsity> report = analyze_sparsity(model, jobs);
+    std::filesystem::path folder =
+        sparsity_command.get<std::string>(output_flag);
+    std::filesystem::create_directories(folder);
+    save_sparsity(model, report, file.path().stem().string(), folder);
+    uint64_t elements = 0, zeros = 0;
+    for (const BufferSparsity& stats : report) {
+      elements += stats.elements;
+      zeros += stats.zeros;
+    }
+    std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - start;
+    log_info("Scanned {} buffers ({} M values, {:.2f}% zeros) of {} in "
+             "{:.2f} s.",
+             report.size(),
+             elements / 1000000,
+             elements ? 100.0 * zeros / elements : 0.0,
+             file.path().string(),
+             elapsed.count());
+    return EXIT_SUCCESS;
+  }
+  if (parser.is_subcommand_used(reference_command)) {
+    for (std::string_view flag : {input_flag, image_flag}) {
+      if (!reference_command.is_used(flag)) {
+        log_fatal("{} is required.", flag);
+      }
+    }
+    std::chrono::steady_clock::time_point start =
+        std::chrono::steady_clock::now();
+    MappedFile file(reference_command.get<std::string>(input_flag));
+    if (!reference_command.get<bool>(trust_input_flag) &&
+        !verify_model(file.data(),
+                      file.size(),
+                      reference_command.get<size_t>(jobs_flag))) {
+      log_error("{} is not a valid tflite model.", file.path().string());
+      return EXIT_FAILURE;
+    }
+    ModelArena arena(file.size() / 8);
+    tflite::ModelT model_table;
+    unpack_model(tflite::GetModel(file.data()), model_table, arena);
+    std::filesystem::path folder =
+        reference_command.get<std::string>(output_flag);
+    std::filesystem::create_directories(folder);
+    if (!save_reference_outputs(model_table,
+                                file.path().stem(),
+                                folder,
+                                reference_command.get<std::string>(
+                                    image_flag))) {
+      return EXIT_FAILURE;
+    }
+    std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - start;
+    log_info("Ran {} on the reference executor in {:.2f} s.",
+             file.path().string(),
+             elapsed.count());
+    return EXIT_SUCCESS;
+  }
+  if (!parser.is_used(input_flag)) {
+    log_fatal("{} is required.", input_flag);
+  }
+
   log_warning("current path: {}", std::filesystem::current_path().string());
   std::filesystem::path file_path = parser.get<std::string>(input_flag);
   std::filesystem::path root_folder = parser.get<std::string>(output_flag);
@@ -33,20 +431,129 @@ int main(int argc, char** argv) {
                 root_folder.string());
   }
 
+  // every flag is checked before the model is read, so that a typo does not
+  // cost a transform pass
+  std::string weights = parser.get<std::string>(weights_flag);
+  if (weights != "fp32" && weights != "fp16" && weights != "int8") {
+    log_fatal("Unknown {}: {}, expect fp32, fp16 or int8.",
+              weights_flag,
+              weights);
+  }
+  WeightLayout layout{parser.get<size_t>(weight_alignment_flag)};
+  if (layout.alignment < schema_alignment ||
+      (layout.alignment & (layout.alignment - 1)) != 0) {
+    log_fatal("{} must be a power of two of at least {}, got {}.",
+              weight_alignment_flag,
+              schema_alignment,
+              layout.alignment);
+  }
+  std::string writer_name = parser.get<std::string>(writer_flag);
+  if (writer_name != "io_uring" && writer_name != "pwrite") {
+    log_fatal("Unknown {}: {}, expect io_uring or pwrite.",
+              writer_flag,
+              writer_name);
+  }
+  double sparse = parser.get<double>(sparse_weights_flag);
+  if (!(sparse >= 0.0 && sparse <= 1.0)) {
+    log_fatal("{} must be a share between 0 and 1, got {}.",
+              sparse_weights_flag,
+              sparse);
+  }
+  std::filesystem::path fixture_input =
+      parser.get<std::string>(fixture_input_flag);
+  if (!fixture_input.empty() &&
+      !std::filesystem::is_regular_file(fixture_input)) {
+    log_fatal("{} {} is not a file.",
+              fixture_input_flag,
+              fixture_input.string());
+  }
+
   auto [data, size] = read_binary_from_path(file_path);
 
   if (data == nullptr || size == 0) {
     return EXIT_FAILURE;
   }
 
+  size_t jobs = parser.get<size_t>(jobs_flag);
+  if (parser.get<bool>(trust_input_flag)) {
+    log_warning("{} is set, the input model is not verified.",
+                trust_input_flag);
+  } else if (!verify_model(
+                 reinterpret_cast<const uint8_t*>(data.get()), size, jobs)) {
+    log_error("{} is not a valid tflite model.", file_path.string());
+    return EXIT_FAILURE;
+  }
+
   tflite::Model* model = tflite::GetMutableModel(data.get());
 
+  // declared before the table so that it outlives the objects placed in it
+  ModelArena arena(size / 8);
   tflite::ModelT model_table;
-  model->UnPackTo(&model_table);
+  {
+#ifdef SPLIT_TFLITE_ALLOC_STATS
+    size_t allocations = allocation_count();
+#endif
+    std::chrono::steady_clock::time_point start =
+        std::chrono::steady_clock::now();
+    unpack_model(model, model_table, arena);
+    std::chrono::duration<double, std::milli> elapsed =
+        std::chrono::steady_clock::now() - start;
+    log_info("Unpacked model in {:.2f} ms.", elapsed.count());
+#ifdef SPLIT_TFLITE_ALLOC_STATS
+    log_info("Unpacking made {} allocations.",
+             allocation_count() - allocations);
+#endif
+  }
+
+  unsigned batch = parser.get<unsigned>(batch_flag);
+  if (batch > 0) {
+    set_batch(model_table, batch);
+  }
+  bool infer = parser.get<bool>(infer_shapes_flag);
+  if (infer) {
+    report_shapes(model_table, infer_shapes(model_table));
+  }
+  bool fold = parser.get<bool>(fold_constants_flag);
+  if (fold) {
+    fold_constants(model_table);
+  }
+  bool fuse = parser.get<bool>(fuse_operators_flag);
+  if (fuse) {
+    fuse_operators(model_table);
+  }
+  if (sparse > 0.0) {
+    sparsify_weights(model_table, sparse, jobs);
+  }
+  if (weights == "fp16") {
+    size_t saved = convert_weights_to_fp16(model_table, jobs);
+    log_info("Float16 weights save {} MB.", saved >> 20);
+  } else if (weights == "int8") {
+    size_t saved = quantize_weights_to_int8(model_table, jobs);
+    log_info("Int8 weights save {} MB.", saved >> 20);
+  }
+  bool merge = parser.get<bool>(merge_buffers_flag);
+  if (merge) {
+    merge_duplicate_buffers(model_table, jobs);
+  }
 
   std::filesystem::path model_name = file_path.stem();
 
-  save_operators(model_table, model_name, root_folder);
+  PtrType<OutputWriter> writer = make_writer(
+      writer_name == "pwrite" ? WriterKind::PWRITE : WriterKind::IO_URING,
+      parser.get<unsigned>(queue_depth_flag));
+
+  save_operators(model_table,
+                 model_name,
+                 root_folder,
+                 *writer,
+                 jobs,
+                 fixture_input,
+                 parser.get<bool>(unique_ops_flag),
+                 parser.get<bool>(split_blocks_flag),
+                 batch > 0 || infer || fold || fuse || sparse > 0.0 ||
+                     weights != "fp32" || merge ||
+                     layout.alignment > schema_alignment,
+                 layout);
 
   return EXIT_SUCCESS;
 }